@@ -0,0 +1,436 @@
+/*******************************************************************************
+* bench.c                                                                      *
+*                                                                              *
+* Description: This file contains a load generator for the Liso server. It    *
+*              opens N connections to a running lisod, keeps every one of      *
+*              them busy with a request mix for a fixed duration and prints   *
+*              throughput and latency percentiles as one JSON object, so      *
+*              runs can be compared by scripts. bench.sh drives it for        *
+*              'make bench'.                                                   *
+*                                                                              *
+* Usage:       ./lisod_bench [-c conns] [-d seconds] [-p pipeline] [-k 0|1]    *
+*              [-m mix] <host> <port>                                          *
+*              mix is one of small, large, head, post, 404, mixed              *
+* example:     ./lisod_bench -c 64 -d 5 -p 8 -m small 127.0.0.1 8080           *
+*******************************************************************************/
+
+#define _GNU_SOURCE   // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define BENCH_BUF 65536
+#define MAX_PIPELINE 64
+
+/* kinds of request a mix is made of, with the status each must get */
+enum { REQ_SMALL, REQ_LARGE, REQ_HEAD, REQ_POST, REQ_404, REQ_KINDS };
+
+static const struct
+{
+    const char *line;     // request line and headers, up to the blank line
+    const char *body;
+    int status;
+    int is_head;
+} kinds[REQ_KINDS] =
+{
+    {"GET /small.html HTTP/1.1\r\nHost: bench\r\n", "", 200, 0},
+    {"GET /large.bin HTTP/1.1\r\nHost: bench\r\n", "", 200, 0},
+    {"HEAD /small.html HTTP/1.1\r\nHost: bench\r\n", "", 200, 1},
+    {"POST /form HTTP/1.1\r\nHost: bench\r\nContent-Length: 11\r\n",
+     "name=liso&x", 204, 0},
+    {"GET /missing.html HTTP/1.1\r\nHost: bench\r\n", "", 404, 0},
+};
+
+static const struct
+{
+    const char *name;
+    int seq[REQ_KINDS];   // kinds cycled through by every connection
+    int len;
+} mixes[] =
+{
+    {"small", {REQ_SMALL}, 1},
+    {"large", {REQ_LARGE}, 1},
+    {"head",  {REQ_HEAD}, 1},
+    {"post",  {REQ_POST}, 1},
+    {"404",   {REQ_404}, 1},
+    {"mixed", {REQ_SMALL, REQ_HEAD, REQ_POST, REQ_404, REQ_LARGE}, 5},
+};
+
+/* this data structure wraps the state kept for one benchmark connection */
+typedef struct
+{
+    int fd;
+    int next;                   // position in the mix of the next request
+    int inflight;               // requests sent and not yet answered
+    int sent_kind[MAX_PIPELINE];
+    int head;                   // oldest request in sent_kind
+    double sent_at;             // time the current batch was written
+    long body_left;             // body bytes of the current response to skip
+    int in_body;
+    int closing;                // server announced Connection: close
+    int olen, ooff;             // unsent bytes of the current batch
+    char obuf[MAX_PIPELINE * 128];
+    int ilen;
+    char ibuf[BENCH_BUF];
+} bench_conn;
+
+static struct
+{
+    int conns;
+    int seconds;
+    int pipeline;
+    int keepalive;
+    int mix;
+    struct sockaddr_in addr;
+} opt = {16, 5, 1, 1, 0};
+
+static struct
+{
+    long requests;
+    long errors;
+    long connects;
+    long bytes;
+    long status[6];             // responses by status class, 1xx..5xx
+    unsigned int *lat;          // latency of every response in microseconds
+    long nlat, maxlat;
+} stats;
+
+static int epfd;
+
+/******************************************************************************
+* subroutine: now                                                             *
+* purpose:    monotonic time in seconds                                       *
+* parameters: none                                                            *
+* return:     the time                                                        *
+******************************************************************************/
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/******************************************************************************
+* subroutine: record                                                          *
+* purpose:    count one response and keep its latency                        *
+* parameters: us - latency in microseconds                                    *
+* return:     none                                                            *
+******************************************************************************/
+static void record(double us)
+{
+    if (stats.nlat == stats.maxlat)
+    {
+        stats.maxlat = stats.maxlat ? stats.maxlat * 2 : 1 << 16;
+        stats.lat = realloc(stats.lat, stats.maxlat * sizeof(unsigned int));
+    }
+    stats.lat[stats.nlat++] = (unsigned int)us;
+    stats.requests++;
+}
+
+/******************************************************************************
+* subroutine: conn_open                                                       *
+* purpose:    start a non-blocking connect and register it with epoll         *
+* parameters: c - the connection slot                                         *
+* return:     0 on success, -1 on failure                                     *
+******************************************************************************/
+static int conn_open(bench_conn *c)
+{
+    struct epoll_event ev;
+    int one = 1;
+
+    memset(c, 0, sizeof(*c));
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) return -1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(c->fd, (struct sockaddr *)&opt.addr, sizeof(opt.addr)) < 0 &&
+        errno != EINPROGRESS)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    stats.connects++;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: conn_batch                                                      *
+* purpose:    queue the next batch of pipelined requests of a connection      *
+* parameters: c - the connection                                              *
+* return:     none                                                            *
+******************************************************************************/
+static void conn_batch(bench_conn *c)
+{
+    int i, k;
+
+    c->olen = c->ooff = 0;
+    c->head = 0;
+    for (i = 0; i < opt.pipeline; i++)
+    {
+        k = mixes[opt.mix].seq[c->next++ % mixes[opt.mix].len];
+        c->sent_kind[i] = k;
+        c->olen += snprintf(c->obuf + c->olen, sizeof(c->obuf) - c->olen,
+                            "%s%s\r\n%s", kinds[k].line,
+                            opt.keepalive ? "" : "Connection: close\r\n",
+                            kinds[k].body);
+    }
+    c->inflight = opt.pipeline;
+    c->sent_at = now();
+}
+
+/******************************************************************************
+* subroutine: conn_write                                                      *
+* purpose:    write as much of the pending batch as the socket takes          *
+* parameters: c - the connection                                              *
+* return:     0 on success, -1 if the connection failed                      *
+******************************************************************************/
+static int conn_write(bench_conn *c)
+{
+    ssize_t n;
+
+    while (c->ooff < c->olen)
+    {
+        n = write(c->fd, c->obuf + c->ooff, c->olen - c->ooff);
+        if (n < 0)
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        c->ooff += n;
+    }
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: parse_head                                                      *
+* purpose:    parse the header block of a response at the front of ibuf      *
+* parameters: c - the connection                                              *
+* return:     length of the header block, 0 if incomplete, -1 if malformed    *
+******************************************************************************/
+static int parse_head(bench_conn *c)
+{
+    char *end, *line, *eol;
+    int  status, kind = c->sent_kind[c->head];
+
+    end = memmem(c->ibuf, c->ilen, "\r\n\r\n", 4);
+    if (end == NULL) return (c->ilen == BENCH_BUF) ? -1 : 0;
+
+    if (c->ilen < 12 || strncmp(c->ibuf, "HTTP/1.1 ", 9)) return -1;
+    status = atoi(c->ibuf + 9);
+    if (status < 100 || status > 599) return -1;
+    stats.status[status / 100]++;
+    if (status != kinds[kind].status) stats.errors++;
+
+    c->body_left = 0;
+    for (line = c->ibuf; line < end; line = eol + 2)
+    {
+        eol = memmem(line, end + 2 - line, "\r\n", 2);
+        if (!strncasecmp(line, "Content-Length:", 15))
+            c->body_left = strtol(line + 15, NULL, 10);
+        else if (!strncasecmp(line, "Connection: close", 17))
+            c->closing = 1;
+    }
+    if (kinds[kind].is_head || status == 204 || status == 304)
+        c->body_left = 0;
+
+    return end + 4 - c->ibuf;
+}
+
+/******************************************************************************
+* subroutine: conn_read                                                       *
+* purpose:    read and account the responses which arrived on a connection    *
+* parameters: c - the connection                                              *
+* return:     0 on success, 1 if the connection must be reopened, -1 on error *
+******************************************************************************/
+static int conn_read(bench_conn *c)
+{
+    ssize_t n;
+    int used;
+    long skip;
+
+    for (;;)
+    {
+        n = read(c->fd, c->ibuf + c->ilen, BENCH_BUF - c->ilen);
+        if (n == 0) return (c->inflight == 0 && c->closing) ? 1 : -1;
+        if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        c->ilen += n;
+        stats.bytes += n;
+
+        for (;;)
+        {
+            if (!c->in_body)
+            {
+                if (c->inflight == 0) return -1;  // response nobody asked for
+                if ((used = parse_head(c)) <= 0)
+                {
+                    if (used < 0) return -1;
+                    break;
+                }
+                memmove(c->ibuf, c->ibuf + used, c->ilen - used);
+                c->ilen -= used;
+                c->in_body = 1;
+            }
+
+            skip = (c->body_left < c->ilen) ? c->body_left : c->ilen;
+            memmove(c->ibuf, c->ibuf + skip, c->ilen - skip);
+            c->ilen -= skip;
+            c->body_left -= skip;
+            if (c->body_left > 0) break;
+
+            // one complete response
+            c->in_body = 0;
+            c->head++;
+            c->inflight--;
+            record((now() - c->sent_at) * 1e6);
+
+            if (c->inflight == 0)
+            {
+                if (c->closing || !opt.keepalive) return 1;
+                conn_batch(c);
+                if (conn_write(c) < 0) return -1;
+            }
+        }
+    }
+}
+
+/******************************************************************************
+* subroutine: cmp_uint                                                        *
+* purpose:    qsort comparator of latencies                                   *
+* parameters: a, b - the values                                               *
+* return:     <0, 0 or >0                                                     *
+******************************************************************************/
+static int cmp_uint(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return (x > y) - (x < y);
+}
+
+/******************************************************************************
+* subroutine: percentile                                                      *
+* purpose:    latency below which the given fraction of responses completed  *
+* parameters: q - the fraction, e.g. 0.99                                     *
+* return:     latency in microseconds                                         *
+******************************************************************************/
+static unsigned int percentile(double q)
+{
+    long i;
+
+    if (stats.nlat == 0) return 0;
+    i = (long)(q * stats.nlat);
+    if (i >= stats.nlat) i = stats.nlat - 1;
+    return stats.lat[i];
+}
+
+static void usage_exit()
+{
+    fprintf(stderr,
+            "Usage: ./lisod_bench [-c conns] [-d seconds] [-p pipeline] [-k 0|1] \n"
+            "       [-m mix] <host> <port> \n"
+            "    -c conns    - concurrent connections (default 16) \n"
+            "    -d seconds  - duration of the run (default 5) \n"
+            "    -p pipeline - requests sent per batch on a connection (default 1) \n"
+            "    -k 0|1      - keep connections alive (default 1) or reconnect \n"
+            "                  after every response \n"
+            "    -m mix      - small, large, head, post, 404 or mixed \n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int i, n, ch, ret;
+    double start, elapsed;
+    bench_conn *conns, *c;
+    struct epoll_event events[256];
+
+    while ((ch = getopt(argc, argv, "c:d:p:k:m:")) != -1)
+    {
+        switch (ch)
+        {
+            case 'c': opt.conns = atoi(optarg); break;
+            case 'd': opt.seconds = atoi(optarg); break;
+            case 'p': opt.pipeline = atoi(optarg); break;
+            case 'k': opt.keepalive = atoi(optarg); break;
+            case 'm':
+                for (opt.mix = 0; opt.mix < sizeof(mixes) / sizeof(mixes[0]);
+                     opt.mix++)
+                    if (!strcmp(optarg, mixes[opt.mix].name)) break;
+                if (opt.mix == sizeof(mixes) / sizeof(mixes[0])) usage_exit();
+                break;
+            default:
+                usage_exit();
+        }
+    }
+    if (argc - optind != 2 || opt.conns < 1 || opt.seconds < 1 ||
+        opt.pipeline < 1 || opt.pipeline > MAX_PIPELINE)
+        usage_exit();
+    if (!opt.keepalive) opt.pipeline = 1;  // the server closes after one
+
+    opt.addr.sin_family = AF_INET;
+    opt.addr.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, argv[optind], &opt.addr.sin_addr) != 1)
+        usage_exit();
+
+    epfd = epoll_create1(0);
+    conns = calloc(opt.conns, sizeof(bench_conn));
+    for (i = 0; i < opt.conns; i++)
+    {
+        if (conn_open(&conns[i]) < 0)
+        {
+            fprintf(stderr, "Error: connect failed: %s \n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        conn_batch(&conns[i]);
+    }
+
+    start = now();
+    while ((elapsed = now() - start) < opt.seconds)
+    {
+        n = epoll_wait(epfd, events, 256, 100);
+        for (i = 0; i < n; i++)
+        {
+            c = events[i].data.ptr;
+            ret = 0;
+            if (events[i].events & EPOLLOUT) ret = conn_write(c);
+            if (ret == 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                ret = conn_read(c);
+            if (ret == 0) continue;
+
+            // reconnect after Connection: close, count anything else as error
+            if (ret < 0) stats.errors++;
+            close(c->fd);
+            if (conn_open(c) < 0) continue;
+            conn_batch(c);
+        }
+    }
+
+    qsort(stats.lat, stats.nlat, sizeof(unsigned int), cmp_uint);
+    printf("{\"mix\": \"%s\", \"connections\": %d, \"pipeline\": %d, "
+           "\"keepalive\": %d, \"duration_s\": %.3f, \"requests\": %ld, "
+           "\"errors\": %ld, \"connects\": %ld, \"rps\": %.1f, "
+           "\"mb_per_s\": %.2f, "
+           "\"status\": {\"2xx\": %ld, \"3xx\": %ld, \"4xx\": %ld, \"5xx\": %ld}, "
+           "\"latency_us\": {\"p50\": %u, \"p99\": %u, \"p999\": %u, "
+           "\"max\": %u}}\n",
+           mixes[opt.mix].name, opt.conns, opt.pipeline, opt.keepalive,
+           elapsed, stats.requests, stats.errors, stats.connects,
+           stats.requests / elapsed, stats.bytes / elapsed / 1e6,
+           stats.status[2], stats.status[3], stats.status[4], stats.status[5],
+           percentile(0.50), percentile(0.99), percentile(0.999),
+           stats.nlat ? stats.lat[stats.nlat - 1] : 0);
+
+    return (stats.requests > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+################################################################################
+# bench.sh                                                                     #
+#                                                                              #
+# Description: This script runs the load benchmark of the Liso server. It      #
+#              starts ./lisod on a scratch www tree, runs ./lisod_bench once   #
+#              per request mix and prints the results as a JSON array. It is  #
+#              run by 'make bench'. Settings come from the environment:        #
+#                  BENCH_PORT (9080)  BENCH_CONNS (64)  BENCH_SECONDS (5)      #
+#                  BENCH_PIPELINE (16)  BENCH_WORKERS (0)                      #
+#                                                                              #
+################################################################################
+PORT=${BENCH_PORT:-9080}
+CONNS=${BENCH_CONNS:-64}
+SECS=${BENCH_SECONDS:-5}
+PIPE=${BENCH_PIPELINE:-16}
+WORKERS=${BENCH_WORKERS:-0}
+
+DIR=$(mktemp -d /tmp/lisod_bench.XXXXXX) || exit 1
+mkdir -p "$DIR/www" "$DIR/cgi"
+head -c 1024 /dev/zero | tr '\0' 'x' > "$DIR/www/small.html"
+head -c 1048576 /dev/urandom > "$DIR/www/large.bin"
+
+./lisod --workers "$WORKERS" --log-level warn "$PORT" $((PORT + 1)) \
+    "$DIR/lisod.log" "$DIR/lisod.lock" "$DIR/www" "$DIR/cgi" \
+    "$DIR/key.pem" "$DIR/cert.pem" || exit 1
+sleep 1
+
+# name:arguments of every run
+RUNS="small:-m_small
+small_closed:-m_small_-k_0
+small_pipelined:-m_small_-p_$PIPE
+large:-m_large
+head:-m_head
+post:-m_post
+404:-m_404
+mixed_pipelined:-m_mixed_-p_$PIPE"
+
+STATUS=0
+SEP="["
+for run in $RUNS; do
+    name=${run%%:*}
+    args=$(echo "${run#*:}" | tr '_' ' ')
+    out=$(./lisod_bench -c "$CONNS" -d "$SECS" $args 127.0.0.1 "$PORT") || STATUS=1
+    printf '%s\n  {"run": "%s", %s' "$SEP" "$name" "${out#\{}"
+    SEP=","
+done
+printf '\n]\n'
+
+kill "$(cat "$DIR/lisod.lock")" 2>/dev/null
+sleep 1
+rm -rf "$DIR"
+exit $STATUS
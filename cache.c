@@ -0,0 +1,626 @@
+/*
+ * cache.c
+ *
+ * Description: This file defines an in-memory cache for small static files
+ *              of the Liso server. Entries are keyed by the resolved path,
+ *              evicted in LRU order when the cache grows past its bounds,
+ *              and invalidated through inotify when the file changes, so a
+ *              hot file is served without any filesystem syscall.
+ *
+ */
+#include "cache.h"
+
+#define CACHE_BUCKETS 4096  // power of two
+
+static cache_entry *buckets[CACHE_BUCKETS];
+static cache_entry *lru_head;   // most recently used
+static cache_entry *lru_tail;   // least recently used
+static size_t cache_bytes;
+static size_t cache_max_bytes;
+static int    cache_entries;
+static int    cache_max_entries;
+static int    ino_fd = -1;
+static char **wd_dirs;          // watched directory of each watch descriptor
+static int    wd_size;
+
+/******************************************************************************
+* subroutine: hash_path                                                       *
+* purpose:    FNV-1a hash of a path                                           *
+* parameters: path - the path to hash                                         *
+* return:     the hash value                                                  *
+******************************************************************************/
+static unsigned int hash_path(const char *path)
+{
+    unsigned int h = 2166136261u;
+
+    while (*path)
+    {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/******************************************************************************
+* subroutine: file_etag                                                       *
+* purpose:    make the entity tag of a file from its inode, size and mtime,   *
+*             so every worker, cached or not, gives a file the same tag and   *
+*             any change to it gives a new one                                *
+* parameters: sbuf - stat result of the file                                  *
+* return:     the tag                                                         *
+******************************************************************************/
+uint64_t file_etag(struct stat *sbuf)
+{
+    uint64_t h = (uint64_t)sbuf->st_ino;
+
+    // splitmix64 steps over the fields, so close values spread apart
+    h = (h ^ (uint64_t)sbuf->st_size) * 0x9e3779b97f4a7c15ull;
+    h = (h ^ (h >> 31) ^ (uint64_t)sbuf->st_mtim.tv_sec) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27) ^ (uint64_t)sbuf->st_mtim.tv_nsec) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+/******************************************************************************
+* subroutine: etag_format                                                     *
+* purpose:    write an entity tag as it appears in a header, with its quotes  *
+* parameters: etag - the tag                                                  *
+*             buf  - a buffer of at least ETAG_LEN + 1 bytes                  *
+* return:     ETAG_LEN                                                        *
+******************************************************************************/
+int etag_format(uint64_t etag, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    buf[0] = '"';
+    for (i = 16; i > 0; i--, etag >>= 4)
+        buf[i] = hex[etag & 15];
+    buf[17] = '"';
+    buf[18] = '\0';
+    return ETAG_LEN;
+}
+
+/******************************************************************************
+* subroutine: lru_unlink                                                      *
+* purpose:    take an entry out of the LRU list                               *
+* parameters: e - the entry                                                   *
+* return:     none                                                            *
+******************************************************************************/
+static void lru_unlink(cache_entry *e)
+{
+    if (e->prev) e->prev->next = e->next; else lru_head = e->next;
+    if (e->next) e->next->prev = e->prev; else lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+/******************************************************************************
+* subroutine: lru_push                                                        *
+* purpose:    make an entry the most recently used one                        *
+* parameters: e - the entry                                                   *
+* return:     none                                                            *
+******************************************************************************/
+static void lru_push(cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head) lru_head->prev = e; else lru_tail = e;
+    lru_head = e;
+}
+
+/******************************************************************************
+* subroutine: cache_free                                                      *
+* purpose:    release the memory of an entry                                  *
+* parameters: e - the entry                                                   *
+* return:     none                                                            *
+******************************************************************************/
+static void cache_free(cache_entry *e)
+{
+    free(e->path);
+    free(e->header);
+    free(e->data);
+    free(e);
+}
+
+/******************************************************************************
+* subroutine: cache_remove                                                    *
+* purpose:    unlink an entry from its bucket and the LRU list and free it.   *
+*             An entry still referenced by a response is freed on release     *
+* parameters: e - the entry                                                   *
+* return:     none                                                            *
+******************************************************************************/
+static void cache_remove(cache_entry *e)
+{
+    cache_entry **pp = &buckets[e->hash & (CACHE_BUCKETS - 1)];
+
+    int enc;
+
+    while (*pp != e) pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    lru_unlink(e);
+
+    cache_bytes -= e->size;
+    cache_entries--;
+
+    // the compressed copies are of this version of the file only
+    for (enc = ENC_BR; enc < ENC_TYPES; enc++)
+    {
+        if (e->variant[enc] == NULL) continue;
+        cache_bytes -= e->variant[enc]->size;
+        if (e->variant[enc]->refcnt > 0)
+            e->variant[enc]->dead = 1;
+        else
+            cache_free(e->variant[enc]);
+        e->variant[enc] = NULL;
+    }
+
+    if (e->refcnt > 0)
+        e->dead = 1;
+    else
+        cache_free(e);
+}
+
+/******************************************************************************
+* subroutine: cache_hold                                                      *
+* purpose:    keep an entry alive while a response still points into it       *
+* parameters: e - the entry                                                   *
+* return:     none                                                            *
+******************************************************************************/
+void cache_hold(cache_entry *e)
+{
+    e->refcnt++;
+}
+
+/******************************************************************************
+* subroutine: cache_release                                                   *
+* purpose:    drop a reference taken by cache_hold                            *
+* parameters: e - the entry                                                   *
+* return:     none                                                            *
+******************************************************************************/
+void cache_release(cache_entry *e)
+{
+    if (--e->refcnt == 0 && e->dead) cache_free(e);
+}
+
+/******************************************************************************
+* subroutine: cache_wrap                                                      *
+* purpose:    wrap a malloc'ed buffer in an entry which is not in the cache,  *
+*             so a response can reference it like a cached body. The entry   *
+*             and buffer are freed when the last reference is released       *
+* parameters: data - the buffer, owned by the entry from now on               *
+*             size - the number of bytes in data                              *
+* return:     the entry, NULL if out of memory (data stays the caller's)     *
+******************************************************************************/
+cache_entry *cache_wrap(char *data, size_t size)
+{
+    cache_entry *e = (cache_entry *)calloc(1, sizeof(cache_entry));
+
+    if (e == NULL) return NULL;
+    e->data = data;
+    e->size = size;
+    e->dead = 1;
+    return e;
+}
+
+/******************************************************************************
+* subroutine: watch_dir                                                       *
+* purpose:    watch the directory containing path for changes                 *
+* parameters: path - a file path                                              *
+* return:     the watch descriptor, -1 on failure                             *
+******************************************************************************/
+static int watch_dir(const char *path)
+{
+    int  wd, n;
+    char dir[MAX_PATH];
+    char **dirs;
+    const char *slash = strrchr(path, '/');
+
+    if (ino_fd < 0 || slash == NULL || slash - path >= MAX_PATH) return -1;
+
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+
+    // the www index may watch the directory too, with more events
+    wd = inotify_add_watch(ino_fd, dir[0] ? dir : "/",
+                           IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE |
+                           IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+                           IN_MOVE_SELF | IN_MASK_ADD);
+    if (wd < 0) return -1;
+
+    if (wd >= wd_size)
+    {
+        n = (wd + 1) * 2;
+        if ((dirs = (char **)realloc(wd_dirs, n * sizeof(char *))) == NULL)
+            return -1;
+        wd_dirs = dirs;
+        memset(wd_dirs + wd_size, 0, (n - wd_size) * sizeof(char *));
+        wd_size = n;
+    }
+    if (wd_dirs[wd] == NULL && (wd_dirs[wd] = strdup(dir)) == NULL) return -1;
+    return wd;
+}
+
+/******************************************************************************
+* subroutine: cache_init                                                      *
+* purpose:    set the bounds of the cache and the inotify instance it        *
+*             watches directories with                                        *
+* parameters: max_bytes   - maximum total size of cached file content         *
+*             max_entries - maximum number of cached files                    *
+*             fd          - the inotify instance, shared with the www index   *
+* return:     0 on success, -1 if the cache is disabled                       *
+******************************************************************************/
+int cache_init(size_t max_bytes, int max_entries, int fd)
+{
+    cache_max_bytes = max_bytes;
+    cache_max_entries = max_entries;
+    ino_fd = fd;
+
+    // without notifications we could serve stale content, so cache nothing
+    if (ino_fd < 0)
+    {
+        Log(LOG_ERROR, "Error: no inotify instance, file cache disabled \n");
+        cache_max_entries = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cache_lookup                                                    *
+* purpose:    find the entry of a path and mark it recently used              *
+* parameters: path - resolved filesystem path                                 *
+* return:     the entry, NULL if path is not cached                           *
+******************************************************************************/
+cache_entry *cache_lookup(const char *path)
+{
+    unsigned int h = hash_path(path);
+    cache_entry *e;
+
+    for (e = buckets[h & (CACHE_BUCKETS - 1)]; e; e = e->hnext)
+    {
+        if (e->hash == h && !strcmp(e->path, path))
+        {
+            if (e != lru_head)
+            {
+                lru_unlink(e);
+                lru_push(e);
+            }
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/******************************************************************************
+* subroutine: load_file                                                       *
+* purpose:    read a whole file into memory                                   *
+* parameters: fd   - the open file                                            *
+*             size - its size                                                 *
+* return:     the content, malloc'ed, or NULL if it can't be read in full     *
+******************************************************************************/
+static char *load_file(int fd, size_t size)
+{
+    char *data = (char *)malloc(size ? size : 1);
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < size)
+    {
+        n = read(fd, data + off, size - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += n;
+    }
+
+    if (off != size)
+    {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/******************************************************************************
+* subroutine: cache_header                                                    *
+* purpose:    render the header lines of an entry which depend only on it     *
+* parameters: e - the entry, with its size, type, coding and validators set   *
+* return:     0 on success, -1 if out of memory                               *
+******************************************************************************/
+static int cache_header(cache_entry *e)
+{
+    struct tm tm;
+    char tbuf[MIN_LINE], hbuf[BUF_SIZE];
+    int len;
+
+    tm = *gmtime(&e->mtime);
+    strftime(tbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+    len = snprintf(hbuf, BUF_SIZE,
+                   "Content-Length: %ld\r\n"
+                   "Content-Type: %s\r\n"
+                   "Last-Modified: %s\r\n"
+                   "ETag: ",
+                   (long)e->size, e->type, tbuf);
+    len += etag_format(e->etag, hbuf + len);
+    len += snprintf(hbuf + len, BUF_SIZE - len, "\r\nAccept-Ranges: bytes\r\n");
+    if (e->encoding != ENC_IDENTITY)
+        len += snprintf(hbuf + len, BUF_SIZE - len, "Content-Encoding: %s\r\n",
+                        encode_name(e->encoding));
+    if (encode_compressible(e->type))
+        len += snprintf(hbuf + len, BUF_SIZE - len, "Vary: Accept-Encoding\r\n");
+    if ((e->header = strdup(hbuf)) == NULL) return -1;
+    e->header_len = len;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cache_insert                                                    *
+* purpose:    load a small regular file into the cache, evicting the least    *
+*             recently used entries to stay within the bounds                 *
+* parameters: path     - resolved filesystem path                             *
+*             sbuf     - stat result of path                                  *
+*             filetype - the MIME type of the file, from mime_type            *
+* return:     the new entry, NULL if the file is not cacheable                *
+******************************************************************************/
+cache_entry *cache_insert(const char *path, struct stat *sbuf,
+                          const char *filetype)
+{
+    int fd, wd;
+    struct stat fbuf;
+    cache_entry *e;
+
+    if (cache_max_entries <= 0 || !S_ISREG(sbuf->st_mode) ||
+        sbuf->st_size > CACHE_MAX_FILE ||
+        (size_t)sbuf->st_size > cache_max_bytes)
+        return NULL;
+
+    // watch before reading, so a change made while loading is not missed
+    if ((wd = watch_dir(path)) < 0) return NULL;
+
+    if ((fd = open(path, O_RDONLY, 0)) < 0) return NULL;
+    if (fstat(fd, &fbuf) < 0 || fbuf.st_size != sbuf->st_size)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // out of memory is not an error, the file is served from disk
+    if ((e = (cache_entry *)calloc(1, sizeof(cache_entry))) == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    e->data = load_file(fd, fbuf.st_size);
+    close(fd);
+    if (e->data == NULL)
+    {
+        free(e);
+        return NULL;
+    }
+
+    e->size = fbuf.st_size;
+    e->type = filetype;
+    e->etag = file_etag(&fbuf);
+    e->mtime = fbuf.st_mtime;
+    e->wd = wd;
+    if (cache_header(e) < 0 || (e->path = strdup(path)) == NULL)
+    {
+        cache_free(e);
+        return NULL;
+    }
+    e->hash = hash_path(path);
+
+    // replace an older copy, then make room
+    cache_invalidate(path);
+    while (lru_tail && (cache_entries >= cache_max_entries ||
+                        cache_bytes + e->size > cache_max_bytes))
+        cache_remove(lru_tail);
+
+    e->hnext = buckets[e->hash & (CACHE_BUCKETS - 1)];
+    buckets[e->hash & (CACHE_BUCKETS - 1)] = e;
+    lru_push(e);
+    cache_bytes += e->size;
+    cache_entries++;
+
+    return e;
+}
+
+/******************************************************************************
+* subroutine: make_variant                                                    *
+* purpose:    make a compressed copy of a cached file: from its precompressed *
+*             sibling (path.br, path.gz) when there is one no older than the  *
+*             file, else by compressing it. A copy no smaller than the file   *
+*             is not kept                                                     *
+* parameters: parent - the entry of the file                                  *
+*             enc    - the coding                                             *
+* return:     the copy, NULL if there is none worth sending                   *
+******************************************************************************/
+static cache_entry *make_variant(cache_entry *parent, int enc)
+{
+    int fd;
+    struct stat sbuf;
+    char path[MAX_PATH];
+    char *data = NULL;
+    size_t size = 0;
+    uint64_t etag = 0;
+    cache_entry *v;
+
+    if (snprintf(path, MAX_PATH, "%s%s", parent->path, encode_suffix(enc)) < MAX_PATH &&
+        (fd = open(path, O_RDONLY, 0)) >= 0)
+    {
+        if (fstat(fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode) &&
+            sbuf.st_mtime >= parent->mtime && sbuf.st_size <= CACHE_MAX_FILE &&
+            (data = load_file(fd, sbuf.st_size)) != NULL)
+        {
+            size = sbuf.st_size;
+            etag = file_etag(&sbuf);
+        }
+        close(fd);
+    }
+    if (data == NULL && (data = encode_buf(enc, parent->data, parent->size, &size)))
+        etag = parent->etag + enc;  // another representation, another tag
+
+    if (data && size >= parent->size)
+    {
+        free(data);
+        data = NULL;
+    }
+    if (data == NULL) return NULL;
+
+    // make room among the other files; if that's not enough, do without
+    while (lru_tail && lru_tail != parent && cache_bytes + size > cache_max_bytes)
+        cache_remove(lru_tail);
+    if (cache_bytes + size > cache_max_bytes)
+    {
+        free(data);
+        return NULL;
+    }
+
+    if ((v = (cache_entry *)calloc(1, sizeof(cache_entry))) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    v->data = data;
+    v->size = size;
+    v->type = parent->type;
+    v->encoding = enc;
+    v->etag = etag;
+    v->mtime = parent->mtime;
+    v->wd = parent->wd;
+    if (cache_header(v) < 0)
+    {
+        cache_free(v);
+        return NULL;
+    }
+    cache_bytes += size;
+    return v;
+}
+
+/******************************************************************************
+* subroutine: cache_variant                                                   *
+* purpose:    find the smallest compressed copy of a text file which a client *
+*             takes, making each copy the first time its coding is asked for  *
+* parameters: e      - the entry of the file                                  *
+*             accept - the codings the client takes, ENC_MASK bits            *
+* return:     the copy, NULL if the file is to be sent as it is               *
+******************************************************************************/
+cache_entry *cache_variant(cache_entry *e, int accept)
+{
+    int enc;
+    cache_entry *best = NULL;
+
+    if (!encode_compressible(e->type)) return NULL;
+
+    for (enc = ENC_BR; enc < ENC_TYPES; enc++)
+    {
+        if (!(accept & ENC_MASK(enc))) continue;
+        if (!(e->tried & ENC_MASK(enc)))
+        {
+            e->tried |= ENC_MASK(enc);
+            e->variant[enc] = make_variant(e, enc);
+        }
+        if (e->variant[enc] && (best == NULL || e->variant[enc]->size < best->size))
+            best = e->variant[enc];
+    }
+    return best;
+}
+
+/******************************************************************************
+* subroutine: cache_invalidate                                                *
+* purpose:    drop the entry of a path if it is cached                        *
+* parameters: path - resolved filesystem path                                 *
+* return:     none                                                            *
+******************************************************************************/
+void cache_invalidate(const char *path)
+{
+    unsigned int h = hash_path(path);
+    cache_entry *e;
+
+    for (e = buckets[h & (CACHE_BUCKETS - 1)]; e; e = e->hnext)
+    {
+        if (e->hash == h && !strcmp(e->path, path))
+        {
+            cache_remove(e);
+            return;
+        }
+    }
+}
+
+/******************************************************************************
+* subroutine: cache_flush                                                     *
+* purpose:    drop every entry                                                *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void cache_flush()
+{
+    while (lru_tail) cache_remove(lru_tail);
+}
+
+/******************************************************************************
+* subroutine: cache_drop_dir                                                  *
+* purpose:    drop every entry living in a watched directory                  *
+* parameters: wd - the watch descriptor of the directory                      *
+* return:     none                                                            *
+******************************************************************************/
+static void cache_drop_dir(int wd)
+{
+    cache_entry *e, *next;
+
+    for (e = lru_head; e; e = next)
+    {
+        next = e->next;
+        if (e->wd == wd) cache_remove(e);
+    }
+}
+
+/******************************************************************************
+* subroutine: cache_event                                                     *
+* purpose:    invalidate the entries of the files an inotify event names.    *
+*             Events of watches the cache did not ask for are ignored         *
+* parameters: ev - the event                                                  *
+* return:     none                                                            *
+******************************************************************************/
+void cache_event(const struct inotify_event *ev)
+{
+    char path[MAX_PATH];
+    int len, slen, enc;
+
+    // events were lost, nothing in the cache can be trusted
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        Log(LOG_INFO, "Info: inotify queue overflow, flushing file cache \n");
+        cache_flush();
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= wd_size || wd_dirs[ev->wd] == NULL)
+        return;
+
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+    {
+        cache_drop_dir(ev->wd);
+        if (ev->mask & IN_IGNORED)
+        {
+            free(wd_dirs[ev->wd]);
+            wd_dirs[ev->wd] = NULL;
+        }
+        return;
+    }
+
+    if (ev->len > 0)
+    {
+        snprintf(path, MAX_PATH, "%s/%s", wd_dirs[ev->wd], ev->name);
+        cache_invalidate(path);
+
+        // a precompressed sibling changed: its file looks for it again
+        len = strlen(path);
+        for (enc = ENC_BR; enc < ENC_TYPES; enc++)
+        {
+            slen = strlen(encode_suffix(enc));
+            if (len > slen && !strcmp(path + len - slen, encode_suffix(enc)))
+            {
+                path[len - slen] = '\0';
+                cache_invalidate(path);
+            }
+        }
+    }
+}
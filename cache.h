@@ -0,0 +1,58 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "log.h"
+#include "encode.h"
+
+/* this data structure wraps one small static file held in memory, together
+ * with the part of the response header which only depends on the file. Its
+ * compressed copies hang off it, outside the hash and LRU list, and go with
+ * it when the file changes or is evicted */
+typedef struct cache_entry
+{
+    struct cache_entry *hnext;   // next entry in the same hash bucket
+    struct cache_entry *prev;    // neighbour towards the most recently used
+    struct cache_entry *next;    // neighbour towards the least recently used
+    unsigned int hash;           // hash of path
+    int    refcnt;               // responses still sending data
+    int    dead;                 // removed, freed when refcnt drops to 0
+    int    wd;                   // inotify watch of the containing directory
+    char  *path;                 // resolved filesystem path (the key)
+    char  *header;               // Content-Length/Type, Last-Modified, ETag
+    int    header_len;           // and Accept-Ranges lines
+    const char *type;            // MIME type, from the static table
+    time_t mtime;                // validators of the cached copy
+    uint64_t etag;
+    char  *data;                 // file content
+    size_t size;
+    int    encoding;             // content coding of data, ENC_*
+    int    tried;                // ENC_MASK of the copies looked for
+    struct cache_entry *variant[ENC_TYPES];  // compressed copies, or NULL
+} cache_entry;
+
+/* an entity tag is the quoted hex form of a hash of inode, size and mtime */
+#define ETAG_LEN 18
+uint64_t file_etag(struct stat *sbuf);
+int  etag_format(uint64_t etag, char *buf);
+
+int  cache_init(size_t max_bytes, int max_entries, int fd);
+cache_entry *cache_lookup(const char *path);
+cache_entry *cache_insert(const char *path, struct stat *sbuf,
+                          const char *filetype);
+cache_entry *cache_variant(cache_entry *e, int accept);
+void cache_invalidate(const char *path);
+void cache_hold(cache_entry *e);
+void cache_release(cache_entry *e);
+cache_entry *cache_wrap(char *data, size_t size);
+void cache_flush();
+void cache_event(const struct inotify_event *ev);
+
+#endif
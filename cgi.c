@@ -0,0 +1,872 @@
+/*
+ * cgi.c
+ *
+ * Description: This file defines how the Liso server runs CGI programs.
+ *              By default every request forks the program (posix_spawn) with
+ *              a pipe on its stdin and stdout; the server registers the
+ *              pipes with its epoll instance, so a slow program never blocks
+ *              other clients. With --fastcgi N, N copies of the CGI script
+ *              are started once and share a listening Unix socket, and each
+ *              request is a FastCGI connection to one of them instead of a
+ *              fork and exec. The server side of the FastCGI protocol is
+ *              implemented here: a single responder request per connection.
+ *
+ */
+#define _GNU_SOURCE   // pipe2, posix_spawn file actions
+#include <ctype.h>
+#include <stddef.h>
+#include "cgi.h"
+#include "slab.h"
+
+/* from the FastCGI specification 1.0 */
+#define FCGI_VERSION_1     1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST   3
+#define FCGI_PARAMS        4
+#define FCGI_STDIN         5
+#define FCGI_STDOUT        6
+#define FCGI_STDERR        7
+#define FCGI_RESPONDER     1
+#define FCGI_MAX_CONTENT   65535
+
+extern char **environ;
+
+static char  cgi_arg[MAX_PATH];      // the CGI path as given, resolved again on reload
+static int   enabled;                // the CGI path was found
+static int   is_dir;                 // the CGI path is a folder of programs
+static int   app_sock = -1;          // listening socket of the FastCGI processes
+static struct sockaddr_un app_addr;
+static socklen_t app_addrlen;
+static pid_t apps[CGI_MAX_APPS];
+static time_t app_started[CGI_MAX_APPS];
+static int   napps;
+static pid_t app_owner;              // the process which started them
+
+/******************************************************************************
+* subroutine: spawn                                                           *
+* purpose:    start a program in its own folder with the given stdin, stdout *
+*             and environment. stderr goes to the log file. posix_spawn does *
+*             not copy the page tables of the server like fork() would        *
+* parameters: path   - absolute path of the program                           *
+*             in_fd  - descriptor to become stdin                             *
+*             out_fd - descriptor to become stdout, -1 for /dev/null          *
+*             envp   - the environment                                        *
+* return:     pid of the program, -1 on failure                               *
+******************************************************************************/
+static pid_t spawn(const char *path, int in_fd, int out_fd, char **envp)
+{
+    pid_t pid;
+    char  dir[MAX_PATH], *slash, *argv[2];
+    sigset_t set;
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+
+    snprintf(dir, MAX_PATH, "%s", path);
+    if ((slash = strrchr(dir, '/')) != NULL) slash[slash == dir] = '\0';
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in_fd, 0);
+    if (out_fd >= 0)
+        posix_spawn_file_actions_adddup2(&fa, out_fd, 1);
+    else
+        posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, fileno(STATE.log), 2);
+    posix_spawn_file_actions_addclosefrom_np(&fa, 3);
+    posix_spawn_file_actions_addchdir_np(&fa, dir);
+
+    // the server ignores SIGPIPE and SIGCHLD, the program must not inherit it
+    posix_spawnattr_init(&attr);
+    sigemptyset(&set);
+    posix_spawnattr_setsigmask(&attr, &set);
+    sigaddset(&set, SIGPIPE);
+    sigaddset(&set, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &set);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    argv[0] = (char *)path;
+    argv[1] = NULL;
+    if ((errno = posix_spawn(&pid, path, &fa, &attr, argv, envp)) != 0)
+    {
+        Log(LOG_ERROR, "Error: failed starting CGI program %s: %s \n",
+            path, strerror(errno));
+        pid = -1;
+    }
+
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    return pid;
+}
+
+/******************************************************************************
+* subroutine: spawn_app                                                       *
+* purpose:    start FastCGI process i. As the specification asks, it gets    *
+*             the listening socket as its stdin                               *
+* parameters: i - the slot of the process                                     *
+* return:     none                                                            *
+******************************************************************************/
+static void spawn_app(int i)
+{
+    apps[i] = spawn(STATE.cgi_path, app_sock, -1, environ);
+    app_started[i] = time(NULL);
+    if (apps[i] > 0)
+        Log(LOG_INFO, "FastCGI process %d started: pid=%d \n", i, apps[i]);
+}
+
+/******************************************************************************
+* subroutine: find_cgi                                                        *
+* purpose:    resolve the CGI path as given to an absolute one, as programs   *
+*             run in their own folder                                         *
+* parameters: none                                                            *
+* return:     0 on success, -1 if it is not found and CGI is disabled         *
+******************************************************************************/
+static int find_cgi()
+{
+    char path[MAX_PATH];
+    struct stat sbuf;
+
+    if (realpath(cgi_arg, path) == NULL || stat(path, &sbuf) < 0)
+    {
+        Log(LOG_WARN, "Warning: CGI path %s not found, CGI disabled \n", cgi_arg);
+        enabled = 0;
+        return -1;
+    }
+    strcpy(STATE.cgi_path, path);
+    is_dir = S_ISDIR(sbuf.st_mode);
+    enabled = 1;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cgi_init                                                        *
+* purpose:    find the CGI folder or script, and start the FastCGI processes *
+*             if asked to. Called before the workers are forked, they all    *
+*             connect to the same processes                                   *
+* parameters: n - number of FastCGI processes, 0 to fork per request         *
+* return:     0 on success, -1 if CGI or FastCGI is disabled                  *
+******************************************************************************/
+int cgi_init(int n)
+{
+    int  i, len;
+
+    strcpy(cgi_arg, STATE.cgi_path);
+    if (find_cgi() < 0) return -1;
+
+    if (n == 0) return 0;
+    if (is_dir)
+    {
+        Log(LOG_ERROR, "Error: FastCGI needs a CGI script, not a folder, "
+            "FastCGI disabled \n");
+        return -1;
+    }
+
+    // an abstract address leaves nothing behind on the filesystem
+    memset(&app_addr, 0, sizeof(app_addr));
+    app_addr.sun_family = AF_UNIX;
+    len = snprintf(app_addr.sun_path + 1, sizeof(app_addr.sun_path) - 1,
+                   "lisod-fastcgi-%d", getpid());
+    app_addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+
+    if ((app_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(app_sock, (struct sockaddr *)&app_addr, app_addrlen) < 0 ||
+        listen(app_sock, MAX_CONN) < 0)
+    {
+        Log(LOG_ERROR, "Error: failed creating FastCGI socket, FastCGI disabled \n");
+        if (app_sock >= 0) close(app_sock);
+        app_sock = -1;
+        return -1;
+    }
+
+    app_owner = getpid();
+    napps = n;
+    for (i = 0; i < napps; i++)
+        spawn_app(i);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cgi_reload                                                      *
+* purpose:    resolve the CGI path again on reload, so a deploy which moved   *
+*             it (such as a switched symbolic link) is picked up by the next  *
+*             request. FastCGI processes keep the script they were started    *
+*             with, until they are restarted                                  *
+* parameters: none                                                            *
+* return:     0 on success, -1 if CGI is now disabled                         *
+******************************************************************************/
+int cgi_reload()
+{
+    if (napps > 0) return 0;
+    return find_cgi();
+}
+
+/******************************************************************************
+* subroutine: cgi_respawn                                                     *
+* purpose:    restart a FastCGI process which exited, in the master           *
+* parameters: pid - the process which exited                                  *
+* return:     1 if it was a FastCGI process, 0 otherwise                      *
+******************************************************************************/
+int cgi_respawn(pid_t pid)
+{
+    int i;
+
+    if (getpid() != app_owner) return 0;
+    for (i = 0; i < napps && apps[i] != pid; i++)
+        ;
+    if (i == napps) return 0;
+
+    Log(LOG_ERROR, "Error: FastCGI process %d (pid=%d) exited, restarting \n",
+        i, pid);
+    // don't spin if the script dies right after starting
+    if (time(NULL) - app_started[i] < 1) sleep(1);
+    spawn_app(i);
+    return 1;
+}
+
+/******************************************************************************
+* subroutine: cgi_check_pool                                                  *
+* purpose:    restart FastCGI processes which exited, without workers. The   *
+*             server ignores SIGCHLD, so they are probed once a second        *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void cgi_check_pool()
+{
+    int i;
+    time_t now;
+    static time_t last;
+
+    if (napps == 0 || getpid() != app_owner) return;
+    if ((now = time(NULL)) == last) return;
+    last = now;
+
+    for (i = 0; i < napps; i++)
+    {
+        if (apps[i] > 0 && (kill(apps[i], 0) == 0 || errno != ESRCH))
+            continue;
+        Log(LOG_ERROR, "Error: FastCGI process %d exited, restarting \n", i);
+        if (now - app_started[i] >= 1) spawn_app(i);
+    }
+}
+
+/******************************************************************************
+* subroutine: cgi_shutdown                                                    *
+* purpose:    stop the FastCGI processes when the server stops                *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void cgi_shutdown()
+{
+    int i;
+
+    if (napps == 0 || getpid() != app_owner) return;
+    for (i = 0; i < napps; i++)
+    {
+        if (apps[i] > 0) kill(apps[i], SIGTERM);
+        apps[i] = 0;
+    }
+}
+
+/******************************************************************************
+* subroutine: cgi_resolve                                                     *
+* purpose:    find the program for a CGI URI. A CGI script serves everything *
+*             under CGI_PREFIX; in a CGI folder the first path segment after  *
+*             it names the program                                            *
+* parameters: uri       - the URI without query string, under CGI_PREFIX     *
+*             script    - returns the path of the program                     *
+*             name      - returns SCRIPT_NAME                                 *
+*             path_info - returns PATH_INFO, the rest of uri                  *
+* return:     0 on success, otherwise the status code to answer with         *
+******************************************************************************/
+int cgi_resolve(const char *uri, char *script, char *name,
+                const char **path_info)
+{
+    int  len;
+    const char *rest = uri + strlen(CGI_PREFIX), *end;
+    struct stat sbuf;
+
+    if (!enabled) return 404;
+
+    if (!is_dir)
+    {
+        strcpy(script, STATE.cgi_path);
+        strcpy(name, CGI_PREFIX);
+        *path_info = rest;
+        return 0;
+    }
+
+    if (*rest == '/') rest++;
+    end = strchr(rest, '/');
+    len = end ? end - rest : strlen(rest);
+
+    // no hidden files, and never "." or ".."
+    if (len == 0 || rest[0] == '.') return 404;
+    if (snprintf(script, MAX_PATH, "%s/%.*s", STATE.cgi_path, len, rest) >= MAX_PATH)
+        return 404;
+    snprintf(name, MAX_PATH, "%s/%.*s", CGI_PREFIX, len, rest);
+    *path_info = rest + len;
+
+    if (stat(script, &sbuf) < 0) return 404;
+    if (!S_ISREG(sbuf.st_mode) || access(script, X_OK) < 0) return 403;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cgi_setenv                                                      *
+* purpose:    add a variable to the environment of a CGI request. Variables  *
+*             which don't fit are dropped                                     *
+* parameters: env   - the environment                                         *
+*             name  - the variable                                            *
+*             value - its value                                               *
+*             vlen  - length of value, -1 if it is NUL terminated             *
+* return:     none                                                            *
+******************************************************************************/
+void cgi_setenv(cgi_env *env, const char *name, const char *value, int vlen)
+{
+    int nlen = strlen(name);
+
+    if (vlen < 0) vlen = strlen(value);
+    if (env->len + nlen + vlen + 2 > CGI_ENV) return;
+
+    memcpy(env->buf + env->len, name, nlen);
+    env->len += nlen;
+    env->buf[env->len++] = '=';
+    memcpy(env->buf + env->len, value, vlen);
+    env->len += vlen;
+    env->buf[env->len++] = '\0';
+    env->cnt++;
+}
+
+/******************************************************************************
+* subroutine: cgi_header_env                                                  *
+* purpose:    pass a request header to a CGI program as HTTP_<NAME>           *
+* parameters: env   - the environment                                         *
+*             name  - the header name                                         *
+*             nlen  - length of name                                          *
+*             value - the header value                                        *
+*             vlen  - length of value                                         *
+* return:     none                                                            *
+******************************************************************************/
+void cgi_header_env(cgi_env *env, const char *name, int nlen,
+                    const char *value, int vlen)
+{
+    int  i;
+    char var[MAX_NAME];
+    const char *colon;
+
+    // CONTENT_LENGTH comes from the parsed request and a chunked body is
+    // decoded before the program sees it; a client must never set
+    // HTTP_PROXY, which many programs take as their proxy (httpoxy)
+    if ((nlen == 14 && !strncasecmp(name, "Content-Length", 14)) ||
+        (nlen == 17 && !strncasecmp(name, "Transfer-Encoding", 17)) ||
+        (nlen == 5 && !strncasecmp(name, "Proxy", 5)) ||
+        nlen + 6 > MAX_NAME)
+        return;
+
+    if (nlen == 12 && !strncasecmp(name, "Content-Type", 12))
+    {
+        cgi_setenv(env, "CONTENT_TYPE", value, vlen);
+        return;
+    }
+
+    if (nlen == 4 && !strncasecmp(name, "Host", 4))
+    {
+        colon = memchr(value, ':', vlen);
+        cgi_setenv(env, "SERVER_NAME", value, colon ? colon - value : vlen);
+    }
+
+    memcpy(var, "HTTP_", 5);
+    for (i = 0; i < nlen; i++)
+    {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '-') return;
+        var[5 + i] = (name[i] == '-') ? '_' : toupper((unsigned char)name[i]);
+    }
+    var[5 + nlen] = '\0';
+    cgi_setenv(env, var, value, vlen);
+}
+
+/******************************************************************************
+* subroutine: fcgi_put                                                        *
+* purpose:    encode one FastCGI record of request 1, without padding         *
+* parameters: out  - where to write the record                                *
+*             type - the record type                                          *
+*             data - the content                                              *
+*             len  - length of data, at most FCGI_MAX_CONTENT                 *
+* return:     bytes written                                                   *
+******************************************************************************/
+static int fcgi_put(char *out, int type, const char *data, int len)
+{
+    out[0] = FCGI_VERSION_1;
+    out[1] = type;
+    out[2] = 0;
+    out[3] = 1;
+    out[4] = (len >> 8) & 0xff;
+    out[5] = len & 0xff;
+    out[6] = 0;
+    out[7] = 0;
+    if (len > 0) memcpy(out + 8, data, len);
+    return 8 + len;
+}
+
+/******************************************************************************
+* subroutine: fcgi_stream                                                     *
+* purpose:    encode a whole FastCGI stream: as many records as needed and   *
+*             the empty record which ends it                                  *
+* parameters: out  - where to write the records                               *
+*             type - the stream type                                          *
+*             data - the stream content                                       *
+*             len  - length of data                                           *
+* return:     bytes written                                                   *
+******************************************************************************/
+static int fcgi_stream(char *out, int type, const char *data, int len)
+{
+    int k, n = 0;
+
+    for (; len > 0; data += k, len -= k)
+    {
+        k = (len > FCGI_MAX_CONTENT) ? FCGI_MAX_CONTENT : len;
+        n += fcgi_put(out + n, type, data, k);
+    }
+    return n + fcgi_put(out + n, type, NULL, 0);
+}
+
+/******************************************************************************
+* subroutine: fcgi_length                                                     *
+* purpose:    encode the length of a FastCGI name or value                    *
+* parameters: out - where to write it                                         *
+*             len - the length                                                *
+* return:     bytes written, 1 or 4                                           *
+******************************************************************************/
+static int fcgi_length(char *out, int len)
+{
+    if (len < 128)
+    {
+        out[0] = len;
+        return 1;
+    }
+    out[0] = ((len >> 24) & 0x7f) | 0x80;
+    out[1] = (len >> 16) & 0xff;
+    out[2] = (len >> 8) & 0xff;
+    out[3] = len & 0xff;
+    return 4;
+}
+
+/******************************************************************************
+* subroutine: fcgi_request                                                    *
+* purpose:    encode the start of a FastCGI request: BEGIN_REQUEST and the   *
+*             PARAMS stream. The STDIN stream follows as the body arrives     *
+* parameters: env - the environment, sent as PARAMS                           *
+*             len - returns the length of the records                         *
+* return:     the records, malloc'ed, NULL if out of memory                   *
+******************************************************************************/
+static char *fcgi_request(cgi_env *env, int *len)
+{
+    static const char begin[8] = {0, FCGI_RESPONDER, 0};
+    int  n, plen = 0;
+    char *out, *pairs;
+    const char *var, *eq;
+
+    if ((pairs = (char *)malloc(env->len + 8 * env->cnt)) == NULL) return NULL;
+    for (var = env->buf; var < env->buf + env->len; var += strlen(var) + 1)
+    {
+        eq = strchr(var, '=');
+        n = strlen(eq + 1);
+        plen += fcgi_length(pairs + plen, eq - var);
+        plen += fcgi_length(pairs + plen, n);
+        memcpy(pairs + plen, var, eq - var);
+        plen += eq - var;
+        memcpy(pairs + plen, eq + 1, n);
+        plen += n;
+    }
+
+    out = (char *)malloc(16 + plen + 8 * (plen / FCGI_MAX_CONTENT + 2));
+    if (out == NULL)
+    {
+        free(pairs);
+        return NULL;
+    }
+    n = fcgi_put(out, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+    n += fcgi_stream(out + n, FCGI_PARAMS, pairs, plen);
+
+    free(pairs);
+    *len = n;
+    return out;
+}
+
+/******************************************************************************
+* subroutine: cgi_start                                                       *
+* purpose:    start a CGI request: spawn the program, or connect to one of   *
+*             the FastCGI processes. The descriptors are non-blocking and    *
+*             left for the caller to watch; the request body is passed with  *
+*             cgi_send and ended with cgi_end                                 *
+* parameters: script - path of the program                                    *
+*             env    - the environment of the request                         *
+* return:     the request, NULL with errno set on failure (EAGAIN if every    *
+*             FastCGI process is busy)                                        *
+******************************************************************************/
+cgi_proc *cgi_start(const char *script, cgi_env *env)
+{
+    int  i, in[2], out[2];
+    char **envp, *var;
+    const char *base;
+    cgi_proc *cp = (cgi_proc *)slab_alloc(SLAB_CGI);
+
+    if (cp == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(cp, 0, offsetof(cgi_proc, hbuf));
+    cp->in_fd = cp->out_fd = -1;
+
+    if (napps > 0)
+    {
+        cp->is_fcgi = 1;
+        if ((cp->in = fcgi_request(env, &cp->in_len)) == NULL) goto Fail;
+
+        cp->in_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (cp->in_fd < 0 ||
+            connect(cp->in_fd, (struct sockaddr *)&app_addr, app_addrlen) < 0)
+            goto Fail;
+        cp->out_fd = cp->in_fd;
+        return cp;
+    }
+
+    base = strrchr(script, '/');
+    cp->is_nph = !strncmp(base ? base + 1 : script, "nph-", 4);
+    cp->header_done = cp->is_nph;   // passed through as it is
+
+    if ((envp = (char **)malloc((env->cnt + 1) * sizeof(char *))) == NULL)
+        goto Fail;
+    for (i = 0, var = env->buf; i < env->cnt; i++, var += strlen(var) + 1)
+        envp[i] = var;
+    envp[i] = NULL;
+
+    // the server ends of the pipes must not leak into other programs
+    if (pipe2(in, O_CLOEXEC) < 0)
+    {
+        free(envp);
+        goto Fail;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0)
+    {
+        close(in[0]); close(in[1]); free(envp);
+        goto Fail;
+    }
+
+    cp->pid = spawn(script, in[0], out[1], envp);
+    close(in[0]);
+    close(out[1]);
+    free(envp);
+    cp->in_fd = in[1];
+    cp->out_fd = out[0];
+    if (cp->pid < 0) goto Fail;
+
+    fcntl(cp->in_fd, F_SETFL, O_NONBLOCK);
+    fcntl(cp->out_fd, F_SETFL, O_NONBLOCK);
+    return cp;
+
+    Fail:
+    i = errno;
+    cgi_close(cp, 0);
+    errno = i;
+    return NULL;
+}
+
+/******************************************************************************
+* subroutine: cgi_write                                                       *
+* purpose:    write what is left of the bytes queued for the program         *
+* parameters: cp - the request                                                *
+* return:     0 when everything is written, CGI_AGAIN if the pipe is full,   *
+*             -1 if the program stopped reading                               *
+******************************************************************************/
+int cgi_write(cgi_proc *cp)
+{
+    ssize_t n;
+
+    while (cp->in_off < cp->in_len)
+    {
+        n = write(cp->in_fd, cp->in + cp->in_off, cp->in_len - cp->in_off);
+        if (n > 0)
+        {
+            cp->in_off += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return CGI_AGAIN;
+        return -1;
+    }
+
+    if (cp->in != cp->ibuf) free(cp->in);
+    cp->in = NULL;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cgi_send                                                        *
+* purpose:    pass bytes of the request body to the program, as many as its  *
+*             pipe takes now. FastCGI bytes are wrapped in one STDIN record  *
+*             of at most CGI_CHUNK bytes                                      *
+* parameters: cp  - the request                                               *
+*             buf - the body bytes                                            *
+*             len - their number                                              *
+* return:     bytes taken, 0 if the pipe is full, -1 if the program stopped  *
+*             reading                                                         *
+******************************************************************************/
+int cgi_send(cgi_proc *cp, const char *buf, int len)
+{
+    int ret;
+    ssize_t n;
+
+    if ((ret = cgi_write(cp)) != 0) return (ret < 0) ? -1 : 0;
+
+    if (cp->is_fcgi)
+    {
+        n = (len > CGI_CHUNK) ? CGI_CHUNK : len;
+        cp->in = cp->ibuf;
+        cp->in_off = 0;
+        cp->in_len = fcgi_put(cp->ibuf, FCGI_STDIN, buf, n);
+        return (cgi_write(cp) < 0) ? -1 : n;
+    }
+
+    while ((n = write(cp->in_fd, buf, len)) < 0 && errno == EINTR)
+        ;
+    if (n >= 0) return n;
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+}
+
+/******************************************************************************
+* subroutine: cgi_end                                                         *
+* purpose:    end the request body once the bytes queued are written. A      *
+*             FastCGI request gets the empty STDIN record; the stdin pipe of *
+*             a program is left for the caller to close                       *
+* parameters: cp - the request                                                *
+* return:     0 when done, CGI_AGAIN if the pipe is full, -1 if the program  *
+*             stopped reading                                                 *
+******************************************************************************/
+int cgi_end(cgi_proc *cp)
+{
+    int ret;
+
+    if ((ret = cgi_write(cp)) != 0 || !cp->is_fcgi || cp->in_end) return ret;
+
+    cp->in_end = 1;
+    cp->in = cp->ibuf;
+    cp->in_off = 0;
+    cp->in_len = fcgi_put(cp->ibuf, FCGI_STDIN, NULL, 0);
+    return cgi_write(cp);
+}
+
+/******************************************************************************
+* subroutine: cgi_read                                                        *
+* purpose:    read response bytes of a program, like read() on a             *
+*             non-blocking descriptor. FastCGI records are unwrapped: only   *
+*             STDOUT content is returned, STDERR content goes to the log     *
+* parameters: cp  - the request                                               *
+*             buf - where to store the bytes                                  *
+*             len - room in buf                                               *
+* return:     bytes read, 0 at the end of the response, -1 with errno set on *
+*             error or EAGAIN                                                 *
+******************************************************************************/
+ssize_t cgi_read(cgi_proc *cp, char *buf, size_t len)
+{
+    int     k;
+    ssize_t n;
+    char    tmp[LOG_LINE / 2];
+
+    for (;;)
+    {
+        if (!cp->is_fcgi)
+            n = read(cp->out_fd, buf, len);
+        else if (cp->ended)
+            return 0;
+        else if (cp->rec_got < 8)
+            n = read(cp->out_fd, cp->rec + cp->rec_got, 8 - cp->rec_got);
+        else if (cp->rec_left > 0 && cp->rec[1] == FCGI_STDOUT)
+            n = read(cp->out_fd, buf, len < cp->rec_left ? len : cp->rec_left);
+        else if (cp->rec_left + cp->pad_left > 0)
+        {
+            k = (cp->rec_left > 0) ? cp->rec_left : cp->pad_left;
+            n = read(cp->out_fd, tmp, k < (int)sizeof(tmp) ? k : (int)sizeof(tmp));
+        }
+        else
+        {
+            // a record is complete; END_REQUEST finishes the response
+            if (cp->rec[1] == FCGI_END_REQUEST) cp->ended = 1;
+            cp->rec_got = 0;
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || !cp->is_fcgi) return n;
+
+        if (cp->rec_got < 8)
+        {
+            if ((cp->rec_got += n) < 8) continue;
+            if (cp->rec[0] != FCGI_VERSION_1)
+            {
+                Log(LOG_ERROR, "Error: bad FastCGI record from the application \n");
+                errno = EPROTO;
+                return -1;
+            }
+            cp->rec_left = (cp->rec[4] << 8) | cp->rec[5];
+            cp->pad_left = cp->rec[6];
+        }
+        else if (cp->rec_left > 0 && cp->rec[1] == FCGI_STDOUT)
+        {
+            cp->rec_left -= n;
+            return n;
+        }
+        else if (cp->rec_left > 0)
+        {
+            if (cp->rec[1] == FCGI_STDERR)
+                Log(LOG_INFO, "FastCGI stderr: %.*s \n", (int)n, tmp);
+            cp->rec_left -= n;
+        }
+        else
+            cp->pad_left -= n;
+    }
+}
+
+/******************************************************************************
+* subroutine: header_end                                                      *
+* purpose:    find the blank line which ends a CGI response header            *
+* parameters: buf - the bytes read so far                                     *
+*             len - their number                                              *
+* return:     offset of the first byte after the blank line, 0 if not found  *
+******************************************************************************/
+static int header_end(const char *buf, int len)
+{
+    const char *line = buf, *nl;
+
+    while ((nl = memchr(line, '\n', buf + len - line)) != NULL)
+    {
+        if (nl == line || (nl == line + 1 && *line == '\r'))
+            return nl + 1 - buf;
+        line = nl + 1;
+    }
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: translate_header                                                *
+* purpose:    turn the header of a CGI response into an HTTP status line and *
+*             header lines. Status and Location set the status; the server   *
+*             frames the body itself, so the program's framing headers go     *
+* parameters: cp  - the request, the header is in hbuf                        *
+*             end - offset of the end of the header in hbuf                   *
+* return:     0 on success, -1 if the header is malformed                     *
+******************************************************************************/
+static int translate_header(cgi_proc *cp, int end)
+{
+    int  len, nlen, vlen, has_type = 0, has_location = 0;
+    char *line = cp->hbuf, *nl, *colon, *value;
+
+    cp->header = (char *)malloc(2 * end + 1);
+    cp->header_len = 0;
+    if (cp->header == NULL) return -1;
+
+    for (; line < cp->hbuf + end; line = nl + 1)
+    {
+        nl = memchr(line, '\n', cp->hbuf + end - line);
+        len = nl - line;
+        if (len > 0 && line[len - 1] == '\r') len--;
+        if (len == 0) break;
+
+        colon = memchr(line, ':', len);
+        if (colon == NULL || colon == line) return -1;
+        nlen = colon - line;
+        for (value = colon + 1; value < line + len && (*value == ' ' || *value == '\t'); value++)
+            ;
+        vlen = line + len - value;
+
+        if (nlen == 6 && !strncasecmp(line, "Status", 6))
+        {
+            if (vlen < 3 || !isdigit((unsigned char)value[0]) ||
+                !isdigit((unsigned char)value[1]) || !isdigit((unsigned char)value[2]) ||
+                (vlen > 3 && value[3] != ' '))
+                return -1;
+            cp->status = (value[0] - '0') * 100 + (value[1] - '0') * 10 + (value[2] - '0');
+            if (cp->status < 100 || cp->status > 599) return -1;
+            if (vlen > MIN_LINE - 12) vlen = MIN_LINE - 12;
+            snprintf(cp->status_line, MIN_LINE, "HTTP/1.1 %.*s\r\n", vlen, value);
+            continue;
+        }
+        if ((nlen == 14 && !strncasecmp(line, "Content-Length", 14)) ||
+            (nlen == 17 && !strncasecmp(line, "Transfer-Encoding", 17)) ||
+            (nlen == 10 && !strncasecmp(line, "Connection", 10)))
+            continue;
+
+        if (nlen == 8 && !strncasecmp(line, "Location", 8)) has_location = 1;
+        if (nlen == 12 && !strncasecmp(line, "Content-Type", 12)) has_type = 1;
+        memcpy(cp->header + cp->header_len, line, len);
+        cp->header_len += len;
+        memcpy(cp->header + cp->header_len, "\r\n", 2);
+        cp->header_len += 2;
+    }
+
+    if (cp->status == 0)
+    {
+        if (!has_location && !has_type) return -1;
+        cp->status = has_location ? 302 : 200;
+        strcpy(cp->status_line, has_location ? "HTTP/1.1 302 Found\r\n" :
+                                               "HTTP/1.1 200 OK\r\n");
+    }
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cgi_read_header                                                 *
+* purpose:    read the response header of a program and translate it. Body   *
+*             bytes read along with it are left in hbuf from body_off         *
+* parameters: cp - the request                                                *
+* return:     0 once translated, CGI_AGAIN if more bytes are needed, -1 if   *
+*             the program failed or sent a malformed header                   *
+******************************************************************************/
+int cgi_read_header(cgi_proc *cp)
+{
+    int end;
+    ssize_t n;
+
+    while ((end = header_end(cp->hbuf, cp->hlen)) == 0)
+    {
+        if (cp->hlen == CGI_HEADER)
+        {
+            Log(LOG_ERROR, "Error: CGI response header too long \n");
+            return -1;
+        }
+        n = cgi_read(cp, cp->hbuf + cp->hlen, CGI_HEADER - cp->hlen);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return CGI_AGAIN;
+        if (n <= 0)
+        {
+            Log(LOG_ERROR, "Error: CGI program ended without a response header \n");
+            return -1;
+        }
+        cp->hlen += n;
+    }
+
+    if (translate_header(cp, end) < 0)
+    {
+        Log(LOG_ERROR, "Error: malformed CGI response header \n");
+        return -1;
+    }
+    cp->body_off = end;
+    cp->header_done = 1;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: cgi_close                                                       *
+* purpose:    release a CGI request                                           *
+* parameters: cp    - the request                                             *
+*             abort - the response was not read to its end, stop the program *
+* return:     none                                                            *
+******************************************************************************/
+void cgi_close(cgi_proc *cp, int abort)
+{
+    if (cp->in_fd >= 0 && cp->in_fd != cp->out_fd) close(cp->in_fd);
+    if (cp->out_fd >= 0) close(cp->out_fd);
+    if (abort && cp->pid > 0) kill(cp->pid, SIGTERM);
+
+    if (cp->in != cp->ibuf) free(cp->in);
+    free(cp->header);
+    slab_free(SLAB_CGI, cp);
+}
@@ -0,0 +1,77 @@
+#ifndef _CGI_H_
+#define _CGI_H_
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "log.h"
+
+#define CGI_AGAIN 1       // the pipe or socket would block, wait for an edge
+
+/* this data structure holds the environment of one CGI request as
+ * "NAME=value" strings, one after the other */
+typedef struct
+{
+    int  len;                    // bytes used in buf
+    int  cnt;                    // number of variables
+    char buf[CGI_ENV];
+} cgi_env;
+
+/* this data structure wraps one running CGI request: a forked program with
+ * a pipe on each of stdin and stdout, or a connection to a FastCGI process */
+typedef struct
+{
+    pid_t pid;                   // the program, 0 for FastCGI
+    int   in_fd;                 // where the request body goes, -1 when done
+    int   out_fd;                // where the response comes from
+    int   is_fcgi;               // in_fd and out_fd are one FastCGI socket
+    int   is_nph;                // the program writes the whole HTTP response
+    int   is_head;               // the body of the response is dropped
+    int   method;                // request method, for the metrics
+    char *in;                    // bytes for in_fd not yet written
+    int   in_len;
+    int   in_off;
+    int   in_end;                // the empty FastCGI STDIN record is queued
+    unsigned char rec[8];        // header of the FastCGI record being read
+    int   rec_got;
+    int   rec_left;              // content bytes of that record still unread
+    int   pad_left;
+    int   ended;                 // FCGI_END_REQUEST seen
+    int   header_done;           // the response header was translated
+    int   status;                // status code given by the program
+    char  status_line[MIN_LINE]; // "HTTP/1.1 <status>\r\n"
+    char *header;                // header lines for the client, malloc'ed
+    int   header_len;
+    int   body_off;              // body bytes read along with the header,
+    int   hlen;                  // from body_off to hlen in hbuf
+    // the buffers are not cleared when a request is recycled
+    char  hbuf[CGI_HEADER];      // response header of the program
+    char  ibuf[8 + CGI_CHUNK];   // the FastCGI STDIN record being written
+} cgi_proc;
+
+int  cgi_init(int n);
+int  cgi_reload();
+int  cgi_respawn(pid_t pid);
+void cgi_check_pool();
+void cgi_shutdown();
+int  cgi_resolve(const char *uri, char *script, char *name,
+                 const char **path_info);
+void cgi_setenv(cgi_env *env, const char *name, const char *value, int vlen);
+void cgi_header_env(cgi_env *env, const char *name, int nlen,
+                    const char *value, int vlen);
+cgi_proc *cgi_start(const char *script, cgi_env *env);
+int  cgi_write(cgi_proc *cp);
+int  cgi_send(cgi_proc *cp, const char *buf, int len);
+int  cgi_end(cgi_proc *cp);
+ssize_t cgi_read(cgi_proc *cp, char *buf, size_t len);
+int  cgi_read_header(cgi_proc *cp);
+void cgi_close(cgi_proc *cp, int abort);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * encode.c
+ *
+ * Description: This file defines the content codings of the Liso server:
+ *              reading which codings a client takes from Accept-Encoding,
+ *              and compressing a body with gzip or brotli. Compressed copies
+ *              are kept by the file cache, so each file is compressed once.
+ *
+ */
+#include "encode.h"
+
+static const char *names[ENC_TYPES] = { "identity", "br", "gzip" };
+static const char *suffixes[ENC_TYPES] = { "", ".br", ".gz" };
+
+/******************************************************************************
+* subroutine: encode_accept                                                   *
+* purpose:    read the value of Accept-Encoding. A coding is taken unless its *
+*             q is 0; '*' stands for the codings not named                    *
+* parameters: value - the header value                                        *
+*             len   - the length of value                                     *
+* return:     the codings taken, as ENC_MASK bits                             *
+******************************************************************************/
+int encode_accept(const char *value, int len)
+{
+    const char *p = value, *end = value + len, *tok, *param, *q;
+    int tlen, taken, mask = 0, named = 0, star = 0, enc;
+
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        tok = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        tlen = p - tok;
+
+        // of the parameters only q matters, and only whether it is 0
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        for (taken = 1; p < end && *p == ';'; )
+        {
+            for (p++; p < end && (*p == ' ' || *p == '\t'); p++);
+            param = p;
+            while (p < end && *p != '=' && *p != ';' && *p != ',') p++;
+            if (p - param == 1 && (*param == 'q' || *param == 'Q') && p < end && *p == '=')
+            {
+                for (q = p + 1; q < end && (*q == '0' || *q == '.'); q++);
+                taken = (q < end && *q >= '1' && *q <= '9');
+            }
+            while (p < end && *p != ';' && *p != ',') p++;
+        }
+        while (p < end && *p != ',') p++;
+
+        if (tlen == 1 && *tok == '*')
+        {
+            star = taken ? 1 : -1;
+            continue;
+        }
+        for (enc = ENC_BR; enc < ENC_TYPES; enc++)
+        {
+            if ((tlen == (int)strlen(names[enc]) && !strncasecmp(tok, names[enc], tlen)) ||
+                (enc == ENC_GZIP && tlen == 6 && !strncasecmp(tok, "x-gzip", 6)))
+            {
+                named |= ENC_MASK(enc);
+                if (taken) mask |= ENC_MASK(enc);
+            }
+        }
+    }
+
+    if (star > 0)
+        mask |= ~named & (ENC_MASK(ENC_BR) | ENC_MASK(ENC_GZIP));
+    return mask;
+}
+
+/******************************************************************************
+* subroutine: encode_compressible                                             *
+* purpose:    tell if a MIME type is text, which compresses well; images,    *
+*             media and archives are compressed already                      *
+* parameters: type - the MIME type                                            *
+* return:     1 if it's worth compressing, 0 otherwise                        *
+******************************************************************************/
+int encode_compressible(const char *type)
+{
+    int len = strlen(type);
+
+    return !strncmp(type, "text/", 5) ||
+           !strcmp(type, "application/javascript") ||
+           !strcmp(type, "application/json") ||
+           !strcmp(type, "application/wasm") ||
+           (len > 4 && !strcmp(type + len - 4, "+xml")) ||
+           (len > 5 && !strcmp(type + len - 5, "+json"));
+}
+
+/******************************************************************************
+* subroutine: encode_name                                                     *
+* purpose:    the name of a coding, as in Content-Encoding                    *
+* parameters: enc - the coding                                                *
+* return:     the name                                                        *
+******************************************************************************/
+const char *encode_name(int enc)
+{
+    return names[enc];
+}
+
+/******************************************************************************
+* subroutine: encode_suffix                                                   *
+* purpose:    the suffix of a file precompressed with a coding                *
+* parameters: enc - the coding                                                *
+* return:     the suffix, with its dot                                        *
+******************************************************************************/
+const char *encode_suffix(int enc)
+{
+    return suffixes[enc];
+}
+
+/******************************************************************************
+* subroutine: encode_buf                                                      *
+* purpose:    compress a body with a coding, at a level cheap enough to run   *
+*             in the event loop: every file is compressed once per worker     *
+* parameters: enc      - ENC_BR or ENC_GZIP                                   *
+*             data     - the body                                             *
+*             size     - the length of data                                   *
+*             out_size - returns the compressed length                        *
+* return:     the compressed body, malloc'ed, or NULL on failure              *
+******************************************************************************/
+char *encode_buf(int enc, const char *data, size_t size, size_t *out_size)
+{
+    z_stream zs;
+    char *out;
+    size_t bound;
+
+    if (enc == ENC_BR)
+    {
+        bound = BrotliEncoderMaxCompressedSize(size);
+        if (bound == 0 || (out = (char *)malloc(bound)) == NULL) return NULL;
+        *out_size = bound;
+        if (BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW,
+                                  BROTLI_MODE_TEXT, size, (const uint8_t *)data,
+                                  out_size, (uint8_t *)out) == BROTLI_TRUE)
+            return out;
+        free(out);
+        return NULL;
+    }
+
+    // windowBits + 16 writes a gzip header and trailer around the deflate data
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    bound = deflateBound(&zs, size);
+    if ((out = (char *)malloc(bound)) == NULL)
+    {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = size;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+    {
+        Log(LOG_ERROR, "Error: gzip failed \n");
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+    *out_size = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
@@ -0,0 +1,26 @@
+#ifndef _ENCODE_H_
+#define _ENCODE_H_
+
+#include <string.h>
+#include <stdlib.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "log.h"
+
+/* content codings of a static body */
+enum
+{
+    ENC_IDENTITY,
+    ENC_BR,
+    ENC_GZIP,
+    ENC_TYPES
+};
+#define ENC_MASK(enc) (1 << (enc))
+
+int  encode_accept(const char *value, int len);
+int  encode_compressible(const char *type);
+const char *encode_name(int enc);
+const char *encode_suffix(int enc);
+char *encode_buf(int enc, const char *data, size_t size, size_t *out_size);
+
+#endif
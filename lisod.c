@@ -10,13 +10,26 @@
 *              The server currently support following features:                *
 *              1. HTTP1.1: support HEAD, GET and POST                          *
 *              2. Support connections from multiple clients                    *
-*              3. Log debug, info and error in the log file                    *
+*              3. Log debug, info and error in the log file, asynchronously    *
 *              4. Run server as a daemon process                               *
+*              5. Optionally run N worker processes on SO_REUSEPORT sockets    *
+*              6. HTTPS with TLS 1.2/1.3, session resumption and ALPN          *
+*              7. CGI programs on non-blocking pipes, or a FastCGI pool        *
+*              8. Request bodies streamed in constant memory, also chunked     *
+*              9. Header, body, keep-alive and write timeouts on a timer wheel *
+*             10. Admission control: idle connections are evicted, then 503s  *
+*                 are rate limited, then accepting pauses                     *
+*             11. Reload on SIGHUP, binary upgrade on SIGUSR2 without         *
+*                 refusing connections, graceful stop on SIGQUIT              *
 *                                                                              *
 * Authors:     Wenjun Zhang <wenjunzh@andrew.cmu.edu>,                         *
 *                                                                              *
-* Usage:       ./lisod <HTTP port> <HTTPS port> <log file> <lock file>         *
-*              <www folder> <CGI folder> <private key> <certificate file>      *
+* Usage:       ./lisod [--workers N] [--log-level L] [--fastcgi N]             *
+*              [--max-body BYTES] [--header-timeout S] [--body-timeout S]      *
+*              [--keepalive-timeout S] [--write-timeout S] [--reject-rate N]   *
+*              <HTTP port>                                                     *
+*              <HTTPS port> <log file> <lock file> <www folder> <CGI folder>   *
+*              <private key> <certificate file>                                *
 * example:     ./lisod 8080 4443 lisod.log lisod.lock www cgi key cert         *
 *                                                                              *
 *              To stop the server, first find the pid                          *
@@ -25,21 +38,141 @@
 *                 kill <pid>                                                   *
 *******************************************************************************/
 
+#define _GNU_SOURCE   // accept4
 #include "lisod.h"
 
 struct lisod_state STATE;
 static int KEEPON = 1;
+static int RELOAD, UPGRADE, DRAIN;   // set by SIGHUP, SIGUSR2 and SIGQUIT
+
+static int    inherited[2 * MAX_WORKERS];  // listeners passed by an upgrade
+static int    ninherited;
+static pid_t  old_pid;                     // server to retire once listening
+static char   old_lock[MAX_PATH + 8];      // our lock file, moved by an upgrade
+
+static char   date_hdr[MIN_LINE];  // 'Date' header line of the current second
+static int    date_len;
+static time_t date_time;
+
+/* names of the request methods, for REQUEST_METHOD of a CGI program */
+static const char *method_names[] =
+{
+    [METHOD_GET] = "GET", [METHOD_HEAD] = "HEAD", [METHOD_POST] = "POST",
+    [METHOD_OTHER] = ""
+};
+
+/* names of the timeouts, for the log */
+static const char *timeout_names[] =
+{
+    [TIMEOUT_HEADER] = "header", [TIMEOUT_BODY] = "body",
+    [TIMEOUT_KEEPALIVE] = "keep-alive", [TIMEOUT_WRITE] = "write"
+};
+
+/* error responses of the server, rendered once by init_responses. The last
+ * entry is used for codes not listed here */
+static struct
+{
+    int   code;
+    char *shortmsg;
+    char *longmsg;
+    char *status;      // status line
+    int   status_len;
+    char *rest[2];     // headers after 'Date' and body, [1] with close
+    int   rest_len[2];
+} errors[] =
+{
+    {400, "Bad Request", "The request is not understood by the server"},
+    {403, "Forbidden", "Server couldn't read this file"},
+    {404, "Not Found", "Server couldn't find this file"},
+    {408, "Request Timeout",
+          "The server timed out waiting for the request."},
+    {411, "Length Required", "Content-Length is required."},
+    {413, "Request Entity Too Large",
+          "The request body is larger than the server accepts."},
+    {414, "Request-URI Too Long",
+          "The request line is longer than the server can handle."},
+    {501, "Not Implemented",
+          "The method is not valid or not implemented by the server"},
+    {502, "Bad Gateway",
+          "The CGI program failed or returned an invalid response."},
+    {503, "Service Unavailable",
+          "Server is too busy right now. Please try again later."},
+    {505, "HTTP Version not supported",
+          "HTTP/1.0 is not supported by Liso server"},
+    {500, "Internal Server Error",
+          "The server encountered an unexpected condition."},
+    {0}
+};
 
 int main(int argc, char* argv[])
 {
-    int sock, s_sock, client_fd;
-    socklen_t client_size;
-    struct sockaddr_in addr, client_addr;
-    struct timeval tv;
-    static pool pool;
-    sigset_t mask;
+    int opt;
+    static struct option long_opts[] =
+    {
+        {"workers", required_argument, NULL, 'w'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"fastcgi", required_argument, NULL, 'f'},
+        {"max-body", required_argument, NULL, 'b'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"body-timeout", required_argument, NULL, 'B'},
+        {"keepalive-timeout", required_argument, NULL, 'K'},
+        {"write-timeout", required_argument, NULL, 'W'},
+        {"reject-rate", required_argument, NULL, 'r'},
+        {0, 0, 0, 0}
+    };
+
+    STATE.argv = argv;
+    STATE.max_body = MAX_BODY;
+    STATE.timeouts[TIMEOUT_HEADER] = HEADER_TIMEOUT;
+    STATE.timeouts[TIMEOUT_BODY] = BODY_TIMEOUT;
+    STATE.timeouts[TIMEOUT_KEEPALIVE] = KEEPALIVE_TIMEOUT;
+    STATE.timeouts[TIMEOUT_WRITE] = WRITE_TIMEOUT;
+    STATE.reject_rate = REJECT_RATE;
+
+    // parse options, they must come before the positional arguments
+    while ((opt = getopt_long(argc, argv, "+w:l:f:b:H:B:K:W:r:", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'w':
+                STATE.workers = (int)strtol(optarg, (char**)NULL, 10);
+                if (STATE.workers < 0 || STATE.workers > MAX_WORKERS)
+                    usage_exit();
+                break;
+            case 'l':
+                if ((log_level = log_parse_level(optarg)) < 0)
+                    usage_exit();
+                break;
+            case 'f':
+                STATE.fastcgi = (int)strtol(optarg, (char**)NULL, 10);
+                if (STATE.fastcgi < 0 || STATE.fastcgi > CGI_MAX_APPS)
+                    usage_exit();
+                break;
+            case 'b':
+                STATE.max_body = strtoll(optarg, (char**)NULL, 10);
+                if (STATE.max_body < 0) usage_exit();
+                break;
+            case 'H':
+            case 'B':
+            case 'K':
+            case 'W':
+                opt = (opt == 'H') ? TIMEOUT_HEADER : (opt == 'B') ? TIMEOUT_BODY :
+                      (opt == 'K') ? TIMEOUT_KEEPALIVE : TIMEOUT_WRITE;
+                STATE.timeouts[opt] = (int)strtol(optarg, (char**)NULL, 10);
+                if (STATE.timeouts[opt] < 0 || STATE.timeouts[opt] > MAX_TIMEOUT)
+                    usage_exit();
+                break;
+            case 'r':
+                STATE.reject_rate = (int)strtol(optarg, (char**)NULL, 10);
+                if (STATE.reject_rate < 0) usage_exit();
+                break;
+            default:
+                usage_exit();
+        }
+    }
 
-    if (argc != 9)  usage_exit();
+    if (argc - optind != 8)  usage_exit();
+    argv += optind - 1;  // so the positional arguments start at argv[1]
 
     // parse arguments
     STATE.port = (int)strtol(argv[1], (char**)NULL, 10);
@@ -53,135 +186,265 @@ int main(int argc, char* argv[])
 
     if (STATE.www_path[strlen(STATE.www_path)-1] == '/')
          STATE.www_path[strlen(STATE.www_path)-1] = '\0';
+    STATE.www_len = strlen(STATE.www_path);
 
+    // an upgraded server goes on with the log of the one it replaces
+    inherit_listeners();
     daemonize();
-    STATE.log = log_open(STATE.log_path);
+    STATE.log = log_open(STATE.log_path, ninherited ? "a" : "w");
     
-    Log("Start Liso server. Server is running in background. \n");
+    Log(LOG_INFO, "Start Liso server. Server is running in background. \n");
+
+    // FastCGI processes are shared by the workers forked later
+    cgi_init(STATE.fastcgi);
+
+    // and the MIME table, built once
+    mime_init();
+
+    // so are the metrics, one slot each
+    metrics_init(STATE.workers > 0 ? STATE.workers : 1);
+
+    // also shared: all workers get the same session ticket keys
+    STATE.tls_ctx = tls_init(STATE.key_path, STATE.ctf_path);
+
+    if (open_listeners() < 0)
+    {
+        clean();
+        return EXIT_FAILURE;
+    }
+
+    if (STATE.workers > 0)
+        return supervise_workers();
+
+    return run_server();
+}
+
+/******************************************************************************
+* subroutine: open_listenfd                                                   *
+* purpose:    create a non-blocking socket listening on the given port. In    *
+*             worker mode every worker binds its own socket with SO_REUSEPORT *
+*             and the kernel spreads new connections across them             *
+* parameters: port - the port to listen on                                    *
+* return:     the listening descriptor on success, -1 on failure              *
+******************************************************************************/
+int open_listenfd(int port)
+{
+    int sock, optval = 1;
+    struct sockaddr_in addr;
 
     /* all networked programs must create a socket
      * PF_INET - IPv4 Internet protocols
      * SOCK_STREAM - sequenced, reliable, two-way, connection-based byte stream
      * 0 (protocol) - use default protocol
      */
-    // create sock for HTTP connection
     if ((sock = socket(PF_INET, SOCK_STREAM, 0)) == -1)
     {
-        Log("Error: failed creating socket for HTTP connection.\n");
-        fclose(STATE.log);
-        return EXIT_FAILURE;
+        Log(LOG_ERROR, "Error: failed creating socket for port %d.\n", port);
+        return -1;
     }
+    Log(LOG_DEBUG, "Create socket success: sock =  %d \n", sock);
 
-    STATE.sock = sock;
-    Log("Create socket success: sock =  %d \n", sock);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (STATE.workers > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)))
+    {
+        Log(LOG_ERROR, "Error: failed setting SO_REUSEPORT.\n");
+        close(sock);
+        return -1;
+    }
 
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(STATE.port);
+    addr.sin_port = htons(port);
     addr.sin_addr.s_addr = INADDR_ANY;
     /* servers bind sockets to ports---notify the OS they accept connections */
     if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)))
     {
-        Log("Error: failed binding socket.\n");
-        clean();
-        return EXIT_FAILURE;
+        Log(LOG_ERROR, "Error: failed binding socket.\n");
+        close(sock);
+        return -1;
     }
-    Log("Bind success! \n");
+    Log(LOG_DEBUG, "Bind success! \n");
 
     if (listen(sock, MAX_CONN))
     {
-        Log("Error: listening on socket.\n");
-        clean();
-        return EXIT_FAILURE;
+        Log(LOG_ERROR, "Error: listening on socket.\n");
+        close(sock);
+        return -1;
     }
-    Log("Listen success! >>>>>>>>>>>>>>>>>>>> \n");
+    Log(LOG_INFO, "Listen success! >>>>>>>>>>>>>>>>>>>> \n");
+
+    // edge-triggered accept loops drain the queue until EAGAIN
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    return sock;
+}
+
+/******************************************************************************
+* subroutine: inherit_listeners                                               *
+* purpose:    pick up the listening sockets passed by a binary upgrade, and   *
+*             the pid of the server to retire once this one listens           *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void inherit_listeners()
+{
+    char *fds = getenv(ENV_FDS), *pid = getenv(ENV_OLD_PID), *end;
+    long fd;
+
+    if (fds == NULL || pid == NULL) return;
 
-    // create sock for HTTPS connection
-    Log("Create sock for HTTPS connection \n");
-    if ((s_sock = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+    while (ninherited < 2 * MAX_WORKERS)
     {
-        Log("Error: failed creating socket for HTTPS connection.\n");
-        close(sock);
-        fclose(STATE.log);
-        return EXIT_FAILURE;
+        fd = strtol(fds, &end, 10);
+        if (end == fds) break;
+        if (fd > 2) inherited[ninherited++] = (int)fd;   // never stdio
+        if (*end != ',') break;
+        fds = end + 1;
     }
+    old_pid = (pid_t)strtol(pid, (char**)NULL, 10);
 
-    STATE.s_sock = s_sock;
-    Log("Create HTTPS socket success: sock =  %d \n", s_sock);
+    // CGI programs don't need to see them
+    unsetenv(ENV_FDS);
+    unsetenv(ENV_OLD_PID);
+}
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(STATE.s_port);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    /* servers bind sockets to ports---notify the OS they accept connections */
-    if (bind(s_sock, (struct sockaddr *) &addr, sizeof(addr)))
+/******************************************************************************
+* subroutine: take_listener                                                   *
+* purpose:    take a passed listening socket bound to a port                  *
+* parameters: port - the port                                                 *
+* return:     the descriptor, -1 if none is left for the port                 *
+******************************************************************************/
+static int take_listener(int port)
+{
+    int i, fd;
+    struct sockaddr_in addr;
+    socklen_t len;
+
+    for (i = 0; i < ninherited; i++)
     {
-        Log("Error: failed binding socket.\n");
-        close(sock); close(s_sock); fclose(STATE.log);
-        return EXIT_FAILURE;
+        len = sizeof(addr);
+        if (inherited[i] < 0 ||
+            getsockname(inherited[i], (struct sockaddr *)&addr, &len) < 0 ||
+            addr.sin_family != AF_INET || ntohs(addr.sin_port) != port)
+            continue;
+
+        fd = inherited[i];
+        inherited[i] = -1;
+        Log(LOG_INFO, "Listen on passed socket %d for port %d \n", fd, port);
+        return fd;
+    }
+    return -1;
+}
+
+/******************************************************************************
+* subroutine: open_listeners                                                  *
+* purpose:    open the listening sockets of every worker, or the one pair of  *
+*             a single process. They are opened before the workers are        *
+*             forked, so a restarted worker takes over the queue of the one   *
+*             it replaces, and an upgrade can pass them all on. Sockets       *
+*             passed by the server being upgraded are used first              *
+* parameters: none                                                            *
+* return:     0 on success, -1 on failure                                     *
+******************************************************************************/
+int open_listeners()
+{
+    int i, k, port, n = (STATE.workers > 0) ? STATE.workers : 1;
+
+    for (i = 0; i < n; i++)
+    {
+        for (k = 0; k < 2; k++)
+        {
+            port = k ? STATE.s_port : STATE.port;
+            if ((STATE.listen_fd[i][k] = take_listener(port)) < 0 &&
+                (STATE.listen_fd[i][k] = open_listenfd(port)) < 0)
+                return -1;
+        }
     }
-    Log("Bind success! \n");
 
-    if (listen(s_sock, MAX_CONN))
+    // the old server had more workers: their queues are left to it
+    for (i = 0; i < ninherited; i++)
+        if (inherited[i] >= 0) close(inherited[i]);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: run_server                                                      *
+* purpose:    open the listening sockets and run the event loop until the     *
+*             server is asked to stop. Each worker runs its own copy          *
+* parameters: none                                                            *
+* return:     EXIT_FAILURE if the server could not be started                 *
+******************************************************************************/
+int run_server()
+{
+    static pool pool;
+    sigset_t mask;
+
+    metrics_attach(STATE.worker_id);
+
+    // the listening sockets were opened before the workers were forked
+    STATE.sock = STATE.listen_fd[STATE.worker_id][0];
+    STATE.s_sock = STATE.listen_fd[STATE.worker_id][1];
+
+    // one inotify instance per worker keeps the cache and the index current
+    if ((STATE.ino_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+        Log(LOG_ERROR, "Error: inotify_init failed \n");
+    cache_init(CACHE_MAX_BYTES, CACHE_MAX_ENTRIES, STATE.ino_fd);
+    tree_init(STATE.www_path, STATE.ino_fd);
+    init_responses();
+
+    if (init_pool(&pool) < 0)
     {
-        Log("Error: listening on socket.\n");
-        close(sock); close(s_sock); fclose(STATE.log);
+        Log(LOG_ERROR, "Error: failed creating epoll instance. \n");
+        close(STATE.sock); close(STATE.s_sock); log_close();
         return EXIT_FAILURE;
     }
-    Log("Listen success! >>>>>>>>>>>>>>>>>>>> \n");
-    init_pool(&pool);
+    if (STATE.workers == 0) retire_old();
 
-    // the main loop to wait for connections and serve requests
+    // the main loop to wait for connections and serve requests. Only
+    // SIGTERM may interrupt the wait, the others are acted on after it
     while (KEEPON)
     {
-       tv.tv_sec = 1; // timeout = 1 sec
-       tv.tv_usec = 0;
-       pool.ready_set = pool.read_set;
-
        sigemptyset(&mask);
        sigaddset(&mask, SIGHUP);
+       sigaddset(&mask, SIGUSR2);
+       sigaddset(&mask, SIGQUIT);
        sigprocmask(SIG_BLOCK, &mask, NULL);
-       pool.nready = select(pool.maxfd+1, &pool.ready_set, NULL, NULL, &tv);
+       pool.nready = epoll_wait(pool.epfd, pool.events, MAX_EVENTS,
+                                POOL_ADMITS(&pool) ? 0 : TIMER_TICK_MS);
        sigprocmask(SIG_UNBLOCK, &mask, NULL);
 
        if (pool.nready < 0)
        {
            if (errno == EINTR)
            {
-               Log("Shut down Server >>>>>>>>>>>>>>>>>>>> \n");
+               Log(LOG_INFO, "Shut down Server >>>>>>>>>>>>>>>>>>>> \n");
                break;
            }
           
-           Log("Error: select error \n");
+           Log(LOG_ERROR, "Error: epoll_wait error \n");
            continue;
        }
 
-       // if there is new connection, accept and add the new client to pool
-       if (FD_ISSET(sock, &pool.ready_set))
-       {
-           client_size = sizeof(client_addr);
-           client_fd = accept(sock, (struct sockaddr *) &client_addr,
-                              &client_size);
+       update_date();
+       cgi_check_pool();
 
-           if (client_fd < 0) ///TODO
-           {
-               Log("Error: accepting connection. \n");
-               continue;
-           }
+       // process each ready connected descriptor, then accept new
+       // connections as far as there is room for them
+       check_clients(&pool);
+       admit_clients(&pool);
 
-           Log("accept client: client_fd=%d \n", client_fd);
+       // close the connections which missed a deadline
+       timer_run(expire_client, &pool);
 
-           if (STATE.is_full)
-           {
-               pool.nready--;
-               serve_error(client_fd, "503", "Service Unavailable",
-                    "Server is too busy right now. Please try again later.", 1);
-               close(client_fd);
-           }
-           else
-              add_client(client_fd, &pool);
+       if (RELOAD) reload_server(1);
+       if (UPGRADE && STATE.workers == 0) upgrade_server();
+       UPGRADE = 0;   // workers leave upgrades to the master
+       if (DRAIN && drain_server(&pool) == 0)
+       {
+           Log(LOG_INFO, "Drained, shut down Server >>>>>>>>>>>>>>>>>>>> \n");
+           if (STATE.workers == 0 && old_lock[0]) unlink(old_lock);
+           break;
        }
-
-       // process each ready connected descriptor
-       check_clients(&pool);
     }
 
     lisod_shutdown();
@@ -189,16 +452,296 @@ int main(int argc, char* argv[])
     return EXIT_SUCCESS; // to make compiler happy
 }
 
+/******************************************************************************
+* subroutine: spawn_worker                                                    *
+* purpose:    fork a worker process which runs its own listeners, event loop  *
+*             and client pool                                                 *
+* parameters: id   - the slot number of the worker                           *
+*             mask - the signal mask the worker should run with               *
+* return:     pid of the worker in the master, -1 on failure                  *
+******************************************************************************/
+pid_t spawn_worker(int id, sigset_t *mask)
+{
+    int i;
+    pid_t pid;
+
+    if ((pid = fork()) != 0)
+    {
+        if (pid < 0) Log(LOG_ERROR, "Error: failed forking worker %d \n", id);
+        return pid;
+    }
+
+    // a worker only holds its own listeners, the master holds them all
+    for (i = 0; i < STATE.workers; i++)
+    {
+        if (i == id) continue;
+        close(STATE.listen_fd[i][0]);
+        close(STATE.listen_fd[i][1]);
+    }
+
+    STATE.worker_id = id;
+    signal(SIGCHLD, SIG_IGN);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+    Log(LOG_INFO, "Worker %d started: pid=%d \n", id, getpid());
+    exit(run_server());
+}
+
+/******************************************************************************
+* subroutine: supervise_workers                                               *
+* purpose:    start STATE.workers worker processes and restart any which      *
+*             exits while the server is running. On SIGTERM the workers are   *
+*             stopped before the master cleans up. SIGHUP and SIGQUIT are     *
+*             passed on to them, SIGUSR2 upgrades the binary                  *
+* parameters: none                                                            *
+* return:     does not return, the master exits through lisod_shutdown        *
+******************************************************************************/
+int supervise_workers()
+{
+    int i, status;
+    pid_t pid, *pids;
+    time_t *started;
+    sigset_t mask, orig;
+
+    pids = (pid_t *)calloc(STATE.workers, sizeof(pid_t));
+    started = (time_t *)calloc(STATE.workers, sizeof(time_t));
+
+    // only take signals while waiting in sigsuspend, so none gets lost
+    signal(SIGCHLD, signal_handler);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &mask, &orig);
+
+    for (i = 0; i < STATE.workers; i++)
+    {
+        started[i] = time(NULL);
+        pids[i] = spawn_worker(i, &orig);
+    }
+    retire_old();
+
+    while (KEEPON)
+    {
+        sigsuspend(&orig);
+
+        if (RELOAD)
+        {
+            reload_server(0);
+            for (i = 0; i < STATE.workers; i++)
+                if (pids[i] > 0) kill(pids[i], SIGHUP);
+        }
+        if (UPGRADE) upgrade_server();
+        UPGRADE = 0;
+        if (DRAIN == 1)
+        {
+            DRAIN = 2;   // passed on once
+            for (i = 0; i < STATE.workers; i++)
+                if (pids[i] > 0) kill(pids[i], SIGQUIT);
+        }
+
+        while (KEEPON && (pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for (i = 0; i < STATE.workers && pids[i] != pid; i++)
+                ;
+            if (i == STATE.workers)
+            {
+                cgi_respawn(pid);
+                continue;
+            }
+
+            // a drained worker is done, the new server has taken over
+            if (DRAIN)
+            {
+                pids[i] = 0;
+                continue;
+            }
+
+            Log(LOG_ERROR, "Error: worker %d (pid=%d) exited with status %d, restarting \n",
+                i, pid, status);
+
+            // don't spin if a worker dies right after starting
+            if (time(NULL) - started[i] < 1) sleep(1);
+            started[i] = time(NULL);
+            pids[i] = spawn_worker(i, &orig);
+        }
+
+        for (i = 0; DRAIN && i < STATE.workers && pids[i] <= 0; i++)
+            ;
+        if (DRAIN && i == STATE.workers)
+        {
+            Log(LOG_INFO, "Workers drained >>>>>>>>>>>>>>>>>>>> \n");
+            if (old_lock[0]) unlink(old_lock);
+            break;
+        }
+    }
+
+    Log(LOG_INFO, "Shut down workers >>>>>>>>>>>>>>>>>>>> \n");
+    for (i = 0; i < STATE.workers; i++)
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+    cgi_shutdown(); // the FastCGI processes are our children too
+    while (waitpid(-1, &status, 0) > 0 || errno == EINTR)
+        ;
+
+    free(pids);
+    free(started);
+    lisod_shutdown();
+    return EXIT_SUCCESS; // to make compiler happy
+}
+
+/******************************************************************************
+* subroutine: reload_server                                                   *
+* purpose:    act on SIGHUP: reopen the log after rotation, load the key and  *
+*             certificate again, find the CGI path again, and drop the cached *
+*             files and the index of the www tree, so the next request sees   *
+*             the files as deployed now. Requests in flight keep what they    *
+*             hold: cache entries are reference counted, and a TLS connection *
+*             keeps its certificate                                           *
+* parameters: caches - whether this process serves, and has caches to drop    *
+* return:     none                                                            *
+******************************************************************************/
+void reload_server(int caches)
+{
+    RELOAD = 0;
+    if (log_reopen(STATE.log_path) < 0)
+        Log(LOG_ERROR, "Error: failed reopening log file %s \n", STATE.log_path);
+    Log(LOG_INFO, "Reload configuration >>>>>>>>>>>>>>>>>>>> \n");
+
+    if (STATE.tls_ctx)
+        tls_reload(STATE.tls_ctx, STATE.key_path, STATE.ctf_path);
+    else
+        STATE.tls_ctx = tls_init(STATE.key_path, STATE.ctf_path);
+    cgi_reload();
+
+    if (!caches) return;
+    cache_flush();
+    tree_reload();
+}
+
+/******************************************************************************
+* subroutine: upgrade_server                                                  *
+* purpose:    act on SIGUSR2: run the command line again, which starts the    *
+*             binary now deployed, and pass it the listening sockets. Both    *
+*             servers accept from the same queues until the new one listens   *
+*             and sends SIGQUIT to this one, so no connection is refused. The *
+*             lock file is moved to '<lock>.oldbin' for the new server         *
+* parameters: none                                                            *
+* return:     0 if the new binary was started, -1 otherwise                   *
+******************************************************************************/
+int upgrade_server()
+{
+    int i, err, len = 0, pfd[2], n = (STATE.workers > 0) ? STATE.workers : 1;
+    char fds[2 * MAX_WORKERS * 12], pid[16];
+    pid_t child;
+    sigset_t none;
+
+    // a failed attempt may have moved the lock file already
+    snprintf(old_lock, sizeof(old_lock), "%s.oldbin", STATE.lck_path);
+    if (rename(STATE.lck_path, old_lock) < 0 && errno != ENOENT)
+    {
+        Log(LOG_ERROR, "Error: upgrade can't move the lock file: %s \n", strerror(errno));
+        old_lock[0] = '\0';
+        return -1;
+    }
+
+    for (i = 0; i < n; i++)
+        len += snprintf(fds + len, sizeof(fds) - len, "%s%d,%d", i ? "," : "",
+                        STATE.listen_fd[i][0], STATE.listen_fd[i][1]);
+    snprintf(pid, sizeof(pid), "%d", getpid());
+
+    // the pipe is closed by a successful exec, else it carries the errno
+    if (pipe2(pfd, O_CLOEXEC) < 0)
+    {
+        Log(LOG_ERROR, "Error: upgrade failed creating a pipe \n");
+        rename(old_lock, STATE.lck_path);
+        return -1;
+    }
+    if ((child = fork()) == 0)
+    {
+        close(pfd[0]);
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        setenv(ENV_FDS, fds, 1);
+        setenv(ENV_OLD_PID, pid, 1);
+        execvp(STATE.argv[0], STATE.argv);
+        err = errno;
+        write(pfd[1], &err, sizeof(err));
+        _exit(EXIT_FAILURE);
+    }
+    close(pfd[1]);
+    err = (child < 0) ? errno : 0;
+    if (child > 0 && read(pfd[0], &err, sizeof(err)) <= 0) err = 0;
+    close(pfd[0]);
+
+    if (child < 0 || err != 0)
+    {
+        Log(LOG_ERROR, "Error: upgrade failed running %s: %s \n",
+            STATE.argv[0], strerror(err));
+        rename(old_lock, STATE.lck_path);
+        return -1;
+    }
+    Log(LOG_INFO, "Upgrade: started %s with listeners %s \n", STATE.argv[0], fds);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: retire_old                                                      *
+* purpose:    after an upgrade, tell the old server to drain once this one    *
+*             accepts connections                                             *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void retire_old()
+{
+    if (old_pid <= 0) return;
+
+    Log(LOG_INFO, "Upgrade: listening, retiring old server pid=%d \n", old_pid);
+    kill(old_pid, SIGQUIT);
+    old_pid = 0;
+}
+
+/******************************************************************************
+* subroutine: drain_server                                                    *
+* purpose:    act on SIGQUIT: stop accepting, and let each response close its *
+*             connection, so the process exits once the requests in flight    *
+*             are answered. Connections idle for DRAIN_IDLE seconds are       *
+*             closed; closing a busy one at once would race its next request. *
+*             Called on every turn of the loop while draining                 *
+* parameters: p - pointer to the pool instance                                *
+* return:     the number of connections still open                            *
+******************************************************************************/
+int drain_server(pool *p)
+{
+    // the master, or the new server, still holds the sockets: they must
+    // leave the epoll set before they are closed here
+    if (STATE.sock >= 0)
+    {
+        Log(LOG_INFO, "Draining %d connections >>>>>>>>>>>>>>>>>>>> \n", p->nconn);
+        epoll_ctl(p->epfd, EPOLL_CTL_DEL, STATE.sock, NULL);
+        epoll_ctl(p->epfd, EPOLL_CTL_DEL, STATE.s_sock, NULL);
+        close_socket(STATE.sock);
+        close_socket(STATE.s_sock);
+        STATE.sock = STATE.s_sock = -1;
+        p->backlog = 0;
+    }
+
+    while (p->idle_head >= 0 &&
+           p->clients[p->idle_head].idle_since + DRAIN_IDLE <= date_time)
+        remove_client(p->idle_head, p);
+    return p->nconn;
+}
+
 void lisod_shutdown()
 {
-    Log("cleaning up. \n");
+    Log(LOG_INFO, "cleaning up. \n");
     clean();
     exit(EXIT_SUCCESS);
 }
 
 void daemonize()
 {
-    int i, lfp, pid;
+    int i, j, lfp, pid;
     char str[256] = {0};
     
     // drop to have init as parent process
@@ -209,11 +752,16 @@ void daemonize()
     // obtain a new process group 
     setsid();
 
-    // close all descriptor
-    for (i=getdtablesize(); i>=0; i--)  close(i);
+    // close all descriptor, but the listeners passed by an upgrade
+    for (i=getdtablesize(); i>=0; i--)
+    {
+        for (j = 0; j < ninherited && inherited[j] != i; j++)
+            ;
+        if (j == ninherited) close(i);
+    }
 
     // redirect stdio
-    i = open("dev/null", O_RDWR);
+    i = open("/dev/null", O_RDWR);
     dup(i); //stdout
     dup(i); //stderr
 
@@ -231,9 +779,12 @@ void daemonize()
     write(lfp, str, strlen(str)); // record pid to lockfile
 
     signal(SIGCHLD, SIG_IGN); // ignore 
+    signal(SIGPIPE, SIG_IGN); // peers closing early must not kill the server
 
     signal(SIGHUP, signal_handler);  // install hangup signal
     signal(SIGTERM, signal_handler); // kill signal
+    signal(SIGUSR2, signal_handler); // binary upgrade
+    signal(SIGQUIT, signal_handler); // graceful stop
 }
 
 /******************************************************************************
@@ -245,42 +796,110 @@ void daemonize()
 void usage_exit()
 {
     fprintf(stdout,
-            "Usage: ./lisod <HTTP port> <HTTPS port> <log file> <lock file> \n"
-            "       <www folder> <CGI folder or script name> <private key file> \n"
-            "       <certificate file> \n"
+            "Usage: ./lisod [--workers N] [--log-level L] [--fastcgi N] \n"
+            "       [--max-body BYTES] [--header-timeout S] [--body-timeout S] \n"
+            "       [--keepalive-timeout S] [--write-timeout S] [--reject-rate N] \n"
+            "       <HTTP port> <HTTPS port> <log file> \n"
+            "       <lock file> <www folder> <CGI folder or script name> \n"
+            "       <private key file> <certificate file> \n"
             "Command line descriptions: \n"
+            "    --workers N - run N worker processes under a supervising master \n"
+            "    --log-level L - error, warn, info (default) or debug \n"
+            "    --fastcgi N - run the CGI script as N persistent FastCGI processes \n"
+            "    --max-body BYTES - largest request body accepted (default 1GB) \n"
+            "    --header-timeout S - seconds to receive a request head (default 20) \n"
+            "    --body-timeout S - seconds a request body may pause (default 60) \n"
+            "    --keepalive-timeout S - seconds an idle connection is kept (default 15) \n"
+            "    --write-timeout S - seconds a response may stall (default 60) \n"
+            "                 a timeout of 0 never expires \n"
+            "    --reject-rate N - 503s sent per second while full (default 64), \n"
+            "                 further connections wait in the listen queue \n"
             "    HTTP port - the port for HTTP server to listen on \n"
             "    HTTPS port - the port for HTTPS server to listen on \n"
             "    log file   - file to send log messages to \n"
             "    lock file  - file to lock on when becoming a daemon process \n"
             "    www folder - folder containing a tree to serve as the root of a website \n"
-            "    CGI folder - folder containign CGI programs \n"
+            "    CGI folder - folder containing CGI programs, or one CGI script \n"
             "    private key file - private key file path \n"
             "    certificate file - certificate file path \n"
+            "Signals: HUP reloads files and reopens the log, USR2 upgrades to \n"
+            "    the binary now installed, QUIT stops after the requests in \n"
+            "    flight, TERM stops \n"
             );
     exit(EXIT_FAILURE);
 }
 
 /******************************************************************************
 * subroutine: init_pool                                                       *
-* purpose:    setup the initial value for pool attributes                     *
-* parameters: sock - the descriptor server using to listen client connections *
-*             p    - pointer to pool instance                                 *
-* return:     none                                                            *
+* purpose:    setup the initial value for pool attributes, size the client    *
+*             table from the descriptor limit and register both listening     *
+*             sockets with a new epoll instance                               *
+* parameters: p    - pointer to pool instance                                 *
+* return:     0 on success, -1 on failure                                     *
 ******************************************************************************/
-void init_pool (pool *p)
+int init_pool(pool *p)
 {
-    // Initialize descriptors
     int i;
-    p->maxi = -1;
-    for (i=0; i< FD_SETSIZE; i++)
-        p->clientfd[i] = -1;
-
-    p->maxfd = STATE.s_sock;
-    FD_ZERO(&p->read_set);
-    FD_SET(STATE.sock, &p->read_set);
-    FD_SET(STATE.s_sock, &p->read_set);
+    struct rlimit rl;
+    struct epoll_event ev;
+
+    // allow as many descriptors as the hard limit permits, up to MAX_FDS,
+    // so that every descriptor indexes the client and owner tables
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+        (rl.rlim_cur < rl.rlim_max || rl.rlim_cur > MAX_FDS))
+    {
+        rl.rlim_cur = (rl.rlim_max > MAX_FDS) ? MAX_FDS : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY)
+        rl.rlim_cur = FD_SETSIZE;
+    if (rl.rlim_cur > MAX_FDS)
+        rl.rlim_cur = MAX_FDS;
+
+    p->nready = 0;
+    p->nconn = 0;
+    p->maxconn = (int)rl.rlim_cur;
+    p->events = (struct epoll_event *)calloc(MAX_EVENTS, sizeof(struct epoll_event));
+    p->clients = (client *)calloc(p->maxconn, sizeof(client));
+    p->owner = (int *)malloc(p->maxconn * sizeof(int));
+    if (p->events == NULL || p->clients == NULL || p->owner == NULL) return -1;
+
+    // buffers and request state are taken when needed and recycled
+    slab_init(SLAB_RIO, MAX_LINE, SLAB_KEEP);
+    slab_init(SLAB_OUT, BUF_SIZE, SLAB_KEEP);
+    slab_init(SLAB_CONTEXT, sizeof(HTTPContext), SLAB_KEEP);
+    slab_init(SLAB_PATH, MAX_PATH, SLAB_KEEP);
+    slab_init(SLAB_COND, sizeof(http_cond), SLAB_KEEP / 4);
+    slab_init(SLAB_ENV, sizeof(cgi_env), SLAB_KEEP / 4);
+    slab_init(SLAB_CGI, sizeof(cgi_proc), SLAB_KEEP / 4);
+    slab_init(SLAB_CHUNK, CGI_CHUNK + 8, SLAB_KEEP / 4);
+    timer_init(TIMER_TICK_MS);
+
+    for (i=0; i< p->maxconn; i++)
+    {
+        p->clients[i].rio.rio_fd = -1;
+        p->clients[i].idle_prev = p->clients[i].idle_next = -1;
+        p->owner[i] = -1;
+    }
+    p->idle_head = p->idle_tail = -1;
+    p->backlog = 0;
+    p->reject_budget = 0;
+    p->budget_time = 0;
+    p->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if ((p->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) return -1;
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = STATE.sock;
+    if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, STATE.sock, &ev) < 0) return -1;
+    ev.data.fd = STATE.s_sock;
+    if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, STATE.s_sock, &ev) < 0) return -1;
+    ev.data.fd = STATE.ino_fd;
+    if (STATE.ino_fd >= 0 &&
+        epoll_ctl(p->epfd, EPOLL_CTL_ADD, STATE.ino_fd, &ev) < 0) return -1;
+
     STATE.is_full = 0;
+    return 0;
 }
 
 /******************************************************************************
@@ -288,516 +907,2704 @@ void init_pool (pool *p)
 * purpose:    add a new client to the pool and update pool attributes         *
 * parameters: client_fd - the descriptor of new client                        *
 *             p    - pointer to pool instance                                 *
+*             is_secure - the client came in on the HTTPS port                *
 * return:     0 on success, -1 on failure                                     *
 ******************************************************************************/
-int add_client(int client_fd, pool *p)
+int add_client(int client_fd, pool *p, int is_secure)
 {
-    int i;
-    p->nready--;
+    SSL *ssl = NULL;
+    struct epoll_event ev;
 
     if (STATE.is_full) return -1;
- 
-    // only accept FD_SETSIZE - 5 clients to keep server from overloading
-    for (i=0; i<(FD_SETSIZE - 5); i++)
-    {
-        if (p->clientfd[i] < 0)
-        {
-            // add client descriptor to the pool
-            p->clientfd[i] = client_fd;
-
-            // add the descriptor to the descriptor set
-            FD_SET(client_fd, &p->read_set);
-
-            // add read buf
-             rio_readinitb(&p->clientrio[i], client_fd);
 
-            // update max descriptor and pool highwater mark
-            if (client_fd > p->maxfd)
-                p->maxfd = client_fd;
-            if (i > p->maxi)
-                p->maxi = i;
-            break;
-        }
-    }
-    
-    if (i == (FD_SETSIZE - 5))
+    // keep a few descriptors in reserve for log, lock and listening sockets
+    if (client_fd >= p->maxconn || p->nconn >= p->maxconn - FD_RESERVE)
     {   
         STATE.is_full = 1;
-        Log ("Error: too many clients. \n");
+        Log(LOG_WARN, "Error: too many clients. \n");
         return -1;
     }
+
+    if (is_secure && (ssl = tls_new(STATE.tls_ctx, client_fd)) == NULL)
+    {
+        Log(LOG_ERROR, "Error: failed creating TLS state for client_fd=%d \n", client_fd);
+        return -1;
+    }
+
+    // EPOLLOUT edges resume responses which filled the socket buffer
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = client_fd;
+    if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+    {
+        Log(LOG_ERROR, "Error: epoll_ctl failed adding client_fd=%d \n", client_fd);
+        if (ssl) SSL_free(ssl);
+        return -1;
+    }
+
+    // add read buf and start waiting for a request line
+    rio_readinitb(&p->clients[client_fd].rio, client_fd);
+    p->clients[client_fd].rio.rio_ssl = ssl;
+    p->clients[client_fd].handshake = (ssl != NULL);
+    p->clients[client_fd].state = CONN_REQLINE;
+    p->clients[client_fd].context = NULL;
+    p->clients[client_fd].cgi = NULL;
+    p->clients[client_fd].chunk = NULL;
+    p->clients[client_fd].closing = 0;
+    p->clients[client_fd].niov = 0;
+    p->clients[client_fd].queued = 0;
+    p->clients[client_fd].paused = 0;
+    p->clients[client_fd].overflow = 0;
+    p->clients[client_fd].olen = 0;
+    p->clients[client_fd].obuf = NULL;
+    p->clients[client_fd].send_fd = -1;
+    p->clients[client_fd].parts = NULL;
+    p->clients[client_fd].timeout = TIMEOUT_HEADER;  // the first request is due
+    if (STATE.timeouts[TIMEOUT_HEADER] > 0)
+        timer_set(&p->clients[client_fd].timer,
+                  STATE.timeouts[TIMEOUT_HEADER] * 1000);
+    p->nconn++;
+    METRICS->accepted++;
+    METRICS->active++;
+
+    if (p->nconn >= p->maxconn - FD_RESERVE)
+        STATE.is_full = 1;
     return 0;
 }
 
 /******************************************************************************
 * subroutine: remove_client                                                   *
 * purpose:    remove a client from the pool after close a connection          *
-* parameters: id - the index number of the client in the pool                 *
+* parameters: id - the descriptor of the client in the pool                   *
 *             p - pointer to the pool instance                                *
-* return:     none                       `                                    *
+* return:     none                                                            *
 ******************************************************************************/
 void remove_client(int id, pool *p)
 {
-    FD_CLR(p->clientfd[id], &p->read_set);
-    if (close(p->clientfd[id]) < 0) Log("Error: close client fd error");
-    p->clientfd[id] = -1;
+    if (p->clients[id].rio.rio_ssl)
+    {
+        tls_close(p->clients[id].rio.rio_ssl);
+        p->clients[id].rio.rio_ssl = NULL;
+    }
+
+    // a program still answering for this client is stopped
+    if (p->clients[id].cgi) finish_cgi(id, p, 1);
+
+    // closing the descriptor also drops it from the epoll interest list
+    if (close(id) < 0) Log(LOG_ERROR, "Error: close client fd error");
+    p->clients[id].rio.rio_fd = -1;
+
+    // drop a request which was only partially received or sent
+    timer_del(&p->clients[id].timer);
+    idle_remove(p, id);
+    free_context(&p->clients[id]);
+    out_reset(&p->clients[id]);
+    slab_free(SLAB_CHUNK, p->clients[id].chunk);
+    p->clients[id].chunk = NULL;
+    rio_release(&p->clients[id].rio);
+    p->nconn--;
+    METRICS->active--;
     STATE.is_full = 0;
 }
 
 /******************************************************************************
-* subroutine: check_clients                                                   *
-* purpose:    process the ready set from the set of descriptors               *
-* parameters: p - pointer to the pool instance                                *
-* return:     0 on success, -1 on failure                                     *
+* subroutine: idle_append                                                     *
+* purpose:    put a client at the tail of the idle list, the end evicted last *
+* parameters: p  - pointer to the pool instance                               *
+*             id - the descriptor of the client in the pool                   *
+* return:     none                                                            *
 ******************************************************************************/
-void check_clients(pool *p)
+void idle_append(pool *p, int id)
 {
-    int i, connfd, is_closed;
-
-    for (i=0; (i <= p->maxi) && (p->nready > 0); i++)
-    {
-        connfd = p->clientfd[i];
+    client *c = &p->clients[id];
 
-        if ((connfd > 0) && (FD_ISSET(connfd, &p->ready_set)))
-        {
-            p->nready--;
-            is_closed = 0;
-            process_request(i, p, &is_closed);
-            if (is_closed) remove_client(i, p);
-        }
-    }
+    idle_remove(p, id);
+    c->idle_since = date_time;
+    c->idle_prev = p->idle_tail;
+    if (p->idle_tail >= 0)
+        p->clients[p->idle_tail].idle_next = id;
+    else
+        p->idle_head = id;
+    p->idle_tail = id;
 }
 
 /******************************************************************************
-* subroutine: process_request                                                 *
-* purpose:    handle a single request and return responses                    *
-* parameters: id        - the index of the client in the pool                 *
-*             p         - a pointer of pool struct                            *
-*             is_closed - idicator if the transaction is closed               *
+* subroutine: idle_remove                                                     *
+* purpose:    take a client off the idle list, if it is on it                 *
+* parameters: p  - pointer to the pool instance                               *
+*             id - the descriptor of the client in the pool                   *
 * return:     none                                                            *
 ******************************************************************************/
-void process_request(int id, pool *p, int *is_closed)
+void idle_remove(pool *p, int id)
 {
-    HTTPContext *context = (HTTPContext *)calloc(1, sizeof(HTTPContext));
+    client *c = &p->clients[id];
 
-    Log("Start processing request. \n");
+    if (c->idle_prev < 0 && p->idle_head != id) return;
 
-    // parse request line (get method, uri, version)
-    if (parse_requestline(id, p, context, is_closed) < 0) goto Done;
+    if (c->idle_prev >= 0)
+        p->clients[c->idle_prev].idle_next = c->idle_next;
+    else
+        p->idle_head = c->idle_next;
+    if (c->idle_next >= 0)
+        p->clients[c->idle_next].idle_prev = c->idle_prev;
+    else
+        p->idle_tail = c->idle_prev;
+    c->idle_prev = c->idle_next = -1;
+}
 
-    // check HTTP method (support GET, POST, HEAD now)
-    if (strcasecmp(context->method, "GET")  && 
-        strcasecmp(context->method, "HEAD") && 
-        strcasecmp(context->method, "POST"))
+/******************************************************************************
+* subroutine: new_context                                                     *
+* purpose:    start a new request of a client, with recycled state            *
+* parameters: c - the client                                                  *
+* return:     0 on success, -1 if out of memory                               *
+******************************************************************************/
+int new_context(client *c)
+{
+    HTTPContext *context = (HTTPContext *)slab_alloc(SLAB_CONTEXT);
+
+    if (context == NULL) return -1;
+    memset(context, 0, sizeof(HTTPContext));
+    context->method = METHOD_OTHER;
+    context->is_secure = (c->rio.rio_ssl != NULL);
+    c->context = context;
+    c->timeout = TIMEOUT_NONE;  // its head gets a deadline of its own
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: free_context                                                    *
+* purpose:    release the request a client is working on, if any              *
+* parameters: c - the client                                                  *
+* return:     none                                                            *
+******************************************************************************/
+void free_context(client *c)
+{
+    if (c->context == NULL) return;
+
+    slab_free(SLAB_ENV, c->context->env);
+    slab_free(SLAB_PATH, c->context->filename);
+    slab_free(SLAB_COND, c->context->cond);
+    slab_free(SLAB_CONTEXT, c->context);
+    c->context = NULL;
+    c->rio.rio_mark = NULL;   // the head is not needed any more
+}
+
+/******************************************************************************
+* subroutine: admit_clients                                                   *
+* purpose:    take connections from the listening sockets which have some     *
+*             queued. Called once the ready clients are served, and refills  *
+*             the 503 budget every second                                     *
+* parameters: p - pointer to the pool instance                                *
+* return:     none                                                            *
+******************************************************************************/
+void admit_clients(pool *p)
+{
+    time_t now;
+
+    if (p->backlog == 0) return;
+
+    if ((now = time(0)) != p->budget_time)
+    {
+        p->budget_time = now;
+        p->reject_budget = STATE.reject_rate;
+    }
+
+    if (p->backlog & BACKLOG_HTTP) accept_clients(STATE.sock, p);
+    if (p->backlog & BACKLOG_HTTPS) accept_clients(STATE.s_sock, p);
+}
+
+/******************************************************************************
+* subroutine: accept_clients                                                  *
+* purpose:    accept up to ACCEPT_BATCH pending connections on a listening    *
+*             socket. The socket is edge-triggered, so its backlog bit stays  *
+*             set until accept4 reports EAGAIN. When the pool is full the     *
+*             longest idle keep-alive client makes room; with none, a         *
+*             connection gets a 503 while the budget lasts, and after that    *
+*             the rest wait in the listen queue                               *
+* parameters: listen_fd - the listening descriptor                            *
+*             p         - pointer to the pool instance                        *
+* return:     none                                                            *
+******************************************************************************/
+void accept_clients(int listen_fd, pool *p)
+{
+    int i, fd, client_fd, optval = 1, is_secure = (listen_fd == STATE.s_sock);
+    int bit = is_secure ? BACKLOG_HTTPS : BACKLOG_HTTP;
+
+    for (i = 0; i < ACCEPT_BATCH; i++)
+    {
+        // under pressure, leave the queue alone rather than accept a
+        // connection only to drop it
+        if (STATE.is_full && !POOL_EVICTS(p) && p->reject_budget == 0)
+            return;
+
+        client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client_fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+
+            // out of descriptors: the spare one lets a connection be
+            // accepted and turned away, instead of sitting in the queue
+            if ((errno == EMFILE || errno == ENFILE) && p->spare_fd >= 0)
+            {
+                close(p->spare_fd);
+                if ((client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+                    reject_client(client_fd, p, is_secure);
+                p->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (client_fd >= 0) continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                Log(LOG_ERROR, "Error: accepting connection. \n");
+            p->backlog &= ~bit;
+            return;
+        }
+
+        Log(LOG_DEBUG, "accept client: client_fd=%d \n", client_fd);
+        // responses are coalesced with MSG_MORE already; Nagle would only
+        // hold back the tail of a batch split over several sendmsg() calls
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+        // without a key and certificate the HTTPS port is not served
+        if (is_secure && STATE.tls_ctx == NULL)
+        {
+            close(client_fd);
+            continue;
+        }
+
+        // make room by closing the longest idle client. Slots are indexed
+        // by descriptor, so one past the table moves down to the freed one
+        if ((STATE.is_full || client_fd >= p->maxconn) && evict_idle(p) == 0 &&
+            client_fd >= p->maxconn)
+        {
+            fd = fcntl(client_fd, F_DUPFD_CLOEXEC, 0);
+            close(client_fd);
+            if ((client_fd = fd) < 0) continue;
+        }
+
+        if (add_client(client_fd, p, is_secure) < 0)
+            reject_client(client_fd, p, is_secure);
+    }
+}
+
+/******************************************************************************
+* subroutine: evict_idle                                                      *
+* purpose:    close the keep-alive client which has been idle the longest,    *
+*             if for EVICT_IDLE seconds at least. A client which has only     *
+*             just been answered is likely to send its next request           *
+* parameters: p - pointer to the pool instance                                *
+* return:     0 on success, -1 if no client is idle                           *
+******************************************************************************/
+int evict_idle(pool *p)
+{
+    int id = p->idle_head;
+
+    if (!POOL_EVICTS(p)) return -1;
+
+    Log(LOG_DEBUG, "evict idle client: client_fd=%d \n", id);
+    METRICS->evicted++;
+    remove_client(id, p);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: reject_client                                                   *
+* purpose:    turn away a connection the pool has no room for. It gets the    *
+*             rendered 503 while this second's budget lasts, then is closed   *
+* parameters: client_fd - the descriptor of the connection                    *
+*             p         - pointer to the pool instance                        *
+*             is_secure - it came in on the HTTPS port, no TLS is set up     *
+* return:     none                                                            *
+******************************************************************************/
+void reject_client(int client_fd, pool *p, int is_secure)
+{
+    METRICS->rejected++;
+    if (p->reject_budget > 0)
+    {
+        p->reject_budget--;
+        if (!is_secure) send_error(client_fd, 503, 1);
+    }
+    close(client_fd);
+}
+
+/******************************************************************************
+* subroutine: check_clients                                                   *
+* purpose:    process the descriptors reported ready by epoll_wait            *
+* parameters: p - pointer to the pool instance                                *
+* return:     none                                                            *
+******************************************************************************/
+void check_clients(pool *p)
+{
+    int i, connfd;
+
+    for (i=0; i < p->nready; i++)
+    {
+        connfd = p->events[i].data.fd;
+
+        // new connections wait until the ready clients are served
+        if (connfd == STATE.sock || connfd == STATE.s_sock)
+        {
+            p->backlog |= (connfd == STATE.sock) ? BACKLOG_HTTP : BACKLOG_HTTPS;
+            continue;
+        }
+        if (connfd == STATE.ino_fd)
+        {
+            handle_inotify();
+            continue;
+        }
+        if (p->owner[connfd] >= 0)
+        {
+            check_cgi(connfd, p, p->events[i].events);
+            continue;
+        }
+
+        if (p->clients[connfd].rio.rio_fd >= 0)
+            handle_client(connfd, p, p->events[i].events);
+    }
+}
+
+/******************************************************************************
+* subroutine: handle_client                                                   *
+* purpose:    make all the progress a client allows: finish the handshake,   *
+*             resume a pending response or CGI program, then read and answer *
+*             requests until the socket is drained                            *
+* parameters: id     - the descriptor of the client in the pool               *
+*             p      - pointer to the pool instance                           *
+*             events - the epoll events of the socket, 0 when called because *
+*                      its CGI program made progress                          *
+* return:     none                                                            *
+******************************************************************************/
+void handle_client(int id, pool *p, uint32_t events)
+{
+    int is_closed, more, ret;
+    client *c = &p->clients[id];
+
+    if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN))
+    {
+        remove_client(id, p);
+        return;
+    }
+
+    // a TLS client completes the handshake before sending any request
+    if (c->handshake)
+    {
+        if ((ret = tls_accept(c->rio.rio_ssl)) < 0)
+        {
+            remove_client(id, p);
+            return;
+        }
+        if (ret == TLS_AGAIN) return;
+        c->handshake = 0;
+    }
+
+    is_closed = c->closing;
+
+    // resume a response which was waiting for the socket to drain
+    if (OUT_PENDING(c) && (events & EPOLLOUT) && out_flush(c) < 0)
+        is_closed = 1;
+
+    // pass on what the CGI program wrote while the socket was full
+    if (c->cgi && !OUT_PENDING(c)) pump_cgi(id, p);
+    if (c->closing) is_closed = 1;
+
+    // a client paused for not taking its responses is read again once its
+    // queue is down to the low watermark; until then the kernel buffers
+    // what it sends, and TCP flow control slows it down
+    if (c->paused && OUT_QUEUED(c) <= OUT_LOW_WATER) c->paused = 0;
+
+    // read whatever is ready and advance the request state machine, until
+    // the socket is drained (edges are only reported once). The body of a
+    // request is read to its end even if the connection closes after it
+    while (!c->paused && (!is_closed || c->state == CONN_BODY))
+    {
+        more = rio_fill(&c->rio);
+        process_request(id, p, &is_closed);
+        if (OUT_QUEUED(c) >= OUT_HIGH_WATER)
+        {
+            c->paused = 1;
+            METRICS->paused++;
+        }
+        if (more < 0)
+        {
+            is_closed = 1;  // EOF or read error
+            if (c->state == CONN_BODY && !c->stalled)
+            {
+                // the body is cut short, its request can't be answered
+                if (c->cgi) finish_cgi(id, p, 1);
+                free_context(c);
+                c->state = CONN_REQLINE;
+            }
+        }
+        if (more <= 0 || RIO_FULL(&c->rio)) break;
+    }
+
+    // between requests an idle connection keeps no buffer
+    if (c->rio.rio_cnt == 0 && c->context == NULL) rio_release(&c->rio);
+
+    if (is_closed)
+    {
+        if (OUT_PENDING(c) || c->cgi || c->state == CONN_BODY)
+            c->closing = 1;   // finish the request in flight first
+        else
+            remove_client(id, p);
+    }
+
+    if (c->rio.rio_fd >= 0) set_timeout(id, p, events != 0);
+}
+
+/******************************************************************************
+* subroutine: set_timeout                                                     *
+* purpose:    arm the timer of a client for what it is waiting on now. The    *
+*             head of a request has a deadline from its first byte; a body,   *
+*             a response and an idle connection are timed from the last      *
+*             progress. Nothing is timed while a CGI program works            *
+* parameters: id       - the descriptor of the client in the pool             *
+*             p        - pointer to the pool instance                         *
+*             progress - the socket had an event, so the client moved on      *
+* return:     none                                                            *
+******************************************************************************/
+void set_timeout(int id, pool *p, int progress)
+{
+    int timeout;
+    client *c = &p->clients[id];
+
+    if (OUT_PENDING(c))
+        timeout = TIMEOUT_WRITE;
+    else if (c->handshake || (c->context == NULL && c->timeout == TIMEOUT_HEADER))
+        timeout = TIMEOUT_HEADER;   // no request yet, still due from accept
+    else if (c->context == NULL)
+        timeout = c->cgi ? TIMEOUT_NONE : TIMEOUT_KEEPALIVE;
+    else if (c->state == CONN_BODY)
+        timeout = c->stalled ? TIMEOUT_NONE : TIMEOUT_BODY;
+    else if (c->state == CONN_RESPONSE)
+        timeout = TIMEOUT_NONE;
+    else
+        timeout = TIMEOUT_HEADER;
+
+    if (timeout == c->timeout && (!progress || timeout == TIMEOUT_HEADER))
+        return;
+
+    // idle keep-alive clients are listed in the order they went idle
+    if (timeout == TIMEOUT_KEEPALIVE)
+        idle_append(p, id);
+    else
+        idle_remove(p, id);
+
+    c->timeout = timeout;
+    if (timeout == TIMEOUT_NONE || STATE.timeouts[timeout] == 0)
+        timer_del(&c->timer);
+    else
+        timer_set(&c->timer, STATE.timeouts[timeout] * 1000);
+}
+
+/******************************************************************************
+* subroutine: expire_client                                                   *
+* purpose:    close a client which missed its deadline, called by timer_run.  *
+*             A request cut short is answered 408 if nothing else is queued   *
+* parameters: t   - the timer of the client                                   *
+*             arg - pointer to the pool instance                              *
+* return:     none                                                            *
+******************************************************************************/
+void expire_client(timer_node *t, void *arg)
+{
+    pool *p = (pool *)arg;
+    client *c = (client *)((char *)t - offsetof(client, timer));
+    int id = c->rio.rio_fd;
+
+    METRICS->timeouts[c->timeout]++;
+    Log(LOG_INFO, "Info: %s timeout, closing client_fd=%d \n",
+        timeout_names[c->timeout], id);
+
+    if ((c->timeout == TIMEOUT_HEADER || c->timeout == TIMEOUT_BODY) &&
+        c->context != NULL && c->cgi == NULL && !OUT_PENDING(c))
+    {
+        serve_error(c, 408, 1);
+        out_flush(c);
+    }
+    remove_client(id, p);
+}
+
+/******************************************************************************
+* subroutine: process_request                                                 *
+* purpose:    advance the request state machine of a client as far as the     *
+*             buffered bytes allow. Every pipelined request already in the    *
+*             buffer is answered, the responses are queued in order and sent  *
+*             together with one flush at the end                              *
+* parameters: id        - the descriptor of the client in the pool            *
+*             p         - a pointer of pool struct                            *
+*             is_closed - idicator if the transaction is closed               *
+* return:     none                                                            *
+******************************************************************************/
+void process_request(int id, pool *p, int *is_closed)
+{
+    int ret;
+    uint64_t start;
+    client *c = &p->clients[id];
+    HTTPContext *context;
+
+    for (;;)
+    {
+        // a file body must leave before anything queued behind it, and the
+        // segment list is bounded: flush, and wait for EPOLLOUT if it's stuck
+        if (c->send_fd >= 0 || c->parts || OUT_FULL(c))
+        {
+            if (out_flush(c) < 0)
+            {
+                *is_closed = 1;
+                break;
+            }
+            if (OUT_PENDING(c)) return;
+        }
+
+        if (c->context == NULL)
+        {
+            // the next request waits until the CGI program has answered
+            if (c->cgi) break;
+
+            // idle between requests, or the last response closes the
+            // connection (a "Connection: close" request is still answered,
+            // one whose response was cut short is not)
+            if (c->overflow) *is_closed = 1;
+            if (*is_closed || c->rio.rio_cnt == 0) break;
+            if (new_context(c) < 0)
+            {
+                Log(LOG_ERROR, "Error: out of memory for a request \n");
+                *is_closed = 1;
+                serve_error(c, 503, *is_closed);
+                break;
+            }
+            c->state = CONN_REQLINE;
+            Log(LOG_DEBUG, "Start processing request. \n");
+        }
+        context = c->context;
+
+        switch (c->state)
+        {
+        case CONN_REQLINE:
+            // parse request line (get method, uri, version)
+            start = metrics_now();
+            ret = parse_requestline(id, p, context, is_closed);
+            context->parse_ns += metrics_now() - start;
+            if (ret == PARSE_AGAIN) goto Flush;
+            if (ret < 0) goto Done;
+
+            // check HTTP method (support GET, POST, HEAD now)
+            if (context->method == METHOD_OTHER)
+            {
+                *is_closed = 1;
+                serve_error(c, 501, *is_closed);
+                goto Done;
+            }
+
+            // check HTTP version
+            if (context->version != 11)
+            {
+                *is_closed = 1;
+                serve_error(c, 505, *is_closed);
+                goto Done;
+            }
+
+            // parse uri (get filename and parameters if any)
+            if ((ret = parse_uri(c, context)) != 0)
+            {
+                *is_closed = 1;
+                serve_error(c, ret, *is_closed);
+                goto Done;
+            }
+            if (!context->is_static)
+            {
+                if ((context->env = (cgi_env *)slab_alloc(SLAB_ENV)) == NULL)
+                {
+                    *is_closed = 1;
+                    serve_error(c, 503, *is_closed);
+                    goto Done;
+                }
+                context->env->len = context->env->cnt = 0;
+            }
+            c->header_cnt = 0;
+            c->state = CONN_HEADERS;
+            break;
+
+        case CONN_HEADERS:
+            // parse request headers 
+            start = metrics_now();
+            ret = parse_requestheaders(id, p, context, is_closed);
+            context->parse_ns += metrics_now() - start;
+            if (ret == PARSE_AGAIN) goto Flush;
+            if (ret < 0) goto Done;
+            hist_record(&METRICS->parse, context->parse_ns);
+
+            // a draining server closes the connection after this response
+            if (DRAIN) *is_closed = 1;
+
+            // a body is consumed whatever the method, so the next request
+            // starts at the right byte
+            c->chunked = context->chunked ? CHUNK_SIZE : CHUNK_NONE;
+            c->body_left = (context->content_len > 0) ? context->content_len : 0;
+            c->body_read = 0;
+            c->stalled = 0;
+            if (context->expect && (c->chunked || c->body_left > 0))
+                OUT_LIT(c, "HTTP/1.1 100 Continue\r\n\r\n");
+            c->state = CONN_BODY;
+
+            // a CGI program starts now and reads the body as it arrives
+            if (!context->is_static) serve_cgi(id, p, context, is_closed);
+
+            // the head is parsed, the buffer is free for the body
+            c->rio.rio_mark = NULL;
+            break;
+
+        case CONN_BODY:
+            // pass the request body to the CGI program, or skip it
+            ret = parse_requestbody(id, p, context, is_closed);
+            if (ret == PARSE_AGAIN) goto Flush;
+            if (ret < 0) goto Done;
+            c->state = CONN_RESPONSE;
+            if (c->cgi) feed_cgi(id, p);  // the body is complete, end stdin
+            break;
+
+        case CONN_RESPONSE:
+            // a CGI request was answered by serve_cgi with its headers
+            if (!context->is_static) goto Done;
+
+            // send response 
+            if (context->is_metrics && context->method != METHOD_POST)
+                serve_metrics(c, context, is_closed);
+            else if (context->method == METHOD_GET)
+                serve_get(c, context, is_closed); 
+            else if (context->method == METHOD_POST)
+                serve_post(c, context, is_closed);
+            else if (context->method == METHOD_HEAD)
+                serve_head(c, context, is_closed);
+            goto Done;
+        }
+        continue;
+
+        Done:
+        free_context(c);
+        c->state = CONN_REQLINE;
+        Log(LOG_DEBUG, "End of processing request. \n");
+    }
+
+    Flush:
+    // the responses of this batch go out together, the rest waits for EPOLLOUT
+    if (out_flush(c) < 0) *is_closed = 1;
+}
+
+/******************************************************************************
+* subroutine: parse_requestline                                               *
+* purpose:    parse the content of request line. The line is split in place   *
+*             into method, uri and version views before they are stored       *
+* parameters: id        - the descriptor of the client in the pool            *
+*             p         - a pointer of the pool data structure                *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     0 on success, PARSE_AGAIN if the line is incomplete, -1 on error*
+******************************************************************************/
+int parse_requestline(int id, pool *p, HTTPContext *context, int *is_closed)
+{
+    int  ret;
+    char *query;
+    client *c = &p->clients[id];
+    slice line, method, uri, version, extra;
+
+    // skip empty lines which some clients send between requests
+    while ((ret = rio_scanline(&c->rio, &line)) > 0 && line.len == 0)
+        ;
+
+    if (ret == 0) return PARSE_AGAIN;
+
+    if (ret < 0)
     {
         *is_closed = 1;
-        serve_error(p->clientfd[id], "501", "Not Implemented",
-                   "The method is not valid or not implemented by the server",
-                    *is_closed); 
-        goto Done;
+        Log(LOG_INFO, "Info: request line too long \n");
+        serve_error(c, 414, *is_closed);
+        return -1;
+    }
+
+    c->rio.rio_mark = (char *)line.ptr;  // slice_token moves line.ptr on
+    if (!slice_token(&line, &method) || !slice_token(&line, &uri) ||
+        !slice_token(&line, &version) || slice_token(&line, &extra))
+    {
+        *is_closed = 1;
+        Log(LOG_INFO, "Info: Invalid request line \n");
+        serve_error(c, 400, *is_closed);
+        return -1;
+    }
+
+    Log(LOG_INFO, "Request: method=%.*s, uri=%.*s, version=%.*s \n",
+        method.len, method.ptr, uri.len, uri.ptr, version.len, version.ptr);
+
+    if (SLICE_IS(method, "GET")) context->method = METHOD_GET;
+    else if (SLICE_IS(method, "HEAD")) context->method = METHOD_HEAD;
+    else if (SLICE_IS(method, "POST")) context->method = METHOD_POST;
+
+    if (SLICE_IS(version, "HTTP/1.1")) context->version = 11;
+    else if (SLICE_IS(version, "HTTP/1.0")) context->version = 10;
+
+    // the line stays in the buffer until the headers are parsed, and the URI
+    // is cut in place into a path and a query string, both NUL terminated
+    // (the byte after the URI is the blank before the version)
+    query = memchr(uri.ptr, '?', uri.len);
+    ((char *)uri.ptr)[uri.len] = '\0';
+    context->path.off = uri.ptr - c->rio.rio_mark;
+    context->path.len = query ? query - uri.ptr : uri.len;
+    context->query.off = (query ? query + 1 : uri.ptr + uri.len) - c->rio.rio_mark;
+    context->query.len = query ? uri.ptr + uri.len - query - 1 : 0;
+    if (query) *query = '\0';
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: parse_requestheaders                                            *
+* purpose:    parse the content of request headers. Lines are consumed as     *
+*             they arrive; the header block may span several reads           *
+* parameters: id        - the descriptor of the client in the pool            *
+*             p         - a pointer of the pool data structure                *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     0 on success, PARSE_AGAIN if the block is incomplete, -1 on     *
+*             error                                                           *
+******************************************************************************/
+int parse_requestheaders(int id, pool *p, HTTPContext *context, int *is_closed)
+{
+    int  ret;
+    client *c = &p->clients[id];
+    slice line, name, value;
+    const char *colon;
+    
+    if (c->header_cnt == 0) context->content_len = -1; 
+
+    for (;;)
+    {   
+        if ((ret = rio_scanline(&c->rio, &line)) == 0)
+            return PARSE_AGAIN;
+
+        c->header_cnt += ret;
+
+        // if request header is larger than 8196, reject request
+        if (ret < 0 || c->header_cnt > MAX_LINE)
+        {
+            *is_closed = 1;
+            Log(LOG_INFO, "Info: request header too long \n");
+            serve_error(c, 400, *is_closed);
+            return -1;
+        }
+
+        if (line.len == 0) break;  // end of header block
+
+        // split "name: value" in place, trimming the blanks around the value
+        colon = memchr(line.ptr, ':', line.len);
+        if (colon == NULL || colon == line.ptr)
+        {
+            *is_closed = 1;
+            Log(LOG_INFO, "Info: Invalid request header \n");
+            serve_error(c, 400, *is_closed);
+            return -1;
+        }
+        name.ptr = line.ptr;
+        name.len = colon - line.ptr;
+        value.ptr = colon + 1;
+        value.len = line.ptr + line.len - value.ptr;
+        while (value.len > 0 && (*value.ptr == ' ' || *value.ptr == '\t'))
+        {
+            value.ptr++;
+            value.len--;
+        }
+        while (value.len > 0 && (value.ptr[value.len-1] == ' ' ||
+                                 value.ptr[value.len-1] == '\t'))
+            value.len--;
+
+        if ((ret = parse_header(context, name, value, is_closed)) != 0)
+        {
+            *is_closed = 1;
+            serve_error(c, ret, *is_closed);
+            return -1;
+        }
+    }
+
+    // a body framed two ways could be read differently by a proxy in front
+    if (context->chunked < 0 || (context->chunked && context->content_len >= 0))
+    {
+        *is_closed = 1;
+        Log(LOG_INFO, "Info: unsupported request body framing \n");
+        serve_error(c, (context->chunked < 0) ? 501 : 400, *is_closed);
+        return -1;
     }
 
-    // check HTTP version
-    if (strcasecmp(context->version, "HTTP/1.1"))
+    if (context->content_len > STATE.max_body)
     {
         *is_closed = 1;
-        serve_error(p->clientfd[id], "505", "HTTP Version not supported",
-                    "HTTP/1.0 is not supported by Liso server", *is_closed);  
-        goto Done;
+        Log(LOG_INFO, "Info: request body of %lld bytes is too large \n",
+            context->content_len);
+        serve_error(c, 413, *is_closed);
+        return -1;
     }
 
-    // parse uri (get filename and parameters if any)
-    parse_uri(context);
-   
-    // parse request headers 
-    if (parse_requestheaders(id, p, context, is_closed) < 0) goto Done;
+    if ((context->content_len < 0) && !context->chunked &&
+        context->method == METHOD_POST)
+    {
+        serve_error(c, 411, *is_closed);
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: parse_header                                                    *
+* purpose:    apply one request header the server understands                 *
+* parameters: context   - a pointer refers to HTTP context                    *
+*             name      - the header name                                     *
+*             value     - the header value, without surrounding blanks        *
+*             is_closed - set if the client asks to close the connection      *
+* return:     0 on success, otherwise the status code to answer with          *
+******************************************************************************/
+int parse_header(HTTPContext *context, slice name, slice value, int *is_closed)
+{
+    int  i;
+    long long len;
+    http_cond *cond;
+
+    // a CGI program sees every header
+    if (context->env)
+        cgi_header_env(context->env, name.ptr, name.len, value.ptr, value.len);
+
+    if (SLICE_IS(name, "Connection"))
+    {
+        if (slice_has(value, "close")) *is_closed = 1;
+    }
+    else if (SLICE_IS(name, "Content-Length"))
+    {
+        if (value.len == 0) return 400;
+        for (len = 0, i = 0; i < value.len; i++)
+        {
+            if (value.ptr[i] < '0' || value.ptr[i] > '9' || len > LLONG_MAX / 10 - 1)
+            {
+                Log(LOG_INFO, "Info: Invalid content-length \n");
+                return 400;
+            }
+            len = len * 10 + (value.ptr[i] - '0');
+        }
+        // repeated with another value, the body can't be framed safely
+        if (context->content_len >= 0 && context->content_len != len) return 400;
+        context->content_len = len;
+        Log(LOG_DEBUG, "Debug: content-length=%lld \n", context->content_len);
+    }
+    else if (SLICE_IS(name, "Transfer-Encoding"))
+    {
+        // only chunked is decoded, anything else is answered with 501
+        context->chunked = SLICE_IS(value, "chunked") ? 1 : -1;
+    }
+    else if (SLICE_IS(name, "Expect"))
+    {
+        if (SLICE_IS(value, "100-continue")) context->expect = 1;
+    }
+    else if (!context->is_static)
+    {
+        // only static files are validated or sent in parts
+    }
+    else if (SLICE_IS(name, "If-None-Match"))
+    {
+        if ((cond = request_cond(context)) == NULL) return 503;
+        parse_etags(cond, value);
+    }
+    else if (SLICE_IS(name, "If-Modified-Since"))
+    {
+        if ((cond = request_cond(context)) == NULL) return 503;
+        cond->since = parse_http_time(value);
+    }
+    else if (SLICE_IS(name, "If-Range"))
+    {
+        if ((cond = request_cond(context)) == NULL) return 503;
+        if (value.len > 0 && value.ptr[0] == '"')
+            cond->if_range = parse_etag(value.ptr, value.len, &cond->range_tag) ? -1 : 1;
+        else
+            cond->if_range = (cond->range_date = parse_http_time(value)) < 0 ? -1 : 2;
+    }
+    else if (SLICE_IS(name, "Range"))
+    {
+        if ((cond = request_cond(context)) == NULL) return 503;
+        parse_ranges(cond, value);
+    }
+    else if (SLICE_IS(name, "Accept-Encoding"))
+    {
+        context->accept = encode_accept(value.ptr, value.len);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: request_cond                                                    *
+* purpose:    get the validators and ranges of a request, taking them from    *
+*             the slab the first time a header asks for one                   *
+* parameters: context - a pointer refers to HTTP context                      *
+* return:     the validators and ranges, NULL if out of memory                *
+******************************************************************************/
+http_cond *request_cond(HTTPContext *context)
+{
+    http_cond *cond = context->cond;
+
+    if (cond == NULL)
+    {
+        if ((cond = (http_cond *)slab_alloc(SLAB_COND)) == NULL) return NULL;
+        memset(cond, 0, sizeof(http_cond));
+        cond->since = -1;
+        cond->fd = -1;
+        context->cond = cond;
+    }
+    return cond;
+}
+
+/******************************************************************************
+* subroutine: parse_etag                                                      *
+* purpose:    read an entity tag in the format this server gives out          *
+* parameters: s    - the tag, with its quotes                                 *
+*             len  - the length of the tag                                    *
+*             etag - returns the tag                                          *
+* return:     0 on success, -1 if it's not one of ours                        *
+******************************************************************************/
+int parse_etag(const char *s, int len, uint64_t *etag)
+{
+    int i, d;
+
+    if (len != ETAG_LEN || s[0] != '"' || s[ETAG_LEN - 1] != '"') return -1;
+
+    for (*etag = 0, i = 1; i < ETAG_LEN - 1; i++)
+    {
+        if (s[i] >= '0' && s[i] <= '9') d = s[i] - '0';
+        else if (s[i] >= 'a' && s[i] <= 'f') d = s[i] - 'a' + 10;
+        else return -1;
+        *etag = (*etag << 4) | d;
+    }
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: parse_etags                                                     *
+* purpose:    read the value of If-None-Match: "*" or a list of tags. Weak    *
+*             tags compare like strong ones here, tags of another format      *
+*             never match                                                     *
+* parameters: cond  - the validators of the request                           *
+*             value - the header value                                        *
+* return:     none                                                            *
+******************************************************************************/
+void parse_etags(http_cond *cond, slice value)
+{
+    const char *p = value.ptr, *end = value.ptr + value.len, *tag, *last;
+
+    if (cond->nomatch == 0) cond->nomatch = 1;
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        tag = p;
+        while (p < end && *p != ',') p++;
+        if (p == tag) break;
+
+        // the blanks before the next comma are not part of the tag
+        last = p;
+        while (last > tag && (last[-1] == ' ' || last[-1] == '\t')) last--;
+
+        if (*tag == '*')
+            cond->nomatch = 2;
+        else
+        {
+            if (last - tag > 2 && tag[0] == 'W' && tag[1] == '/') tag += 2;
+            if (cond->ntags < COND_TAGS &&
+                parse_etag(tag, last - tag, &cond->tags[cond->ntags]) == 0)
+                cond->ntags++;
+        }
+    }
+}
+
+/******************************************************************************
+* subroutine: parse_ranges                                                    *
+* purpose:    read the value of Range: "bytes=" and a list of first-last,     *
+*             first- or -suffix ranges. Anything else, or more than           *
+*             MAX_RANGES ranges, makes the whole header ignored               *
+* parameters: cond  - the ranges of the request                               *
+*             value - the header value                                        *
+* return:     none                                                            *
+******************************************************************************/
+void parse_ranges(http_cond *cond, slice value)
+{
+    const char *p = value.ptr + 6, *end = value.ptr + value.len;
+    long long v[2];
+    int i, n = 0, digits;
+
+    if (value.len < 6 || strncasecmp(value.ptr, "bytes=", 6)) goto Ignore;
+
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p < end && *p == ',')
+        {
+            p++;
+            continue;
+        }
+        if (n == MAX_RANGES) goto Ignore;
+
+        // first and last, -1 when omitted
+        for (i = 0; i < 2; i++)
+        {
+            for (v[i] = 0, digits = 0; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+            {
+                if (v[i] > LLONG_MAX / 10 - 1) goto Ignore;
+                v[i] = v[i] * 10 + (*p - '0');
+            }
+            if (digits == 0) v[i] = -1;
+            if (i == 0 && (p == end || *p++ != '-')) goto Ignore;
+        }
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p < end && *p != ',') goto Ignore;
+        if ((v[0] < 0 && v[1] < 0) || (v[1] >= 0 && v[0] > v[1])) goto Ignore;
+
+        cond->first[n] = v[0];
+        cond->last[n] = v[1];
+        n++;
+    }
+    if (n == 0) goto Ignore;
+    cond->nranges = n;
+    return;
+
+    Ignore:
+    Log(LOG_INFO, "Info: Range header ignored \n");
+    cond->nranges = -1;
+}
+
+/******************************************************************************
+* subroutine: parse_http_time                                                 *
+* purpose:    read a date in the format of http_time                          *
+* parameters: value - the date                                                *
+* return:     the time, or -1 if the date is malformed                        *
+******************************************************************************/
+time_t parse_http_time(slice value)
+{
+    char buf[MIN_LINE], *end;
+    struct tm tm;
+
+    if (value.len >= MIN_LINE) return -1;
+    memcpy(buf, value.ptr, value.len);
+    buf[value.len] = '\0';
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') return -1;
+    return timegm(&tm);
+}
+
+/******************************************************************************
+* subroutine: body_error                                                      *
+* purpose:    answer a request whose body can't be read, and close. A CGI     *
+*             program which has not started its response yet is stopped and  *
+*             replaced by the error; a response already under way is cut      *
+* parameters: id        - the descriptor of the client in the pool            *
+*             p         - a pointer of the pool data structure                *
+*             errnum    - the status code                                     *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     -1                                                              *
+******************************************************************************/
+static int body_error(int id, pool *p, int errnum, int *is_closed)
+{
+    client *c = &p->clients[id];
+
+    *is_closed = 1;
+    Log(LOG_INFO, "Info: request body rejected with %d \n", errnum);
+
+    if (c->cgi && !c->cgi->header_done)
+    {
+        finish_cgi(id, p, 1);
+        serve_error(c, errnum, *is_closed);
+    }
+    else if (c->cgi)
+        finish_cgi(id, p, 1);
+    else if (c->context->is_static)
+        serve_error(c, errnum, *is_closed);
+    return -1;
+}
+
+/******************************************************************************
+* subroutine: parse_requestbody                                               *
+* purpose:    pass the request body to its consumer as it arrives, a piece of *
+*             the read buffer at a time, so a body of any size takes constant *
+*             memory. A CGI program gets it on stdin, static content skips    *
+*             it. A chunked body is decoded on the way. When the program's    *
+*             pipe is full the bytes stay in the buffer, which stops reading  *
+*             the socket until the pipe drains                                *
+* parameters: id        - the descriptor of the client in the pool            *
+*             p         - a pointer of the pool data structure                *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     0 on success, PARSE_AGAIN if body bytes are missing, -1 on error*
+******************************************************************************/
+int parse_requestbody(int id, pool *p, HTTPContext *context, int *is_closed)
+{
+    int i, cnt, ret;
+    long long size;
+    client *c = &p->clients[id];
+    slice line;
+
+    c->stalled = 0;
+
+    for (;;)
+    {
+        if (c->body_left == 0)
+        {
+            // a Content-Length body ends here, a chunked one has a line next
+            if (c->chunked == CHUNK_NONE) return 0;
+            if ((ret = rio_scanline(&c->rio, &line)) == 0) return PARSE_AGAIN;
+            if (ret < 0) return body_error(id, p, 400, is_closed);
+
+            switch (c->chunked)
+            {
+            case CHUNK_SIZE:
+                // hex size, maybe followed by ";extension" which is ignored
+                for (i = 0, size = 0; i < line.len && isxdigit((unsigned char)line.ptr[i]); i++)
+                {
+                    if (size > (LLONG_MAX >> 4)) return body_error(id, p, 400, is_closed);
+                    size = (size << 4) | (isdigit((unsigned char)line.ptr[i]) ? line.ptr[i] - '0' :
+                                          (tolower((unsigned char)line.ptr[i]) - 'a' + 10));
+                }
+                if (i == 0 || (i < line.len && !strchr("; \t", line.ptr[i])))
+                    return body_error(id, p, 400, is_closed);
+                if (size > STATE.max_body - c->body_read)
+                    return body_error(id, p, 413, is_closed);
+                c->body_read += size;
+                c->body_left = size;
+                c->chunked = (size > 0) ? CHUNK_END : CHUNK_TRAILER;
+                c->header_cnt = 0;
+                break;
+
+            case CHUNK_END:
+                if (line.len != 0) return body_error(id, p, 400, is_closed);
+                c->chunked = CHUNK_SIZE;
+                break;
+
+            case CHUNK_TRAILER:
+                // trailer fields are not used, only bounded like headers
+                if (line.len == 0)
+                {
+                    c->chunked = CHUNK_NONE;
+                    return 0;
+                }
+                if ((c->header_cnt += ret) > MAX_LINE)
+                    return body_error(id, p, 400, is_closed);
+                break;
+            }
+            continue;
+        }
+
+        if (c->rio.rio_cnt == 0) return PARSE_AGAIN;
+        cnt = (c->rio.rio_cnt < c->body_left) ? c->rio.rio_cnt : (int)c->body_left;
+
+        if (c->cgi && c->cgi->in_fd >= 0)
+        {
+            if ((ret = cgi_send(c->cgi, c->rio.rio_bufptr, cnt)) == 0)
+            {
+                c->stalled = 1;   // resume when the pipe is writable
+                return PARSE_AGAIN;
+            }
+            if (ret < 0)
+            {
+                Log(LOG_DEBUG, "CGI program of client_fd=%d did not read its input \n", id);
+                end_cgi_input(id, p);
+            }
+            else
+                cnt = ret;
+        }
+        c->rio.rio_bufptr += cnt;
+        c->rio.rio_cnt -= cnt;
+        c->body_left -= cnt;
+    }
+}
+
+/* value of a hex digit, -1 if it is not one */
+static int hex_value(char ch)
+{
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+/******************************************************************************
+* subroutine: normalize_uri                                                   *
+* purpose:    percent-decode the path of a URI, then drop its empty and "."   *
+*             segments and let each ".." take off the segment before it. A   *
+*             path naming a directory keeps its trailing slash                *
+* parameters: uri  - the path of the URI, or an absolute URI                  *
+*             len  - the length of uri                                        *
+*             out  - returns the normalized path, NUL terminated              *
+*             size - the size of out                                          *
+* return:     the length of the path, or the status code to answer with:     *
+*             400 for a malformed path or one climbing above the root, 414   *
+*             if it doesn't fit                                               *
+******************************************************************************/
+int normalize_uri(const char *uri, int len, char *out, int size)
+{
+    const char *end = uri + len;
+    int n = 0, r, w, s, is_dir = 0, hi, lo;
+
+    // absolute form: the path starts after the authority
+    if (len > 7 && !strncasecmp(uri, "http://", 7)) uri += 7;
+    else if (len > 8 && !strncasecmp(uri, "https://", 8)) uri += 8;
+    if (uri != end - len)
+    {
+        while (uri < end && *uri != '/') uri++;
+        if (uri == end) uri = "/", end = uri + 1;
+    }
+    if (uri == end || *uri != '/') return -400;
+
+    // first decode, a %2F separates segments like a '/'
+    while (uri < end)
+    {
+        if (n + 2 >= size) return -414;
+        if (*uri != '%')
+        {
+            out[n++] = *uri++;
+            continue;
+        }
+        if (end - uri < 3 || (hi = hex_value(uri[1])) < 0 || (lo = hex_value(uri[2])) < 0)
+            return -400;
+        if ((out[n++] = (char)(hi << 4 | lo)) == '\0') return -400;
+        uri += 3;
+    }
+
+    // then rebuild the path segment by segment, in place
+    for (r = 0, w = 0; r < n; )
+    {
+        s = ++r;
+        while (r < n && out[r] != '/') r++;
+        is_dir = (r == s || (r - s == 1 && out[s] == '.'));
+        if (r - s == 2 && out[s] == '.' && out[s + 1] == '.')
+        {
+            if (w == 0) return -400;
+            while (out[--w] != '/');
+            is_dir = 1;
+        }
+        else if (!is_dir)
+        {
+            out[w++] = '/';
+            memmove(out + w, out + s, r - s);
+            w += r - s;
+        }
+    }
+    if (w == 0 || is_dir) out[w++] = '/';
+    out[w] = '\0';
+    return w;
+}
+
+/******************************************************************************
+* subroutine: parse_uri                                                       *
+* purpose:    resolve the file of a request behind the www root, from its     *
+*             normalized path, and tell static from dynamic content by it.    *
+*             The raw path and query stay in the read buffer                  *
+* parameters: c       - the client, whose read buffer holds the request line *
+*             context - a pointer of the HTTP context data structure          *
+* return:     0 on success, otherwise the status code to answer with          *
+******************************************************************************/
+int parse_uri(client *c, HTTPContext *context)
+{
+    const char *path = SPAN_STR(&c->rio, context->path);
+    char *uri;
+    int len;
+
+    if ((context->filename = (char *)slab_alloc(SLAB_PATH)) == NULL) return 503;
+    memcpy(context->filename, STATE.www_path, STATE.www_len);
+    uri = context->filename + STATE.www_len;
+    len = normalize_uri(path, context->path.len, uri,
+                        MAX_PATH - STATE.www_len - (sizeof("index.html") - 1));
+    if (len < 0)
+    {
+        Log(LOG_INFO, "Info: invalid path in uri \n");
+        return -len;
+    }
+
+    // parse uri: CGI_PREFIX, and anything below it, is dynamic content
+    if (!strncmp(uri, CGI_PREFIX, sizeof(CGI_PREFIX) - 1) &&
+        (uri[sizeof(CGI_PREFIX) - 1] == '/' || uri[sizeof(CGI_PREFIX) - 1] == '\0'))
+        return 0;
+
+    context->is_static = 1;
+    context->is_metrics = !strcmp(uri, METRICS_URI);
+    if (uri[len - 1] == '/') strcpy(uri + len, "index.html");
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: find_file                                                       *
+* purpose:    get the stat fields of a file, from the index of the www tree  *
+*             when it knows about the path, else from the filesystem          *
+* parameters: context - a pointer refers to HTTP context                      *
+*             sbuf    - returns the stat result of the file, also filled by   *
+*                       the lookup                                            *
+*             found   - what tree_lookup of the path into sbuf returned       *
+* return:     0 if the file exists, -1 otherwise                              *
+******************************************************************************/
+int find_file(HTTPContext *context, struct stat *sbuf, int found)
+{
+    switch (found)
+    {
+    case TREE_FOUND:
+        return 0;
+    case TREE_MISSING:
+        return -1;
+    }
+    return stat(context->filename, sbuf);
+}
+
+/******************************************************************************
+* subroutine: serve_redirect                                                  *
+* purpose:    send a request for a directory to the same path with a slash,  *
+*             where its index.html is served                                  *
+* parameters: c         - the client to respond to                            *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     none                                                            *
+******************************************************************************/
+void serve_redirect(client *c, HTTPContext *context, int is_closed)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *uri = (const unsigned char *)URI_PATH(context);
+    char loc[MIN_LINE];
+    int n = 0;
+
+    metrics_request(context->method, 301);
+    out_header(c, HDR_301, sizeof(HDR_301) - 1, is_closed);
+    OUT_LIT(c, "Location: ");
+
+    // the path was decoded, bytes which can't appear in a URI are encoded;
+    // a long one is copied out in pieces
+    for (; *uri; uri++)
+    {
+        if (n > MIN_LINE - 4)
+        {
+            out_append(c, loc, n);
+            n = 0;
+        }
+        if (isalnum(*uri) || strchr("/-._~!$&'()*+,;=:@", *uri))
+            loc[n++] = *uri;
+        else
+        {
+            loc[n++] = '%';
+            loc[n++] = hex[*uri >> 4];
+            loc[n++] = hex[*uri & 15];
+        }
+    }
+    loc[n++] = '/';
+    out_append(c, loc, n);
+    OUT_LIT(c, "\r\nContent-Length: 0\r\n\r\n");
+}
+
+/******************************************************************************
+* subroutine: validate_file                                                   *
+* purpose:    validate file existence and permisson. A directory named       *
+*             without its slash is redirected to it                           *
+* parameters: c         - the client to respond to                            *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+*             sbuf      - returns the stat result of the file                 *
+*             found     - what tree_lookup of the path into sbuf returned     *
+* return:     0 on success -1 on error                                        *
+******************************************************************************/
+int validate_file(client *c, HTTPContext *context, int *is_closed,
+                  struct stat *sbuf, int found)
+{
+    // check file existence
+    if (find_file(context, sbuf, found) < 0)
+    {
+        serve_error(c, 404, *is_closed);
+        return -1;
+    }
+
+    if (S_ISDIR(sbuf->st_mode))
+    {
+        serve_redirect(c, context, *is_closed);
+        return -1;
+    }
+
+    // check file permission
+    if ((!S_ISREG(sbuf->st_mode)) || !(S_IRUSR & sbuf->st_mode))
+    {
+        serve_error(c, 403, *is_closed);
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: find_sibling                                                    *
+* purpose:    switch an uncached text file to its precompressed sibling       *
+*             (file.br, file.gz) if the client takes that coding and the     *
+*             sibling is no older than the file                               *
+* parameters: context - a pointer refers to HTTP context, whose filename is  *
+*                       changed to the sibling                                *
+*             sbuf    - stat result of the file, replaced by the sibling's    *
+* return:     the coding of the file to send, ENC_IDENTITY if unchanged       *
+******************************************************************************/
+int find_sibling(HTTPContext *context, struct stat *sbuf)
+{
+    int enc, len = strlen(context->filename);
+    struct stat fbuf;
+
+    for (enc = ENC_BR; enc < ENC_TYPES; enc++)
+    {
+        if (!(context->accept & ENC_MASK(enc))) continue;
+        if (snprintf(context->filename + len, MAX_PATH - len, "%s",
+                     encode_suffix(enc)) < MAX_PATH - len &&
+            find_file(context, &fbuf, tree_lookup(URI_PATH(context), &fbuf)) == 0 &&
+            S_ISREG(fbuf.st_mode) &&
+            fbuf.st_mtime >= sbuf->st_mtime)
+        {
+            *sbuf = fbuf;
+            return enc;
+        }
+        context->filename[len] = '\0';
+    }
+    return ENC_IDENTITY;
+}
+
+/******************************************************************************
+* subroutine: not_modified                                                    *
+* purpose:    tell if the copy a client holds is current. If-None-Match wins  *
+*             over If-Modified-Since; a date in the future is ignored         *
+* parameters: cond  - the validators of the request                           *
+*             mtime - modification time of the file                           *
+*             etag  - entity tag of the file                                  *
+* return:     1 if the client's copy is current, 0 otherwise                  *
+******************************************************************************/
+int not_modified(http_cond *cond, time_t mtime, uint64_t etag)
+{
+    int i;
+
+    if (cond->nomatch == 2) return 1;
+    if (cond->nomatch)
+    {
+        for (i = 0; i < cond->ntags; i++)
+            if (cond->tags[i] == etag) return 1;
+        return 0;
+    }
+    return cond->since >= 0 && cond->since <= time(0) && mtime <= cond->since;
+}
+
+/******************************************************************************
+* subroutine: resolve_ranges                                                  *
+* purpose:    turn the ranges of a request into byte offsets of the file,     *
+*             dropping those which start past its end. An If-Range which      *
+*             doesn't match the file asks for all of it instead               *
+* parameters: cond  - the ranges of the request                               *
+*             size  - size of the file                                        *
+*             mtime - modification time of the file                           *
+*             etag  - entity tag of the file                                  *
+* return:     the number of ranges left, 0 if the whole file is to be sent,   *
+*             -1 if no range can be satisfied                                 *
+******************************************************************************/
+int resolve_ranges(http_cond *cond, long long size, time_t mtime, uint64_t etag)
+{
+    int i, n = 0;
+    long long first, last;
+
+    if (cond->nranges <= 0) return 0;
+    if (cond->if_range < 0 ||
+        (cond->if_range == 1 && cond->range_tag != etag) ||
+        (cond->if_range == 2 && cond->range_date != mtime))
+        return 0;
+
+    for (i = 0; i < cond->nranges; i++)
+    {
+        first = cond->first[i];
+        last = cond->last[i];
+        if (first < 0)
+        {
+            // the last bytes of the file
+            first = (last >= size) ? 0 : size - last;
+            last = size - 1;
+        }
+        else if (last < 0 || last >= size)
+            last = size - 1;
+        if (first > last) continue;
+
+        cond->first[n] = first;
+        cond->last[n] = last;
+        n++;
+    }
+    cond->nranges = n;
+    return n ? n : -1;
+}
+
+/******************************************************************************
+* subroutine: part_header                                                     *
+* purpose:    render the boundary and headers in front of a part of a         *
+*             multipart/byteranges body, or the closing boundary              *
+* parameters: buf   - the buffer to render into                               *
+*             size  - the size of buf                                         *
+*             parts - the ranges of the response                              *
+*             i     - the range, nranges for the closing boundary             *
+* return:     the length of the rendered text                                 *
+******************************************************************************/
+int part_header(char *buf, int size, http_cond *parts, int i)
+{
+    char tag[ETAG_LEN + 1];
+
+    // the boundary is the tag of the file, which its bytes can't contain
+    etag_format(parts->etag, tag);
+    tag[ETAG_LEN - 1] = '\0';
+
+    if (i == parts->nranges)
+        return snprintf(buf, size, "\r\n--lisod-%s--\r\n", tag + 1);
+    return snprintf(buf, size, "\r\n--lisod-%s\r\nContent-Type: %s\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n", tag + 1,
+                    parts->type, parts->first[i], parts->last[i], parts->size);
+}
+
+/* add the lines which tell how the body is coded, and that it depends on
+ * Accept-Encoding */
+static void out_coding(client *c, int encoding, int vary)
+{
+    if (encoding != ENC_IDENTITY)
+    {
+        OUT_LIT(c, "Content-Encoding: ");
+        out_append(c, encode_name(encoding), strlen(encode_name(encoding)));
+        OUT_LIT(c, "\r\n");
+    }
+    if (vary) OUT_LIT(c, "Vary: Accept-Encoding\r\n");
+}
+
+/******************************************************************************
+* subroutine: serve_head                                                      *
+* purpose:    queue the response header for a static file. A GET or HEAD     *
+*             whose validators match the file is answered with 304, and a    *
+*             GET with ranges gets the header of a 206 (or a 416). Text is     *
+*             sent compressed to clients which take it                        *
+* parameters: c         - the client to respond to                            *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     0 if a body is to follow, 1 if the response is complete, -1 if  *
+*             an error response was sent instead                              *
+******************************************************************************/
+int serve_head(client *c, HTTPContext *context, int *is_closed)
+{
+    int    i, len, vary;
+    struct stat sbuf;
+    char   tbuf[MIN_LINE * 4];
+    const char *type, *filetype = NULL;
+    long long size;
+    time_t mtime;
+    uint64_t etag, start = metrics_now();
+    http_cond *cond = context->cond;
+    cache_entry *entry;
+    int found = tree_lookup(URI_PATH(context), &sbuf);
+
+    // hot files are answered from the cache without touching the filesystem;
+    // the index also sees a directory above a cached file being renamed
+    if (found == TREE_MISSING ||
+        (context->entry = cache_lookup(context->filename)) == NULL)
+    {
+        if (validate_file(c, context, is_closed, &sbuf, found) < 0) return -1;
+
+        filetype = mime_type(context->filename);
+        context->entry = cache_insert(context->filename, &sbuf, filetype);
+    }
+
+    // a client taking compressed bodies gets the smallest copy there is; a
+    // file too large to cache is only sent compressed from a sibling
+    if (context->entry)
+    {
+        if (context->accept && (entry = cache_variant(context->entry, context->accept)))
+            context->entry = entry;
+        context->encoding = context->entry->encoding;
+    }
+    else if (context->accept && encode_compressible(filetype))
+        context->encoding = find_sibling(context, &sbuf);
+    hist_record(&METRICS->lookup, metrics_now() - start);
+
+    if (context->entry)
+    {
+        size = context->entry->size;
+        mtime = context->entry->mtime;
+        etag = context->entry->etag;
+        type = context->entry->type;
+    }
+    else
+    {
+        size = sbuf.st_size;
+        mtime = sbuf.st_mtime;
+        etag = file_etag(&sbuf);
+        type = filetype;
+    }
+    context->size = size;
+    vary = encode_compressible(type);
+
+    // a POST which reaches a file gets all of it
+    if (cond && context->method != METHOD_POST)
+    {
+        if (not_modified(cond, mtime, etag))
+        {
+            metrics_request(context->method, 304);
+            out_header(c, HDR_304, sizeof(HDR_304) - 1, *is_closed);
+            OUT_LIT(c, "ETag: ");
+            out_append(c, tbuf, etag_format(etag, tbuf));
+            OUT_LIT(c, "\r\n");
+            out_coding(c, ENC_IDENTITY, vary);
+            OUT_LIT(c, "\r\n");
+            return 1;
+        }
+
+        if (context->method == METHOD_GET &&
+            (cond->nranges = resolve_ranges(cond, size, mtime, etag)) < 0)
+        {
+            metrics_request(context->method, 416);
+            out_header(c, HDR_416, sizeof(HDR_416) - 1, *is_closed);
+            OUT_LIT(c, "Content-Length: 0\r\nContent-Range: bytes */");
+            out_long(c, size);
+            OUT_LIT(c, "\r\n\r\n");
+            return 1;
+        }
+        cond->partial = (context->method == METHOD_GET && cond->nranges > 0);
+    }
+
+    if (cond && cond->partial)
+    {
+        cond->size = size;
+        cond->etag = etag;
+        cond->type = type;
+        metrics_request(context->method, 206);
+        out_header(c, HDR_206, sizeof(HDR_206) - 1, *is_closed);
+        OUT_LIT(c, "Content-Length: ");
+        if (cond->nranges == 1)
+        {
+            out_long(c, cond->last[0] - cond->first[0] + 1);
+            OUT_LIT(c, "\r\nContent-Type: ");
+            out_append(c, type, strlen(type));
+            len = snprintf(tbuf, sizeof(tbuf), "\r\nContent-Range: bytes %lld-%lld/%lld",
+                           cond->first[0], cond->last[0], size);
+            out_append(c, tbuf, len);
+        }
+        else
+        {
+            // the parts are sent one by one, their length is known upfront
+            for (size = 0, i = 0; i <= cond->nranges; i++)
+            {
+                size += part_header(tbuf, sizeof(tbuf), cond, i);
+                if (i < cond->nranges) size += cond->last[i] - cond->first[i] + 1;
+            }
+            out_long(c, size);
+            OUT_LIT(c, "\r\nContent-Type: multipart/byteranges; boundary=lisod-");
+            etag_format(etag, tbuf);
+            out_append(c, tbuf + 1, ETAG_LEN - 2);
+        }
+        OUT_LIT(c, "\r\nLast-Modified: ");
+        out_append(c, tbuf, http_time(mtime, tbuf));
+        OUT_LIT(c, "\r\nETag: ");
+        out_append(c, tbuf, etag_format(etag, tbuf));
+        OUT_LIT(c, "\r\n");
+        out_coding(c, context->encoding, vary);
+        OUT_LIT(c, "\r\n");
+        return 0;
+    }
+
+    // send response headers to client
+    metrics_request(context->method, 200);
+    out_header(c, HDR_200, sizeof(HDR_200) - 1, *is_closed);
+    if (context->entry)
+    {
+        out_append(c, context->entry->header, context->entry->header_len);
+    }
+    else
+    {
+        OUT_LIT(c, "Content-Length: ");
+        out_long(c, sbuf.st_size);
+        OUT_LIT(c, "\r\nContent-Type: ");
+        out_append(c, filetype, strlen(filetype));
+        OUT_LIT(c, "\r\nLast-Modified: ");
+        len = http_time(sbuf.st_mtime, tbuf);
+        out_append(c, tbuf, len);
+        OUT_LIT(c, "\r\nETag: ");
+        out_append(c, tbuf, etag_format(etag, tbuf));
+        OUT_LIT(c, "\r\nAccept-Ranges: bytes\r\n");
+        out_coding(c, context->encoding, vary);
+    }
+    OUT_LIT(c, "\r\n");
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: serve_body                                                      *
+* purpose:    queue the response body. A cached body is referenced in place;  *
+*             otherwise the file is handed to the kernel with sendfile(), and *
+*             what does not fit in the socket buffer is sent later from the   *
+*             offset kept in the client slot. Only the ranges of a 206 are    *
+*             sent; several ranges are queued one by one by out_part          *
+* parameters: c         - the client to respond to                            *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     0 on success, -1 on error                                       *
+******************************************************************************/
+int serve_body(client *c, HTTPContext *context, int *is_closed)
+{
+    int fd = -1;
+    struct stat sbuf;
+    http_cond *cond = (context->cond && context->cond->partial) ? context->cond : NULL;
+
+    // a cached body is sent straight from the cache, behind the header
+    if (context->entry && cond == NULL)
+    {
+        out_ref(c, context->entry->data, context->entry->size, context->entry);
+        return 0;
+    }
+    if (context->entry && cond->nranges == 1)
+    {
+        out_ref(c, context->entry->data + cond->first[0],
+                cond->last[0] - cond->first[0] + 1, context->entry);
+        return 0;
+    }
+
+    if (context->entry == NULL)
+    {
+        if ((fd = open(context->filename, O_RDONLY, 0)) < 0)
+        {
+            Log(LOG_ERROR, "Error: Cann't open file \n");
+            return -1; ///TODO what error code here should be?
+        }
+
+        // the header already gave the size found by the lookup; a file which
+        // changed since can't be sent to match it
+        if (fstat(fd, &sbuf) < 0 || sbuf.st_size != context->size)
+        {
+            Log(LOG_WARN, "Warning: %s changed while being served \n", context->filename);
+            close(fd);
+            return -1;
+        }
+    }
+
+    // the parts go out in turn, each once the one before has left
+    if (cond && cond->nranges > 1)
+    {
+        cond->fd = fd;
+        cond->entry = context->entry;
+        if (cond->entry) cache_hold(cond->entry);
+        cond->part = 0;
+        c->parts = cond;
+        context->cond = NULL;
+        out_part(c);
+        return 0;
+    }
+
+    c->send_fd = fd;
+    c->send_off = cond ? cond->first[0] : 0;
+    c->send_end = cond ? cond->last[0] + 1 : context->size;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: out_part                                                        *
+* purpose:    queue the next part of a multipart response, or its closing     *
+*             boundary and then release the ranges                            *
+* parameters: c - the client, with no segment or file region pending          *
+* return:     none                                                            *
+******************************************************************************/
+void out_part(client *c)
+{
+    http_cond *parts = c->parts;
+    char buf[MIN_LINE * 4];
+    int i = parts->part++;
+
+    out_append(c, buf, part_header(buf, sizeof(buf), parts, i));
+    if (i == parts->nranges)
+    {
+        free_parts(c);
+        return;
+    }
+
+    if (parts->entry)
+        out_ref(c, parts->entry->data + parts->first[i],
+                parts->last[i] - parts->first[i] + 1, parts->entry);
+    else
+    {
+        c->send_fd = parts->fd;
+        c->send_off = parts->first[i];
+        c->send_end = parts->last[i] + 1;
+    }
+}
+
+/******************************************************************************
+* subroutine: free_parts                                                      *
+* purpose:    release the ranges of a multipart response, with its file      *
+* parameters: c - the client                                                  *
+* return:     none                                                            *
+******************************************************************************/
+void free_parts(client *c)
+{
+    if (c->parts == NULL) return;
+
+    if (c->parts->fd >= 0) close(c->parts->fd);
+    if (c->parts->entry) cache_release(c->parts->entry);
+    slab_free(SLAB_COND, c->parts);
+    c->parts = NULL;
+}
+
+/******************************************************************************
+* subroutine: send_file                                                       *
+* purpose:    push the pending file region of a client with sendfile(), so    *
+*             the bytes never pass through user space. On a full socket       *
+*             buffer the offset stays in the client slot and sending resumes  *
+*             when epoll reports the socket writable again                    *
+* parameters: c - the client with a pending file region                       *
+* return:     0 when the region is sent, SEND_AGAIN if the socket is full,    *
+*             -1 on error                                                     *
+******************************************************************************/
+int send_file(client *c)
+{
+    ssize_t n;
+
+    while (c->send_off < c->send_end)
+    {
+        if (c->rio.rio_ssl)
+            n = tls_sendfile(c->rio.rio_ssl, c->send_fd, &c->send_off,
+                             c->send_end - c->send_off);
+        else
+            n = sendfile(c->rio.rio_fd, c->send_fd, &c->send_off,
+                         c->send_end - c->send_off);
+        if (n > 0)
+        {
+            METRICS->bytes_sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return SEND_AGAIN;
+
+        // the file shrank under us or the peer went away
+        Log(LOG_ERROR, "Error: sendfile failed on client_fd=%d \n", c->rio.rio_fd);
+        if (c->parts == NULL) close(c->send_fd);
+        c->send_fd = -1;
+        return -1;
+    }
+
+    // the file of a multipart response stays open for its next part
+    if (c->parts == NULL) close(c->send_fd);
+    c->send_fd = -1;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: serve_get                                                       *
+* purpose:    return response for GET request                                 *
+* parameters: c         - the client to respond to                            *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     none                                                            *
+******************************************************************************/
+void serve_get(client *c, HTTPContext *context, int *is_closed)
+{
+    // a 304 or 416 has no body
+    if (serve_head(c, context, is_closed) == 0 &&
+        serve_body(c, context, is_closed) < 0)
+        *is_closed = 1;  // the header promised a body we can't send
+}
+
+/******************************************************************************
+* subroutine: serve_post                                                      *
+* purpose:    return response for POST request                                *
+* parameters: c         - the client to respond to                            *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     none                                                            *
+******************************************************************************/
+void serve_post(client *c, HTTPContext *context, int *is_closed)
+{
+    struct stat sbuf;
+
+    // check file existence
+    if (find_file(context, &sbuf, tree_lookup(URI_PATH(context), &sbuf)) == 0)
+    {
+        serve_get(c, context, is_closed);
+        return;
+    }
+
+    // send response headers to client
+    metrics_request(context->method, 204);
+    out_header(c, HDR_204, sizeof(HDR_204) - 1, *is_closed);
+    OUT_LIT(c, "Content-Length: 0\r\nContent-Type: text/html\r\n\r\n");
+}
+
+/******************************************************************************
+* subroutine: serve_metrics                                                   *
+* purpose:    answer METRICS_URI with the metrics of all workers, rendered   *
+*             into a buffer which lives until the response is sent           *
+* parameters: c         - the client to respond to                            *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     none                                                            *
+******************************************************************************/
+void serve_metrics(client *c, HTTPContext *context, int *is_closed)
+{
+    int len;
+    char *buf = (char *)malloc(METRICS_BUF);
+    cache_entry *body;
+
+    if (buf == NULL)
+    {
+        Log(LOG_ERROR, "Error: no memory to render metrics \n");
+        serve_error(c, 500, *is_closed);
+        return;
+    }
+
+    metrics_request(context->method, 200);
+    len = metrics_render(buf, METRICS_BUF);
+    if ((body = cache_wrap(buf, len)) == NULL)
+    {
+        free(buf);
+        serve_error(c, 500, *is_closed);
+        return;
+    }
+
+    out_header(c, HDR_200, sizeof(HDR_200) - 1, *is_closed);
+    OUT_LIT(c, "Content-Type: text/plain; version=0.0.4\r\n"
+               "Cache-Control: no-cache\r\nContent-Length: ");
+    out_long(c, len);
+    OUT_LIT(c, "\r\n\r\n");
+
+    cache_hold(body);
+    if (context->method != METHOD_HEAD)
+        out_ref(c, body->data, len, body);
+    cache_release(body);
+}
+
+/******************************************************************************
+* subroutine: serve_cgi                                                       *
+* purpose:    start the CGI program of a dynamic request. Its pipes (or its   *
+*             FastCGI socket) join the epoll instance; the response is        *
+*             passed on by pump_cgi as the program writes it, and requests    *
+*             pipelined behind this one wait until it is complete             *
+* parameters: id        - the descriptor of the client in the pool            *
+*             p         - a pointer of the pool data structure                *
+*             context   - a pointer refers to HTTP context                    *
+*             is_closed - an indicator if the current transaction is closed   *
+* return:     none                                                            *
+******************************************************************************/
+void serve_cgi(int id, pool *p, HTTPContext *context, int *is_closed)
+{
+    int  ret;
+    char script[MAX_PATH], name[MAX_PATH], uri[MAX_LINE], num[24];
+    char buf[INET_ADDRSTRLEN];
+    const char *path_info;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    struct epoll_event ev;
+    client *c = &p->clients[id];
+    cgi_env *env = context->env;
+    const char *path = SPAN_STR(&c->rio, context->path);
+    const char *query = SPAN_STR(&c->rio, context->query);
+    cgi_proc *cp;
+
+    if ((ret = cgi_resolve(URI_PATH(context), script, name, &path_info)) != 0)
+    {
+        serve_error(c, ret, *is_closed);
+        return;
+    }
+
+    // the meta-variables of RFC 3875, headers were added while parsing
+    cgi_setenv(env, "GATEWAY_INTERFACE", "CGI/1.1", -1);
+    cgi_setenv(env, "SERVER_SOFTWARE", "Liso/1.0", -1);
+    cgi_setenv(env, "SERVER_PROTOCOL", "HTTP/1.1", -1);
+    snprintf(num, sizeof(num), "%d", context->is_secure ? STATE.s_port : STATE.port);
+    cgi_setenv(env, "SERVER_PORT", num, -1);
+    cgi_setenv(env, "REQUEST_METHOD", method_names[context->method], -1);
+    snprintf(uri, sizeof(uri), "%s%s%s", path, context->query.len ? "?" : "", query);
+    cgi_setenv(env, "REQUEST_URI", uri, -1);
+    cgi_setenv(env, "SCRIPT_NAME", name, -1);
+    cgi_setenv(env, "PATH_INFO", path_info, -1);
+    cgi_setenv(env, "QUERY_STRING", query, context->query.len);
+    if (context->content_len >= 0)
+    {
+        snprintf(num, sizeof(num), "%lld", context->content_len);
+        cgi_setenv(env, "CONTENT_LENGTH", num, -1);
+    }
+    if (getpeername(c->rio.rio_fd, (struct sockaddr *)&addr, &addrlen) == 0 &&
+        inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf)))
+        cgi_setenv(env, "REMOTE_ADDR", buf, -1);
+    if (context->is_secure) cgi_setenv(env, "HTTPS", "on", -1);
+    cgi_setenv(env, "PATH", getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin", -1);
+
+    cp = cgi_start(script, env);
+    if (cp == NULL)
+    {
+        serve_error(c, (errno == EAGAIN) ? 503 : 500, *is_closed);
+        return;
+    }
+    cp->method = context->method;
+    cp->is_head = (context->method == METHOD_HEAD);
+    c->cgi = cp;
+
+    // an nph- program writes the whole response, the connection ends with it
+    if (cp->is_nph)
+    {
+        *is_closed = 1;
+        metrics_request(context->method, 0);
+    }
+
+    ev.events = EPOLLIN | EPOLLET | (cp->is_fcgi ? EPOLLOUT : 0);
+    ev.data.fd = cp->out_fd;
+    ret = epoll_ctl(p->epfd, EPOLL_CTL_ADD, cp->out_fd, &ev);
+    p->owner[cp->out_fd] = id;
+    if (ret == 0 && !cp->is_fcgi)
+    {
+        ev.events = EPOLLOUT | EPOLLET;
+        ev.data.fd = cp->in_fd;
+        ret = epoll_ctl(p->epfd, EPOLL_CTL_ADD, cp->in_fd, &ev);
+        p->owner[cp->in_fd] = id;
+    }
+    if (ret < 0)
+    {
+        Log(LOG_ERROR, "Error: epoll_ctl failed adding CGI pipes of client_fd=%d \n", id);
+        finish_cgi(id, p, 1);
+        serve_error(c, 500, *is_closed);
+        return;
+    }
+
+    feed_cgi(id, p);
+}
+
+/******************************************************************************
+* subroutine: feed_cgi                                                        *
+* purpose:    write what is queued for the CGI program as far as its pipe    *
+*             takes it. The body itself is passed on by parse_requestbody;   *
+*             once it is complete the program's stdin is ended                *
+* parameters: id - the descriptor of the client in the pool                   *
+*             p  - a pointer of the pool data structure                       *
+* return:     none                                                            *
+******************************************************************************/
+void feed_cgi(int id, pool *p)
+{
+    int ret;
+    client *c = &p->clients[id];
+    cgi_proc *cp = c->cgi;
 
-    // for POST, parse request body
-    if (!strcasecmp(context->method, "POST"))
-        if (parse_requestbody(id, p, context, is_closed) < 0) goto Done;
+    if (cp->in_fd < 0) return;
 
-    // send response 
-    if (!strcasecmp(context->method, "GET"))
-        serve_get(p->clientfd[id], context, is_closed); 
-    else if (!strcasecmp(context->method, "POST")) 
-        serve_post(p->clientfd[id], context, is_closed);
-    else if (!strcasecmp(context->method, "HEAD")) 
-        serve_head(p->clientfd[id], context, is_closed);
+    ret = (c->state == CONN_BODY) ? cgi_write(cp) : cgi_end(cp);
+    if (ret == CGI_AGAIN || (ret == 0 && c->state == CONN_BODY)) return;
 
-    Done:
-    free(context); 
-    Log("End of processing request. \n");
+    if (ret < 0)
+        Log(LOG_DEBUG, "CGI program of client_fd=%d did not read its input \n", id);
+    end_cgi_input(id, p);
 }
 
 /******************************************************************************
-* subroutine: parse_requestline                                               *
-* purpose:    parse the content of request line                               *
-* parameters: id        - the index of the client in the pool                 *
-*             p         - a pointer of the pool data structure                *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
-* return:     0 on success -1 on error                                        *
+* subroutine: end_cgi_input                                                   *
+* purpose:    stop writing to the CGI program; its stdin pipe is closed, so  *
+*             the program sees EOF. The rest of the body is skipped          *
+* parameters: id - the descriptor of the client in the pool                   *
+*             p  - a pointer of the pool data structure                       *
+* return:     none                                                            *
 ******************************************************************************/
-int parse_requestline(int id, pool *p, HTTPContext *context, int *is_closed)
+void end_cgi_input(int id, pool *p)
 {
-    char buf[MAX_LINE];
-
-    memset(buf, 0, MAX_LINE); 
-
-    if (rio_readlineb(&p->clientrio[id], buf, MAX_LINE) < 0)
-    {
-        *is_closed = 1;
-        Log("Error: rio_readlineb error in process_request \n");
-        serve_error(p->clientfd[id], "500", "Internal Server Error",
-                    "The server encountered an unexpected condition.", *is_closed);
-        return -1;
-    }
+    cgi_proc *cp = p->clients[id].cgi;
 
-    if (sscanf(buf, "%s %s %s", context->method, context->uri, context->version) < 3)
+    if (cp->in_fd != cp->out_fd)
     {
-        *is_closed = 1;
-        Log("Info: Invalid request line: '%s' \n", buf);
-        serve_error(p->clientfd[id], "400", "Bad Request",
-                    "The request is not understood by the server", *is_closed);
-        return -1;
+        p->owner[cp->in_fd] = -1;
+        close(cp->in_fd);
     }
+    cp->in_fd = -1;
+}
 
-    Log("Request: method=%s, uri=%s, version=%s \n",
-        context->method, context->uri, context->version);
-    return 0;
+/******************************************************************************
+* subroutine: out_chunk                                                       *
+* purpose:    queue CGI output as one chunk of a chunked body. The size line  *
+*             has a fixed width (leading zeros are allowed), so it is written *
+*             in place in front of the data                                   *
+* parameters: c   - the client                                                *
+*             buf - the chunk buffer of the client, the data starts at        *
+*                   buf + 6 and 2 bytes of room follow it                     *
+*             n   - the number of data bytes, at most 0xffff                  *
+* return:     none                                                            *
+******************************************************************************/
+static void out_chunk(client *c, char *buf, int n)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    buf[0] = hex[(n >> 12) & 15];
+    buf[1] = hex[(n >> 8) & 15];
+    buf[2] = hex[(n >> 4) & 15];
+    buf[3] = hex[n & 15];
+    buf[4] = '\r';
+    buf[5] = '\n';
+    buf[6 + n] = '\r';
+    buf[7 + n] = '\n';
+    out_ref(c, buf, n + 8, NULL);
 }
 
 /******************************************************************************
-* subroutine: parse_requestheaders                                            *
-* purpose:    parse the content of request headers                            *
-* parameters: id        - the index of the client in the pool                 *
-*             p         - a pointer of the pool data structure                *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
-* return:     0 on success -1 on error                                        *
+* subroutine: pump_cgi                                                        *
+* purpose:    pass the output of a CGI program on to its client. The header  *
+*             is translated into an HTTP response header and the body is sent *
+*             chunked, so the connection stays open. Reading stops while a    *
+*             chunk is waiting for the socket; the full pipe then holds the   *
+*             program back. So one buffer per client takes every chunk        *
+* parameters: id - the descriptor of the client in the pool                   *
+*             p  - a pointer of the pool data structure                       *
+* return:     none                                                            *
 ******************************************************************************/
-int parse_requestheaders(int id, pool *p, HTTPContext *context, int *is_closed)
+void pump_cgi(int id, pool *p)
 {
-    int  ret, cnt = 0, has_contentlen = 0, port;
-    char buf[MAX_LINE], header[MIN_LINE], data[MIN_LINE], pbuf[MIN_LINE];
-    
-    context->content_len = -1; 
+    int  ret, off, framed;
+    ssize_t n;
+    char *buf;
+    client *c = &p->clients[id];
+    cgi_proc *cp;
 
-    do
-    {   
-        if ((ret = rio_readlineb(&p->clientrio[id], buf, MAX_LINE)) < 0)
-            break;
+    while ((cp = c->cgi) != NULL && !OUT_PENDING(c))
+    {
+        if (c->chunk == NULL && (c->chunk = (char *)slab_alloc(SLAB_CHUNK)) == NULL)
+        {
+            // the response can't go on, only closing can tell the client
+            Log(LOG_ERROR, "Error: no memory for CGI output of client_fd=%d \n", id);
+            c->closing = 1;
+            finish_cgi(id, p, 1);
+            return;
+        }
+        buf = c->chunk;
 
-        cnt += ret;
+        // responses with status 1xx, 204 and 304 carry no body
+        framed = cp->status >= 200 && cp->status != 204 && cp->status != 304;
 
-        // if request header is larger than 8196, reject request
-        if (cnt > MAX_LINE)
+        if (!cp->header_done)
         {
-            *is_closed = 1;
-            serve_error(p->clientfd[id], "400", "Bad Request",
-                       "Request header too long.", *is_closed);
-            return -1;
+            if ((ret = cgi_read_header(cp)) == CGI_AGAIN) return;
+            if (ret < 0)
+            {
+                finish_cgi(id, p, 1);
+                serve_error(c, 502, c->closing);
+                goto Flush;
+            }
+
+            metrics_request(cp->method, cp->status);
+            framed = cp->status >= 200 && cp->status != 204 && cp->status != 304;
+            out_header(c, cp->status_line, strlen(cp->status_line), c->closing);
+            out_own(c, cp->header, cp->header_len);
+            cp->header = NULL;
+            if (framed) OUT_LIT(c, HDR_CHUNKED);
+            OUT_LIT(c, "\r\n");
+
+            // body bytes which came along with the header
+            n = cp->hlen - cp->body_off;
+            if (n > 0 && framed && !cp->is_head)
+            {
+                memcpy(buf + 6, cp->hbuf + cp->body_off, n);
+                out_chunk(c, buf, n);
+            }
+            goto Flush;
         }
-       
-        // parse Host header
-        if (strstr(buf, "Host:"))
+
+        off = cp->is_nph ? 0 : 6;
+        n = cgi_read(cp, buf + off, CGI_CHUNK);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if (n <= 0)
         {
-            if (sscanf(buf, "%s: %s:%s", header, data, pbuf) > 0) {
-                port = (int)strtol(pbuf, (char**)NULL, 10);
-                if (port == STATE.s_port)
-                {
-                    context->is_secure = 1;
-                    Log("Secure connection \n");
-                } 
+            if (n < 0)
+            {
+                // the body is cut short, only closing can tell the client
+                Log(LOG_ERROR, "Error: reading CGI output of client_fd=%d failed \n", id);
+                c->closing = 1;
             }
+            else if (framed && !cp->is_head && !cp->is_nph)
+                OUT_LIT(c, "0\r\n\r\n");
+            finish_cgi(id, p, n < 0);
+
+            // nothing of the buffer is queued now
+            slab_free(SLAB_CHUNK, c->chunk);
+            c->chunk = NULL;
         }
- 
-        if (strstr(buf, "Connection: close")) *is_closed = 1;
+        else if (cp->is_nph)
+            out_ref(c, buf, n, NULL);
+        else if (framed && !cp->is_head)
+            out_chunk(c, buf, n);
 
-        if (strstr(buf, "Content-Length")) 
+        Flush:
+        if (out_flush(c) < 0)
         {
-            has_contentlen = 1;
-            if (sscanf(buf, "%s %s", header, data) > 0)
-                context->content_len = (int)strtol(data, (char**)NULL, 10); 
-            Log("Debug: content-length=%d \n", context->content_len);
-        }  
+            c->closing = 1;
+            if (c->cgi) finish_cgi(id, p, 1);
+            return;
+        }
+    }
+}
+
+/******************************************************************************
+* subroutine: finish_cgi                                                      *
+* purpose:    release the CGI program of a client                             *
+* parameters: id    - the descriptor of the client in the pool                *
+*             p     - a pointer of the pool data structure                    *
+*             abort - the program is stopped before its response is complete *
+* return:     none                                                            *
+******************************************************************************/
+void finish_cgi(int id, pool *p, int abort)
+{
+    cgi_proc *cp = p->clients[id].cgi;
+
+    if (cp->in_fd >= 0) p->owner[cp->in_fd] = -1;
+    if (cp->out_fd >= 0) p->owner[cp->out_fd] = -1;
+    cgi_close(cp, abort);
+    p->clients[id].cgi = NULL;
+}
+
+/******************************************************************************
+* subroutine: check_cgi                                                       *
+* purpose:    handle an epoll event on a pipe or FastCGI socket of a CGI      *
+*             program                                                         *
+* parameters: fd     - the descriptor which became ready                      *
+*             p      - a pointer of the pool data structure                   *
+*             events - the epoll events                                       *
+* return:     none                                                            *
+******************************************************************************/
+void check_cgi(int fd, pool *p, uint32_t events)
+{
+    int id = p->owner[fd];
+    cgi_proc *cp = p->clients[id].cgi;
+
+    if (fd == cp->in_fd && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        feed_cgi(id, p);
+
+    // the program has output, or takes more of a body waiting in the buffer
+    handle_client(id, p, 0);
+}
 
-    } while(strcmp(buf, "\r\n"));
+/******************************************************************************
+* subroutine: handle_inotify                                                  *
+* purpose:    read pending inotify events and pass each one to the www index  *
+*             and then to the file cache, which share the instance            *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void handle_inotify()
+{
+    char buf[BUF_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t n;
+    char *ptr;
 
-    if ((!has_contentlen) && (!strcasecmp(context->method, "POST")))
+    while ((n = read(STATE.ino_fd, buf, sizeof(buf))) > 0)
     {
-        serve_error(p->clientfd[id], "411", "Length Required",
-                       "Content-Length is required.", *is_closed);
-        return -1;
+        for (ptr = buf; ptr < buf + n; ptr += sizeof(*ev) + ev->len)
+        {
+            ev = (const struct inotify_event *)ptr;
+            tree_event(ev);
+            cache_event(ev);
+        }
     }
+}
 
-    return 0;
+/******************************************************************************
+* subroutine: http_time                                                       *
+* purpose:    format a time as an HTTP date (RFC 1123), without strftime      *
+* parameters: t   - the time to format                                        *
+*             buf - a buffer of at least 30 bytes for the result              *
+* return:     the length of the formatted date                                *
+******************************************************************************/
+int http_time(time_t t, char *buf)
+{
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+    int year;
+
+    gmtime_r(&t, &tm);
+    year = tm.tm_year + 1900;
+
+    memcpy(buf, days + 3 * tm.tm_wday, 3);
+    buf[3] = ','; buf[4] = ' ';
+    buf[5] = '0' + tm.tm_mday / 10; buf[6] = '0' + tm.tm_mday % 10;
+    buf[7] = ' ';
+    memcpy(buf + 8, months + 3 * tm.tm_mon, 3);
+    buf[11] = ' ';
+    buf[12] = '0' + year / 1000; buf[13] = '0' + year / 100 % 10;
+    buf[14] = '0' + year / 10 % 10; buf[15] = '0' + year % 10;
+    buf[16] = ' ';
+    buf[17] = '0' + tm.tm_hour / 10; buf[18] = '0' + tm.tm_hour % 10;
+    buf[19] = ':';
+    buf[20] = '0' + tm.tm_min / 10; buf[21] = '0' + tm.tm_min % 10;
+    buf[22] = ':';
+    buf[23] = '0' + tm.tm_sec / 10; buf[24] = '0' + tm.tm_sec % 10;
+    memcpy(buf + 25, " GMT", 5);
+    return 29;
 }
 
 /******************************************************************************
-* subroutine: parse_requestbody                                               *
-* purpose:    parse the content of request body (for POST)                    *
-* parameters: id        - the index of the client in the pool                 *
-*             p         - a pointer of the pool data structure                *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
-* return:     0 on success -1 on error                                        *
+* subroutine: update_date                                                     *
+* purpose:    refresh the cached 'Date' header line, at most once per second  *
+* parameters: none                                                            *
+* return:     none                                                            *
 ******************************************************************************/
-int parse_requestbody(int id, pool *p, HTTPContext *context, int *is_closed)
+void update_date()
 {
-    ///TODO
-    return 0;
+    time_t now = time(0);
+
+    if (now == date_time) return;
+    date_time = now;
+
+    memcpy(date_hdr, "Date: ", 6);
+    date_len = 6 + http_time(now, date_hdr + 6);
+    memcpy(date_hdr + date_len, "\r\n", 2);
+    date_len += 2;
 }
+
 /******************************************************************************
-* subroutine: parse_uri                                                       *
-* purpose:    to parse filename and CGI arguments from uri                    *
-* parameters: context - a pointer of the HTTP context data structure          *
+* subroutine: init_responses                                                  *
+* purpose:    render every error response once, so serve_error only has to    *
+*             copy it out. Called at startup                                  *
+* parameters: none                                                            *
 * return:     none                                                            *
 ******************************************************************************/
-void parse_uri(HTTPContext *context)
+void init_responses()
 {
-    char *ptr;
+    int  i, k, blen;
+    char buf[BUF_SIZE], body[BUF_SIZE];
 
-    ///TODO check HTTP://
-    // initialize filename path
-    strcpy(context->filename, STATE.www_path);
+    update_date();
 
-    // parse uri
-    if (!strstr(context->uri, "cgi-bin"))  // static content
+    for (i = 0; errors[i].code; i++)
     {
-        context->is_static = 1;
-        strcat(context->filename, context->uri);
-        if (context->uri[strlen(context->uri)-1] == '/')
-            strcat(context->filename, "index.html");
-    }
-    else
-    {                             // dynamic content
-        ptr = index(context->uri, '?');
-        if (ptr)
+        // build HTTP response body
+        blen = snprintf(body, BUF_SIZE,
+                        "<html><title>Lisod Error</title><body>\r\n"
+                        "Error %d -- %s\r\n"
+                        "<br><p>%s</p></body></html>\r\n",
+                        errors[i].code, errors[i].shortmsg, errors[i].longmsg);
+
+        errors[i].status_len = snprintf(buf, BUF_SIZE, "HTTP/1.1 %d %s\r\n",
+                                        errors[i].code, errors[i].shortmsg);
+        errors[i].status = strdup(buf);
+
+        // everything after 'Date', without and with 'Connection: close'
+        for (k = 0; k < 2; k++)
         {
-            strcpy(context->cgiargs, ptr+1);
-            *ptr = '\0'; ///TODO what is this for?
-        }
-        else
-        {        
-            strcpy(context->cgiargs, "");
+            errors[i].rest_len[k] = snprintf(buf, BUF_SIZE,
+                                   "%s%sContent-Type: text/html\r\n"
+                                   "Content-Length: %d\r\n\r\n%s",
+                                   HDR_SERVER, k ? HDR_CLOSE : "", blen, body);
+            errors[i].rest[k] = strdup(buf);
         }
     }
 }
 
 /******************************************************************************
-* subroutine: validate_file                                                   *
-* purpose:    validate file existence and permisson                           *
-* parameters: client_fd - client descriptor                                   *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
-* return:     0 on success -1 on error                                        *
+* subroutine: out_room                                                        *
+* purpose:    make room in the output queue of a client for one more segment  *
+*             of len bytes of obuf. A full queue is sent right away unless a  *
+*             file region has to leave first. A response which still does not *
+*             fit can't be completed: the rest of its bytes are dropped and  *
+*             the connection is closed once what is queued is sent            *
+* parameters: c   - the client                                                *
+*             len - the number of bytes to copy into obuf, 0 for a reference  *
+* return:     0 if there is room, -1 if the bytes are to be dropped           *
 ******************************************************************************/
-int validate_file(int client_fd, HTTPContext *context, int *is_closed)
+static int out_room(client *c, int len)
 {
-    struct stat sbuf;
+    if (c->overflow) return -1;
 
-    // check file existence
-    if (stat(context->filename, &sbuf) < 0)
+    if ((c->niov == OUT_IOV || c->olen + len > BUF_SIZE) &&
+        c->send_fd < 0 && c->parts == NULL && out_flush(c) < 0)
+        goto Drop;   // the client is gone
+
+    if (c->niov == OUT_IOV || c->olen + len > BUF_SIZE)
     {
-        serve_error(client_fd, "404", "Not Found",
-                    "Server couldn't find this file", *is_closed);
-        return -1;
+        Log(LOG_ERROR, "Error: response does not fit the output queue of client_fd=%d \n",
+            c->rio.rio_fd);
+        goto Drop;
     }
-
-    // check file permission
-    if ((!S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode))
+    if (len > 0 && c->obuf == NULL && (c->obuf = (char *)slab_alloc(SLAB_OUT)) == NULL)
     {
-        serve_error(client_fd, "403", "Forbidden",
-                    "Server couldn't read this file", *is_closed);
-        return -1;
+        Log(LOG_ERROR, "Error: no memory for the output of client_fd=%d \n", c->rio.rio_fd);
+        goto Drop;
     }
-
     return 0;
+
+    Drop:
+    c->overflow = 1;
+    c->closing = 1;
+    return -1;
 }
 
 /******************************************************************************
-* subroutine: serve_head                                                      *
-* purpose:    return response header to client                                *
-* parameters: client_fd - client descriptor                                   *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
+* subroutine: out_append                                                      *
+* purpose:    copy bytes into the output buffer of a client and queue them    *
+* parameters: c   - the client                                                *
+*             s   - the bytes to append                                       *
+*             len - the number of bytes                                       *
 * return:     none                                                            *
 ******************************************************************************/
-void serve_head(int client_fd, HTTPContext *context, int *is_closed)
+void out_append(client *c, const char *s, int len)
 {
-    struct tm tm;
-    struct stat sbuf;
-    time_t now;
-    char   buf[BUF_SIZE], filetype[MIN_LINE], tbuf[MIN_LINE], dbuf[MIN_LINE]; 
+    struct iovec *last;
+    char *dst;
 
-    if (validate_file(client_fd, context, is_closed) < 0) return;
+    if (len <= 0 || out_room(c, len) < 0) return;
+    last = c->niov ? &c->iov[c->niov - 1] : NULL;
+    dst = c->obuf + c->olen;
 
-    stat(context->filename, &sbuf);
-    get_filetype(context->filename, filetype);
+    memcpy(dst, s, len);
+    c->olen += len;
 
-    // get time string
-    tm = *gmtime(&sbuf.st_mtime);
-    strftime(tbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
-    now = time(0);
-    tm = *gmtime(&now);
-    strftime(dbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
-
-    // send response headers to client
-    sprintf(buf, "HTTP/1.1 200 OK\r\n");
-    sprintf(buf, "%sDate: %s\r\n", buf, dbuf);
-    sprintf(buf, "%sServer: Liso/1.0\r\n", buf);
-    if (is_closed) sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-Length: %ld\r\n", buf, sbuf.st_size);
-    sprintf(buf, "%sContent-Type: %s\r\n", buf, filetype);
-    sprintf(buf, "%sLast-Modified: %s\r\n\r\n", buf, tbuf);
-    send(client_fd, buf, strlen(buf), 0);
+    // grow the last segment if it already ends at this spot of obuf
+    if (last && (char *)last->iov_base + last->iov_len == dst)
+    {
+        last->iov_len += len;
+        c->queued += len;
+    }
+    else
+        out_ref(c, dst, len, NULL);
 }
 
 /******************************************************************************
-* subroutine: serve_body                                                      *
-* purpose:    return response body to client                                  *
-* parameters: client_fd - client descriptor                                   *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
+* subroutine: out_long                                                        *
+* purpose:    append a non-negative decimal number to the output buffer       *
+* parameters: c - the client                                                  *
+*             v - the number                                                  *
 * return:     none                                                            *
 ******************************************************************************/
-int serve_body(int client_fd, HTTPContext *context, int *is_closed)
+void out_long(client *c, long v)
 {
-    int fd, filesize;
-    char *ptr;
-    struct stat sbuf;
-    
-    if ((fd = open(context->filename, O_RDONLY, 0)) < 0)
-    {
-        Log("Error: Cann't open file \n");
-        return -1; ///TODO what error code here should be?
-    }
+    char tmp[24];
+    int  i = sizeof(tmp);
 
-    stat(context->filename, &sbuf);
+    do
+    {
+        tmp[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
 
-    filesize = sbuf.st_size;
-    ptr = mmap(0, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    send(client_fd, ptr, filesize, 0); 
-    munmap(ptr, filesize);
+    out_append(c, tmp + i, sizeof(tmp) - i);
+}
 
-    return 0;
+/******************************************************************************
+* subroutine: out_header                                                      *
+* purpose:    start a response in the output buffer with the status line and  *
+*             the headers common to every response                            *
+* parameters: c         - the client                                          *
+*             status    - the status line, including CRLF                     *
+*             len       - the length of the status line                       *
+*             is_closed - whether to send 'Connection: close'                 *
+* return:     none                                                            *
+******************************************************************************/
+void out_header(client *c, const char *status, int len, int is_closed)
+{
+    out_append(c, status, len);
+    out_append(c, date_hdr, date_len);
+    OUT_LIT(c, HDR_SERVER);
+    if (is_closed) OUT_LIT(c, HDR_CLOSE);
 }
 
 /******************************************************************************
-* subroutine: serve_get                                                       *
-* purpose:    return response for GET request                                 *
-* parameters: client_fd - client descriptor                                   *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
+* subroutine: out_ref                                                         *
+* purpose:    queue bytes which live outside the output buffer, such as a     *
+*             cached body or a pre-rendered response, without copying them    *
+* parameters: c     - the client                                              *
+*             s     - the bytes to send                                       *
+*             len   - the number of bytes                                     *
+*             entry - the cache entry holding s, or NULL for static memory    *
 * return:     none                                                            *
 ******************************************************************************/
-void serve_get(int client_fd, HTTPContext *context, int *is_closed)
+void out_ref(client *c, const char *s, int len, cache_entry *entry)
 {
+    if (len == 0 || out_room(c, 0) < 0) return;
+
+    c->iov[c->niov].iov_base = (void *)s;
+    c->iov[c->niov].iov_len = len;
+    c->iov_ref[c->niov] = entry;
+    if (entry) cache_hold(entry);
+    c->niov++;
+    c->queued += len;
+}
 
-    serve_head(client_fd, context, is_closed);
-    serve_body(client_fd, context, is_closed);
+/******************************************************************************
+* subroutine: out_own                                                         *
+* purpose:    queue a malloc'ed buffer, which is freed once it has been sent  *
+* parameters: c   - the client                                                *
+*             buf - the buffer, owned by the output queue from now on         *
+*             len - the number of bytes                                       *
+* return:     none                                                            *
+******************************************************************************/
+void out_own(client *c, char *buf, int len)
+{
+    cache_entry *e = cache_wrap(buf, len);
 
+    if (e == NULL)
+    {
+        // dropped like bytes which don't fit the queue
+        Log(LOG_ERROR, "Error: no memory for the output of client_fd=%d \n", c->rio.rio_fd);
+        free(buf);
+        c->overflow = 1;
+        c->closing = 1;
+        return;
+    }
+    cache_hold(e);
+    out_ref(c, buf, len, e);
+    cache_release(e);
 }
 
 /******************************************************************************
-* subroutine: serve_post                                                      *
-* purpose:    return response for POST request                                *
-* parameters: client_fd - client descriptor                                   *
-*             context   - a pointer refers to HTTP context                    *
-*             is_closed - an indicator if the current transaction is closed   *
+* subroutine: out_reset                                                       *
+* purpose:    drop everything queued for a client                             *
+* parameters: c - the client                                                  *
 * return:     none                                                            *
 ******************************************************************************/
-void serve_post(int client_fd, HTTPContext *context, int *is_closed)
+void out_reset(client *c)
 {
-    struct tm tm;
-    struct stat sbuf;
-    time_t now;
-    char   buf[BUF_SIZE], dbuf[MIN_LINE]; 
+    int i;
 
-    // check file existence
-    if (stat(context->filename, &sbuf) == 0)
+    for (i = 0; i < c->niov; i++)
+        if (c->iov_ref[i]) cache_release(c->iov_ref[i]);
+    c->niov = 0;
+    c->queued = 0;
+    c->olen = 0;
+    slab_free(SLAB_OUT, c->obuf);
+    c->obuf = NULL;
+
+    if (c->send_fd >= 0 && c->parts == NULL) close(c->send_fd);
+    c->send_fd = -1;
+    free_parts(c);
+}
+
+/******************************************************************************
+* subroutine: out_flush                                                       *
+* purpose:    send the queued segments with one sendmsg() (a writev() that    *
+*             takes flags), then the pending file region. While a file        *
+*             follows, MSG_MORE keeps the header in the same TCP segment as   *
+*             the first bytes of the body. The parts of a multipart response  *
+*             are queued as the previous one leaves. Stops on a full socket   *
+*             buffer; the next EPOLLOUT edge calls it again                   *
+* parameters: c - the client                                                  *
+* return:     0 when everything is sent, SEND_AGAIN if the socket is full,    *
+*             -1 on error, with the queue dropped                             *
+******************************************************************************/
+int out_flush(client *c)
+{
+    int i, ret = 0;
+    ssize_t n;
+    struct msghdr msg;
+    uint64_t start;
+
+    if (!OUT_PENDING(c)) return 0;
+    start = metrics_now();
+
+    for (;;)
     {
-        serve_get(client_fd, context, is_closed);
-        return;
+        while (c->niov > 0)
+        {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = c->iov;
+            msg.msg_iovlen = c->niov;
+
+            if (c->rio.rio_ssl)
+                n = tls_writev(c->rio.rio_ssl, c->iov, c->niov);
+            else
+                n = sendmsg(c->rio.rio_fd, &msg, MSG_NOSIGNAL |
+                            (c->send_fd >= 0 || c->parts ? MSG_MORE : 0));
+            if (n < 0)
+            {
+                if (errno == EINTR) continue;
+                ret = (errno == EAGAIN || errno == EWOULDBLOCK) ? SEND_AGAIN : -1;
+                goto Done;
+            }
+            METRICS->bytes_sent += n;
+            c->queued -= n;
+
+            // drop the segments which are fully sent
+            for (i = 0; i < c->niov && (size_t)n >= c->iov[i].iov_len; i++)
+            {
+                n -= c->iov[i].iov_len;
+                if (c->iov_ref[i]) cache_release(c->iov_ref[i]);
+            }
+            if (i < c->niov)
+            {
+                c->iov[i].iov_base = (char *)c->iov[i].iov_base + n;
+                c->iov[i].iov_len -= n;
+            }
+            c->niov -= i;
+            memmove(c->iov, c->iov + i, c->niov * sizeof(struct iovec));
+            memmove(c->iov_ref, c->iov_ref + i, c->niov * sizeof(cache_entry *));
+        }
+        c->olen = 0;
+        slab_free(SLAB_OUT, c->obuf);   // not needed until the next response
+        c->obuf = NULL;
+
+        if (c->send_fd >= 0 && (ret = send_file(c)) != 0) goto Done;
+
+        // a multipart response queues its next part once the last has left
+        if (c->parts == NULL) break;
+        out_part(c);
     }
 
-    // get time string
-    now = time(0);
-    tm = *gmtime(&now);
-    strftime(dbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+    Done:
+    hist_record(&METRICS->send, metrics_now() - start);
+    if (ret < 0) out_reset(c);   // the client is gone, drop what is queued
+    return ret;
+}
 
-    // send response headers to client
-    sprintf(buf, "HTTP/1.1 204 No Content\r\n");
-    sprintf(buf, "%sDate: %s\r\n", buf, dbuf);
-    sprintf(buf, "%sServer: Liso/1.0\r\n", buf);
-    if (is_closed) sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-Length: 0\r\n", buf);
-    sprintf(buf, "%sContent-Type: text/html\r\n", buf);
-    send(client_fd, buf, strlen(buf), 0);
-}
-
-/******************************************************************************
-* subroutine: get_filetype                                                    *
-* purpose:    find filetype by filename extension                             *
-* parameters: filename: the requested filename                               *
-*             filetype: a pointer to return filetype result                   *
-* return:     none                                                            *
-******************************************************************************/
-void get_filetype(char *filename, char *filetype)
-{
-    if (strstr(filename, ".html"))
-        strcpy(filetype, "text/html");
-    else if (strstr(filename, ".css"))
-        strcpy(filetype, "text/css");
-    else if (strstr(filename, ".js"))
-        strcpy(filetype, "application/javascript");
-    else if (strstr(filename, ".png"))
-        strcpy(filetype, "image/png");
-    else if (strstr(filename, ".gif"))
-        strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".jpg"))
-        strcpy(filetype, "image/jpeg");
-    else
-        strcpy(filetype, "text/plain");
+/******************************************************************************
+* subroutine: find_error                                                      *
+* purpose:    find the pre-rendered response of an error code                 *
+* parameters: errnum - the error code                                         *
+* return:     index into errors, unknown codes map to the last entry (500)    *
+******************************************************************************/
+static int find_error(int errnum)
+{
+    int i;
+
+    for (i = 0; errors[i + 1].code && errors[i].code != errnum; i++)
+        ;
+    return i;
 }
 
 /******************************************************************************
 * subroutine: serve_error                                                     *
-* purpose:    return error message to client                                  *
-* parameters: client_fd: client descriptor                                    *
+* purpose:    queue an error message for a client. The response was rendered  *
+*             at startup, only the status and 'Date' lines are copied         *
+* parameters: c: the client                                                   *
 *             errnum: error number                                            *
-*             shortmsg: short error message                                   *
-*             longmsg:  long error message                                    *
 *             is_closed - an indicate if sending 'Connection: close' back     *
 * return:     none                                                            *
 ******************************************************************************/
-void serve_error(int client_fd, char *errnum, char *shortmsg, char *longmsg, 
-                 int is_closed) {
-    struct tm tm;
-    time_t now;
-    char buf[MAX_LINE], body[MAX_LINE], dbuf[MIN_LINE];
-
-    now = time(0);
-    tm = *gmtime(&now);
-    strftime(dbuf, MIN_LINE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+void serve_error(client *c, int errnum, int is_closed)
+{
+    int i = find_error(errnum), k = is_closed ? 1 : 0;
 
-    // build HTTP response body
-    sprintf(body, "<html><title>Lisod Error</title>");
-    sprintf(body, "%s<body>\r\n", body);
-    sprintf(body, "%sError %s -- %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<br><p>%s</p></body></html>\r\n", body, longmsg);
+    metrics_request(c->context ? c->context->method : METHOD_OTHER, errors[i].code);
+    out_append(c, errors[i].status, errors[i].status_len);
+    out_append(c, date_hdr, date_len);
+    out_ref(c, errors[i].rest[k], errors[i].rest_len[k], NULL);
+}
 
-    // print HTTP response
-    sprintf(buf, "HTTP/1.1 %s %s\r\n", errnum, shortmsg);
-    sprintf(buf, "%sDate: %s\r\n", buf, dbuf);
-    sprintf(buf, "%sServer: Liso/1.0\r\n", buf);
-    if (is_closed) sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-type: text/html\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n\r\n", buf, (int)strlen(body));
-    send(client_fd, buf, strlen(buf), 0);
-    send(client_fd, body, strlen(body), 0);
+/******************************************************************************
+* subroutine: send_error                                                      *
+* purpose:    send an error message on a socket which has no client slot,     *
+*             with a single non-blocking writev. Best effort: a new socket    *
+*             always has room for it                                          *
+* parameters: client_fd: client descriptor                                    *
+*             errnum: error number                                            *
+*             is_closed - an indicate if sending 'Connection: close' back     *
+* return:     none                                                            *
+******************************************************************************/
+void send_error(int client_fd, int errnum, int is_closed)
+{
+    int i = find_error(errnum), k = is_closed ? 1 : 0;
+    struct iovec iov[3];
+
+    iov[0].iov_base = errors[i].status;
+    iov[0].iov_len = errors[i].status_len;
+    iov[1].iov_base = date_hdr;
+    iov[1].iov_len = date_len;
+    iov[2].iov_base = errors[i].rest[k];
+    iov[2].iov_len = errors[i].rest_len[k];
+
+    if (writev(client_fd, iov, 3) < 0)
+        Log(LOG_ERROR, "Error: failed sending error %d to client_fd=%d \n", errnum, client_fd);
 }
 
 /******************************************************************************
@@ -810,7 +3617,7 @@ int close_socket(int sock)
 {
     if (close(sock))
     {
-        Log("Error: failed closing socket. \n");
+        Log(LOG_ERROR, "Error: failed closing socket. \n");
         return -1;
     }
     return 0;
@@ -824,8 +3631,10 @@ int close_socket(int sock)
 ******************************************************************************/
 void clean()
 {
-    fclose(STATE.log);
-    close_socket(STATE.sock);
+    cgi_shutdown();
+    log_close();
+    if (STATE.sock > 0) close_socket(STATE.sock);
+    if (STATE.s_sock > 0) close_socket(STATE.s_sock);
 }
 
 void signal_handler(int sig)
@@ -833,8 +3642,14 @@ void signal_handler(int sig)
     switch(sig)
     {
         case SIGHUP:
-            Log("hangup signal catched \n");
-            break; // rehash the server;
+            RELOAD = 1;   // the event loop reloads
+            break;
+        case SIGUSR2:
+            UPGRADE = 1;
+            break;
+        case SIGQUIT:
+            if (DRAIN == 0) DRAIN = 1;
+            break;
         case SIGTERM:
             KEEPON = 0;
         default:
@@ -846,71 +3661,144 @@ void signal_handler(int sig)
  *                            wrappers from csapp                             *
  *****************************************************************************/
 
-/* 
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+/*
+ * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+void rio_readinitb(rio_t *rp, int fd)
 {
-    int cnt;
+    rp->rio_fd = fd;
+    rp->rio_ssl = NULL;
+    rp->rio_cnt = 0;
+    rp->rio_scan = 0;
+    rp->rio_buf = rp->rio_bufptr = rp->rio_mark = NULL;
+}
 
-    while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
-        if (rp->rio_cnt < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
+/*
+ * rio_release - Give the internal buffer back while nothing is buffered, so
+ *    an idle connection holds none. rio_fill takes a new one.
+ */
+void rio_release(rio_t *rp)
+{
+    slab_free(SLAB_RIO, rp->rio_buf);
+    rp->rio_buf = rp->rio_bufptr = rp->rio_mark = NULL;
+    rp->rio_cnt = 0;
+    rp->rio_scan = 0;
+}
+
+/*
+ * rio_fill - Pull the bytes a non-blocking descriptor has ready into the
+ *    free tail of the internal buffer, after moving unread bytes (and the
+ *    request head from rio_mark) to the front. Returns 1 if the buffer
+ *    filled up before the descriptor was drained, 0 once read() reports
+ *    EAGAIN and -1 on EOF or error, or if no buffer is left for it.
+ */
+int rio_fill(rio_t *rp)
+{
+    int n, room, keep;
+    char *start, *end;
+
+    if (rp->rio_buf == NULL) {            /* idle until now */
+        if ((rp->rio_buf = (char *)slab_alloc(SLAB_RIO)) == NULL) {
+            errno = ENOMEM;
+            return -1;
         }
-        else if (rp->rio_cnt == 0)  /* EOF */
-            return 0;
+        rp->rio_bufptr = rp->rio_buf;
+    }
+
+    start = rp->rio_mark ? rp->rio_mark : rp->rio_bufptr;
+    if (start != rp->rio_buf) {           /* compact kept and unread bytes */
+        keep = rp->rio_bufptr - start;
+        memmove(rp->rio_buf, start, keep + rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf + keep;
+        if (rp->rio_mark) rp->rio_mark = rp->rio_buf;
+    }
+
+    while ((room = rp->rio_buf + MAX_LINE - (end = rp->rio_bufptr + rp->rio_cnt)) > 0) {
+        if (rp->rio_ssl)
+            n = tls_read(rp->rio_ssl, end, room);
         else
-            rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
+            n = read(rp->rio_fd, end, room);
+        if (n > 0)
+            rp->rio_cnt += n;
+        else if (n == 0)                   /* EOF */
+            return -1;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        else if (errno != EINTR)           /* interrupted by sig handler return */
+            return -1;
+    }
+    return 1;
+}
+
+/* 
+ * rio_scanline - find the next text line in the internal buffer, never from
+ *    the descriptor, and consume it without copying. line is set to the line
+ *    in place, without its "\r\n" or "\n" terminator, and stays valid until
+ *    the next rio_fill. The buffer is searched with memchr, and the part of
+ *    a partial line already searched is not searched again. Returns the
+ *    consumed length, 0 if no complete line is buffered yet (the partial
+ *    line stays in place) or -1 if the line cannot fit.
+ */
+ssize_t rio_scanline(rio_t *rp, slice *line)
+{
+    int n;
+    char *eol;
+
+    eol = memchr(rp->rio_bufptr + rp->rio_scan, '\n', rp->rio_cnt - rp->rio_scan);
+    if (eol == NULL) {                    /* no complete line buffered */
+        rp->rio_scan = rp->rio_cnt;
+        return RIO_FULL(rp) ? -1 : 0;
     }
 
-    /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->rio_cnt < n)
-        cnt = rp->rio_cnt;
-    memcpy(usrbuf, rp->rio_bufptr, cnt);
-    rp->rio_bufptr += cnt;
-    rp->rio_cnt -= cnt;
-    return cnt;
+    n = eol - rp->rio_bufptr;
+    line->ptr = rp->rio_bufptr;
+    line->len = (n > 0 && eol[-1] == '\r') ? n - 1 : n;
+
+    n++;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    rp->rio_scan = 0;
+    return n;
 }
 
 /*
- * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
+ * slice_token - take the next blank separated token off the front of s.
+ *    Returns 1 and sets tok, or 0 if s holds no more tokens.
  */
-void rio_readinitb(rio_t *rp, int fd)
+int slice_token(slice *s, slice *tok)
 {
-    rp->rio_fd = fd;
-    rp->rio_cnt = 0;
-    rp->rio_bufptr = rp->rio_buf;
+    while (s->len > 0 && (*s->ptr == ' ' || *s->ptr == '\t')) {
+        s->ptr++;
+        s->len--;
+    }
+    if (s->len == 0) return 0;
+
+    tok->ptr = s->ptr;
+    while (s->len > 0 && *s->ptr != ' ' && *s->ptr != '\t') {
+        s->ptr++;
+        s->len--;
+    }
+    tok->len = s->ptr - tok->ptr;
+    return 1;
 }
 
-/* 
- * rio_readlineb - robustly read a text line (buffered)
+/*
+ * slice_has - tell if a comma separated list such as a Connection header
+ *    holds a token, compared without case. Blanks around the elements are
+ *    ignored. Returns 1 if it does, 0 if not.
  */
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+int slice_has(slice s, const char *token)
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break;    /* EOF, some data was read */
-        } else
-            return -1;    /* error */
+    const char *p = s.ptr, *end = s.ptr + s.len, *elem;
+    int len = strlen(token), n;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        elem = p;
+        while (p < end && *p != ',') p++;
+        for (n = p - elem; n > 0 && (elem[n - 1] == ' ' || elem[n - 1] == '\t'); n--)
+            ;
+        if (n == len && n > 0 && !strncasecmp(elem, token, len)) return 1;
     }
-    *bufp = 0;
-    return n;
+    return 0;
 }
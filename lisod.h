@@ -2,53 +2,253 @@
 #define _LISOD_H_
 
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <getopt.h>
 #include "log.h"
+#include "cache.h"
+#include "encode.h"
+#include "mime.h"
+#include "tree.h"
+#include "metrics.h"
+#include "tls.h"
+#include "cgi.h"
+#include "slab.h"
+#include "timer.h"
+
+/* static fragments of response headers */
+#define HDR_200    "HTTP/1.1 200 OK\r\n"
+#define HDR_204    "HTTP/1.1 204 No Content\r\n"
+#define HDR_301    "HTTP/1.1 301 Moved Permanently\r\n"
+#define HDR_206    "HTTP/1.1 206 Partial Content\r\n"
+#define HDR_304    "HTTP/1.1 304 Not Modified\r\n"
+#define HDR_416    "HTTP/1.1 416 Range Not Satisfiable\r\n"
+#define HDR_SERVER "Server: Liso/1.0\r\n"
+#define HDR_CLOSE  "Connection: close\r\n"
+#define HDR_CHUNKED "Transfer-Encoding: chunked\r\n"
+#define OUT_LIT(c, s) out_append((c), (s), sizeof(s) - 1)
+#define OUT_PENDING(c) ((c)->niov > 0 || (c)->send_fd >= 0 || (c)->parts)
+#define OUT_FULL(c) ((c)->niov > OUT_IOV - 4 || (c)->olen > BUF_SIZE - OUT_RESERVE || \
+                     (c)->queued >= OUT_HIGH_WATER)
+#define OUT_QUEUED(c) ((c)->queued + ((c)->send_fd >= 0 ? (c)->send_end - (c)->send_off : 0))
+#define SLICE_IS(s, lit) ((s).len == sizeof(lit) - 1 && \
+                          !strncasecmp((s).ptr, (lit), sizeof(lit) - 1))
 
 /* this data structure wraps some attributes used for sending data with client */
 typedef struct
 {
     int rio_fd;                 // descriptor for this internal buf 
+    SSL *rio_ssl;               // TLS state of rio_fd, NULL for plain HTTP
     int rio_cnt;                // unread bytes in internal buf 
+    int rio_scan;               // unread bytes known to hold no newline
     char *rio_bufptr;           // next unread byte in internal buf 
-    char rio_buf[MAX_LINE];     // internal buffer 
+    char *rio_buf;              // internal buffer, NULL while idle 
+    char *rio_mark;             // start of the request head being parsed,
+                                // kept in the buffer, or NULL
 } rio_t;
 
-/* this data struture wraps some attributes used to manage a pool of connected 
- * clients. (originally from CSAPP)*/
+/* the request head and the unread bytes behind it fill the whole buffer */
+#define RIO_FULL(rp) (((rp)->rio_mark ? (rp)->rio_bufptr - (rp)->rio_mark : 0) + \
+                      (rp)->rio_cnt == MAX_LINE)
+
+/* this data structure is a view of bytes in place in a read buffer, valid
+ * until the buffer is refilled. The bytes are not NUL terminated */
 typedef struct
 {
-    int maxfd;                   // Largest descriptor in read_set
-    int nready;                  // Number of ready descriptors from select
-    int maxi;                    // Highwater index into client array
-    int clientfd[FD_SETSIZE];    // Set of active client descriptors
-    fd_set read_set;             // Set of all active descriptors
-    fd_set ready_set;            // Subset of descriptors ready for reading
-    rio_t clientrio[FD_SETSIZE]; // Set of active read buffers
-} pool;
+    const char *ptr;
+    int len;
+} slice;
+
+/* this data structure is a view of bytes of the request head, as an offset
+ * from its first byte (rio_mark), so it survives the buffer being compacted.
+ * Valid until the head is parsed */
+typedef struct
+{
+    unsigned short off;
+    unsigned short len;
+} span;
+
+#define SPAN_STR(rp, s) ((rp)->rio_mark + (s).off)  // NUL terminated in place
+#define URI_PATH(ctx) ((ctx)->filename + STATE.www_len)  // normalized path
 
-/* this datastructure wraps some attributes used for processing HTTP requests */
+/* request methods, the values index the metrics */
+enum
+{
+    METHOD_GET = MET_GET,
+    METHOD_HEAD = MET_HEAD,
+    METHOD_POST = MET_POST,
+    METHOD_OTHER = MET_OTHER
+};
+
+/* this data structure holds the validators and byte ranges a static request
+ * asks about. It is only taken by requests which send them; a multipart
+ * response then keeps it in the client until the last part is queued */
+typedef struct
+{
+    unsigned char nomatch;      // If-None-Match: 0 absent, 1 tags, 2 "*"
+    unsigned char ntags;        // tags in the server's format, in tags
+    signed char if_range;       // If-Range: 0 absent, 1 tag, 2 date, -1 unusable
+    signed char nranges;        // byte ranges asked for, -1 if Range is ignored
+    unsigned char partial;      // the response is 206 with these ranges
+    uint64_t tags[COND_TAGS];   // If-None-Match
+    time_t since;               // If-Modified-Since, -1 if absent or invalid
+    uint64_t range_tag;         // If-Range, as a tag
+    time_t range_date;          // or as a date
+    long long first[MAX_RANGES];// byte ranges, -1 for an omitted end
+    long long last[MAX_RANGES];
+    // the parts of a multipart response being sent
+    int part;                   // next range to queue
+    int fd;                     // file of the ranges, or -1 if cached
+    cache_entry *entry;         // cached file of the ranges, held
+    long long size;             // size of the file
+    uint64_t etag;              // names the boundary
+    const char *type;           // MIME type of the file
+} http_cond;
+
+/* this datastructure wraps some attributes used for processing HTTP requests.
+ * The request line stays in the read buffer while it is needed, so only the
+ * resolved path of a static file is copied out */
 typedef struct
 {
-    int  is_secure;
-    int  is_static;
-    int  content_len;
-    char method[MIN_LINE];
-    char version[MIN_LINE];
-    char uri[MAX_LINE];
-    char filename[MAX_LINE];
-    char cgiargs[MAX_LINE];
+    unsigned char method;       // METHOD_*
+    unsigned char version;      // 11 for HTTP/1.1, 10 for HTTP/1.0, else 0
+    unsigned char is_secure;
+    unsigned char is_static;
+    unsigned char is_metrics;   // the path is METRICS_URI
+    unsigned char expect;       // the client waits for 100 Continue
+    signed char chunked;        // Transfer-Encoding: 1 chunked, -1 other
+    unsigned char accept;       // content codings the client takes, ENC_MASK
+    unsigned char encoding;     // content coding of the file sent, ENC_*
+    span path;                  // path of the URI, in the head
+    span query;                 // query string of the URI, in the head
+    long long content_len;      // Content-Length, -1 if not given
+    long long size;             // size of the file the response header gave
+    cache_entry *entry;         // cached copy of the file being served
+    cgi_env *env;               // environment of a CGI request, else NULL
+    http_cond *cond;            // validators and ranges asked for, else NULL
+    char *filename;             // www root and normalized path of the request
+    uint64_t parse_ns;          // time spent parsing the request so far
 } HTTPContext;
 
+/* states of the per-connection request parser. A connection only advances
+ * when bytes are ready, so a slow client never blocks the others */
+enum
+{
+    CONN_REQLINE,               // waiting for a complete request line
+    CONN_HEADERS,               // waiting for the rest of the header block
+    CONN_BODY,                  // passing the request body to its consumer
+    CONN_RESPONSE               // request complete, response to be sent
+};
+
+/* deadlines a connection can be waiting on, the values index the metrics
+ * and STATE.timeouts */
+enum
+{
+    TIMEOUT_HEADER = MET_HEADER,       // the request head must arrive in time
+    TIMEOUT_BODY = MET_BODY,           // the request body must keep moving
+    TIMEOUT_KEEPALIVE = MET_KEEPALIVE, // idle between requests
+    TIMEOUT_WRITE = MET_WRITE,         // the response must keep moving
+    TIMEOUT_NONE = MET_TIMEOUTS        // waiting on the server (a CGI program)
+};
+
+/* states of the decoder of a chunked request body */
+enum
+{
+    CHUNK_NONE,                 // the body has a Content-Length
+    CHUNK_SIZE,                 // waiting for the size line of a chunk
+    CHUNK_END,                  // waiting for the CRLF after chunk data
+    CHUNK_TRAILER               // waiting for the end of the trailer fields
+};
+
+/* this data structure wraps the state kept for one connected client */
+typedef struct
+{
+    int state;                  // current state of the request parser
+    int header_cnt;             // bytes of request header read so far
+    long long body_left;        // bytes of the body (or chunk) not consumed
+    long long body_read;        // bytes of a chunked body so far
+    int chunked;                // state of the chunked body decoder
+    int stalled;                // the CGI program can't take more body now
+    int closing;                // close once the pending response is sent
+    int handshake;              // TLS handshake still in progress
+    int timeout;                // TIMEOUT_* deadline the timer is armed for
+    int idle_prev;              // neighbours in the list of idle keep-alive
+    int idle_next;              // clients, -1 at its ends
+    time_t idle_since;          // when it went idle
+    timer_node timer;           // closes the connection if it is not met
+    int niov;                   // unsent memory segments in iov
+    long long queued;           // unsent bytes of those segments
+    int paused;                 // not read from until the queue drains
+    int overflow;               // a response did not fit the queue, its
+                                // bytes are dropped until the close
+    struct iovec iov[OUT_IOV];  // response bytes to send, in order
+    cache_entry *iov_ref[OUT_IOV]; // cache entry each segment points into
+    int send_fd;                // file sent after the segments, or -1
+    off_t send_off;             // next byte of send_fd to send
+    off_t send_end;             // end of the region of send_fd to send
+    int olen;                   // bytes used in obuf
+    char *obuf;                 // response headers being built, or NULL
+    http_cond *parts;           // ranges of a multipart response to queue
+    HTTPContext *context;       // request being parsed, NULL between requests
+    cgi_proc *cgi;              // CGI program answering the current request
+    char *chunk;                // its output being sent, reused for each chunk
+    rio_t rio;                  // read buffer of this client
+} client;
+
+/* this data struture wraps some attributes used to manage a pool of connected 
+ * clients. Ready descriptors are reported by an edge-triggered epoll instance,
+ * so the cost of a wakeup depends on the number of ready sockets only. Client
+ * slots are indexed by descriptor. (originally from CSAPP)*/
+typedef struct
+{
+    int epfd;                    // epoll instance watching all descriptors
+    int nready;                  // Number of ready descriptors from epoll_wait
+    int nconn;                   // Number of connected clients
+    int maxconn;                 // Size of the client table (fd limit)
+    struct epoll_event *events;  // Ready events returned by epoll_wait
+    client *clients;             // Client slots indexed by descriptor
+    int *owner;                  // Client of each CGI descriptor, or -1
+    int idle_head;               // idle keep-alive client idle the longest
+    int idle_tail;               // and the one idle the shortest, or -1
+    int backlog;                 // BACKLOG_* listeners with queued connections
+    int reject_budget;           // 503s which may still be sent this second
+    time_t budget_time;          // the second reject_budget is for
+    int spare_fd;                // given up to shed a connection on EMFILE
+} pool;
+
+/* listening sockets which may have connections in their queue */
+#define BACKLOG_HTTP  1
+#define BACKLOG_HTTPS 2
+
+/* a connection in the queue can be taken: there's a free slot, an idle one
+ * to evict, or a 503 left to send */
+#define POOL_EVICTS(p) ((p)->idle_head >= 0 && \
+                        (p)->clients[(p)->idle_head].idle_since + EVICT_IDLE <= time(0))
+#define POOL_ADMITS(p) ((p)->backlog && (!STATE.is_full || POOL_EVICTS(p) || \
+                                         (p)->reject_budget > 0))
+
+/* environment of a binary upgrade: the listening sockets passed on, and the
+ * server which passed them */
+#define ENV_FDS     "LISOD_FDS"
+#define ENV_OLD_PID "LISOD_OLD_PID"
+
 /* declaration of subroutines */
 void clean();
 void usage_exit();
@@ -56,29 +256,89 @@ void lisod_shutdown();
 void signal_handler(int sig);
 void daemonize();
 int  close_socket(int sock);
+int  open_listenfd(int port);
+void inherit_listeners();
+int  open_listeners();
+int  run_server();
+pid_t spawn_worker(int id, sigset_t *mask);
+int  supervise_workers();
+void reload_server(int caches);
+int  upgrade_server();
+void retire_old();
 
-void init_pool(pool *p);
-int  add_client(int client_fd, pool *p);
-void remove_client(int index, pool *p);
+int  init_pool(pool *p);
+int  add_client(int client_fd, pool *p, int is_secure);
+void remove_client(int id, pool *p);
+void idle_append(pool *p, int id);
+void idle_remove(pool *p, int id);
+void admit_clients(pool *p);
+int  drain_server(pool *p);
+void accept_clients(int listen_fd, pool *p);
+int  evict_idle(pool *p);
+void reject_client(int client_fd, pool *p, int is_secure);
 void check_clients(pool *p);
+void handle_client(int id, pool *p, uint32_t events);
+int new_context(client *c);
+void set_timeout(int id, pool *p, int progress);
+void expire_client(timer_node *t, void *arg);
+void free_context(client *c);
 
 void process_request(int id, pool *p, int *is_closed); 
 int  parse_requestline(int id, pool *p, HTTPContext *context, int *is_closed);
-void parse_uri(HTTPContext *context);
+int  parse_uri(client *c, HTTPContext *context);
 int  parse_requestheaders(int id, pool *p, HTTPContext *context, int *is_closed);
-int parse_requestbody(int id, pool *p, HTTPContext *context, int *is_closed);
-void serve_head(int client_fd, HTTPContext *context, int *is_closed);
-void serve_get(int client_fd, HTTPContext *context,  int *is_closed);
-void serve_post(int client_fd, HTTPContext *context,  int *is_closed);
-int  serve_body(int client_fd, HTTPContext *context, int *is_closed);
-void serve_error(int client_fd, char *errnum, char *shortmsg, char *longmsg, int is_closed);
+int  parse_header(HTTPContext *context, slice name, slice value, int *is_closed);
+int  parse_requestbody(int id, pool *p, HTTPContext *context, int *is_closed);
+http_cond *request_cond(HTTPContext *context);
+int  parse_etag(const char *s, int len, uint64_t *etag);
+void parse_etags(http_cond *cond, slice value);
+void parse_ranges(http_cond *cond, slice value);
+time_t parse_http_time(slice value);
+int  not_modified(http_cond *cond, time_t mtime, uint64_t etag);
+int  resolve_ranges(http_cond *cond, long long size, time_t mtime, uint64_t etag);
+int  serve_head(client *c, HTTPContext *context, int *is_closed);
+void serve_get(client *c, HTTPContext *context,  int *is_closed);
+int  part_header(char *buf, int size, http_cond *parts, int i);
+void out_part(client *c);
+void free_parts(client *c);
+void serve_post(client *c, HTTPContext *context,  int *is_closed);
+void serve_metrics(client *c, HTTPContext *context, int *is_closed);
+void serve_cgi(int id, pool *p, HTTPContext *context, int *is_closed);
+void feed_cgi(int id, pool *p);
+void end_cgi_input(int id, pool *p);
+void pump_cgi(int id, pool *p);
+void finish_cgi(int id, pool *p, int abort);
+void check_cgi(int fd, pool *p, uint32_t events);
+void handle_inotify();
+int  serve_body(client *c, HTTPContext *context, int *is_closed);
+int  send_file(client *c);
+void serve_error(client *c, int errnum, int is_closed);
+void send_error(int client_fd, int errnum, int is_closed);
+
+int  http_time(time_t t, char *buf);
+void update_date();
+void init_responses();
+void out_append(client *c, const char *s, int len);
+void out_long(client *c, long v);
+void out_header(client *c, const char *status, int len, int is_closed);
+void out_ref(client *c, const char *s, int len, cache_entry *entry);
+void out_own(client *c, char *buf, int len);
+void out_reset(client *c);
+int  out_flush(client *c);
 
-int  validate_file(int client_d, HTTPContext *context, int *is_closed);
-void get_filetype(char *filename, char *filetype);
+int  validate_file(client *c, HTTPContext *context, int *is_closed,
+                   struct stat *sbuf, int found);
+int  find_sibling(HTTPContext *context, struct stat *sbuf);
+int  find_file(HTTPContext *context, struct stat *sbuf, int found);
+int  normalize_uri(const char *uri, int len, char *out, int size);
+void serve_redirect(client *c, HTTPContext *context, int is_closed);
 
 // wrappers from csapp
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd);
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void rio_release(rio_t *rp);
+int  rio_fill(rio_t *rp);
+ssize_t rio_scanline(rio_t *rp, slice *line);
+int  slice_token(slice *s, slice *tok);
+int  slice_has(slice s, const char *token);
 
 #endif
@@ -1,46 +1,316 @@
 /*
  * log.c
  *
- * Description: This file defines routines to record logs for Liso server
+ * Description: This file defines routines to record logs for Liso server.
+ *              Log() formats a message into a slot of a lock-free ring and
+ *              returns; a background thread drains the ring and writes the
+ *              messages to the log file in batches, so the event loop never
+ *              waits on the disk. Every process (each worker after fork)
+ *              runs its own flusher.
  *
  */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <unistd.h>
 #include "log.h"
 
-FILE *log_open(const char *path)
+/* one message in the ring. seq tells its owner: a producer may fill the slot
+ * when seq equals its ticket, the flusher may drain it when seq is one more */
+typedef struct
+{
+    atomic_size_t seq;
+    int  len;
+    char msg[LOG_LINE];
+} log_slot;
+
+int log_level = LOG_INFO;
+
+static log_slot *ring;
+static atomic_size_t ring_head;      // next ticket handed to a producer
+static size_t ring_tail;             // next slot to drain, flusher only
+static atomic_long dropped;          // messages lost because the ring was full
+static atomic_int flusher_state;     // 0 not running, 1 running, 2 stopping
+static pthread_t flusher;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+/******************************************************************************
+* subroutine: ring_reset                                                      *
+* purpose:    empty the ring. Also used in a forked child, which must not     *
+*             write the messages its parent is already writing                *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+static void ring_reset()
+{
+    size_t i;
+
+    for (i = 0; i < LOG_SLOTS; i++)
+        atomic_store_explicit(&ring[i].seq, i, memory_order_relaxed);
+    atomic_store(&ring_head, 0);
+    ring_tail = 0;
+    atomic_store(&dropped, 0);
+    atomic_store(&flusher_state, 0);
+    pthread_mutex_init(&drain_lock, NULL);
+}
+
+/******************************************************************************
+* subroutine: log_drain                                                       *
+* purpose:    write every message published in the ring to the log file,     *
+*             batching as many as fit into one write()                        *
+* parameters: none                                                            *
+* return:     number of messages written, -1 if the file can't be written     *
+******************************************************************************/
+static int log_drain()
+{
+    static char batch[64 << 10];
+    int  len = 0, cnt = 0, nmsg = 0;
+    long lost;
+    size_t seq;
+    log_slot *slot;
+    struct tm tm;
+    time_t now;
+
+    pthread_mutex_lock(&drain_lock);
+    for (;;)
+    {
+        slot = &ring[ring_tail & (LOG_SLOTS - 1)];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if (seq == ring_tail + 1 && len + slot->len <= sizeof(batch))
+        {
+            memcpy(batch + len, slot->msg, slot->len);
+            len += slot->len;
+            atomic_store_explicit(&slot->seq, ring_tail + LOG_SLOTS,
+                                  memory_order_release);
+            ring_tail++;
+            cnt++;
+            nmsg++;
+            continue;
+        }
+
+        // the slots are free already, a batch which can't be written is
+        // counted as dropped and reported by a later drain
+        if (len > 0 && write(fileno(STATE.log), batch, len) < 0)
+        {
+            atomic_fetch_add(&dropped, nmsg);
+            cnt = -1;
+            break;
+        }
+        len = nmsg = 0;
+        if (seq != ring_tail + 1) break;   // nothing more published
+    }
+
+    if ((lost = atomic_exchange(&dropped, 0)) > 0)
+    {
+        now = time(NULL);
+        localtime_r(&now, &tm);
+        len = snprintf(batch, sizeof(batch),
+                       "[%04d%02d%02d %02d:%02d:%02d] Warning: %ld log "
+                       "messages dropped, ring full or file not writable \n",
+                       tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+                       tm.tm_hour, tm.tm_min, tm.tm_sec, lost);
+        if (write(fileno(STATE.log), batch, len) < 0)
+        {
+            atomic_fetch_add(&dropped, lost);
+            cnt = -1;
+        }
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return cnt;
+}
+
+/******************************************************************************
+* subroutine: log_flusher                                                     *
+* purpose:    body of the background thread, drains the ring periodically    *
+* parameters: arg - unused                                                    *
+* return:     NULL                                                            *
+******************************************************************************/
+static void *log_flusher(void *arg)
+{
+    struct timespec ts = {0, LOG_FLUSH_MS * 1000000L};
+
+    while (atomic_load(&flusher_state) == 1)
+    {
+        if (log_drain() <= 0) nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+/******************************************************************************
+* subroutine: log_start                                                       *
+* purpose:    start the flusher of this process. Signals stay with the main  *
+*             thread, which relies on them interrupting epoll_wait/sigsuspend *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+static void log_start()
+{
+    int expected = 0;
+    sigset_t all, orig;
+
+    if (!atomic_compare_exchange_strong(&flusher_state, &expected, 1))
+        return;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &orig);
+    if (pthread_create(&flusher, NULL, log_flusher, NULL) != 0)
+        atomic_store(&flusher_state, 0);  // messages wait for log_close
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+}
+
+FILE *log_open(const char *path, const char *mode)
 {
     FILE *logfile;
 
-    logfile = fopen(path, "w");
+    logfile = fopen(path, mode);
     if ( logfile == NULL )
     {
         fprintf(stdout, "Error opening logfile. \n");
         exit(EXIT_FAILURE);
     }
 
-    // set logfile to line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    // worker processes share this descriptor, append so lines don't overlap
+    fcntl(fileno(logfile), F_SETFL, O_APPEND);
+
+    ring = (log_slot *)malloc(LOG_SLOTS * sizeof(log_slot));
+    ring_reset();
+
+    // threads don't survive fork, a child starts its own flusher on demand
+    pthread_atfork(NULL, NULL, ring_reset);
+    atexit(log_close);
 
     return logfile;
 }
 
-void Log(const char *format, ...)
+/******************************************************************************
+* subroutine: log_reopen                                                      *
+* purpose:    switch to a new file at the log path, once log rotation has    *
+*             moved the old one away. What is in the ring still goes to the   *
+*             old file                                                        *
+* parameters: path - the log file                                             *
+* return:     0 on success, -1 if it can't be opened and the old one is kept  *
+******************************************************************************/
+int log_reopen(const char *path)
+{
+    FILE *logfile, *old;
+
+    if (ring == NULL || (logfile = fopen(path, "a")) == NULL) return -1;
+
+    log_drain();
+    pthread_mutex_lock(&drain_lock);
+    old = STATE.log;
+    STATE.log = logfile;
+    pthread_mutex_unlock(&drain_lock);
+    fclose(old);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: log_close                                                       *
+* purpose:    stop the flusher and write what is left in the ring. Safe to   *
+*             call more than once                                             *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void log_close()
 {
-    time_t ltime;
-    struct tm *Tm;
+    int expected = 1;
+
+    if (ring == NULL || STATE.log == NULL) return;
 
-    ltime = time(NULL);
-    Tm = localtime(&ltime);
+    if (atomic_compare_exchange_strong(&flusher_state, &expected, 2))
+        pthread_join(flusher, NULL);
+    log_drain();
+}
+
+/******************************************************************************
+* subroutine: log_parse_level                                                 *
+* purpose:    translate a level name given on the command line                *
+* parameters: name - error, warn, info or debug                               *
+* return:     the level, -1 if the name is unknown                            *
+******************************************************************************/
+int log_parse_level(const char *name)
+{
+    int i;
 
-    fprintf(STATE.log, "[%04d%02d%02d %02d:%02d:%02d] ",
-                 Tm->tm_year+1900,
-                 Tm->tm_mon+1,
-                 Tm->tm_mday,
-                 Tm->tm_hour,
-                 Tm->tm_min,
-                 Tm->tm_sec
-           );
+    for (i = LOG_ERROR; i <= LOG_DEBUG; i++)
+        if (!strcasecmp(name, level_names[i])) return i;
+    return -1;
+}
 
+/******************************************************************************
+* subroutine: log_write                                                       *
+* purpose:    format a message into the ring, called through Log() once the  *
+*             level is known to be enabled. Never blocks: if the ring is      *
+*             full the message is counted and dropped                         *
+* parameters: format - printf style format and its arguments                  *
+* return:     none                                                            *
+******************************************************************************/
+void log_write(const char *format, ...)
+{
+    static __thread time_t stamp_time = -1;
+    static __thread char stamp[MIN_LINE];
+    static __thread int stamp_len;
+    size_t pos, seq;
+    log_slot *slot;
+    struct tm tm;
+    time_t now;
     va_list ap;
+    int n;
+
+    if (ring == NULL) return;
+    if (atomic_load_explicit(&flusher_state, memory_order_relaxed) == 0)
+        log_start();
+
+    // claim a slot: the ticket of a free slot equals its sequence number
+    pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    for (;;)
+    {
+        slot = &ring[pos & (LOG_SLOTS - 1)];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring_head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if ((long)(seq - pos) < 0)
+        {
+            atomic_fetch_add(&dropped, 1);
+            return;
+        }
+        else
+            pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    }
+
+    // the timestamp is only formatted again when the second changes
+    now = time(NULL);
+    if (now != stamp_time)
+    {
+        localtime_r(&now, &tm);
+        stamp_len = snprintf(stamp, MIN_LINE, "[%04d%02d%02d %02d:%02d:%02d] ",
+                             tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+                             tm.tm_hour, tm.tm_min, tm.tm_sec);
+        stamp_time = now;
+    }
+    memcpy(slot->msg, stamp, stamp_len);
+
     va_start(ap, format);
-    vfprintf(STATE.log, format, ap);
+    n = vsnprintf(slot->msg + stamp_len, LOG_LINE - stamp_len, format, ap);
+    va_end(ap);
+
+    if (n < 0) n = 0;
+    slot->len = stamp_len + n;
+    if (slot->len >= LOG_LINE)          // truncated, keep the line ending
+    {
+        slot->len = LOG_LINE - 1;
+        slot->msg[LOG_LINE - 2] = '\n';
+    }
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
 }
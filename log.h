@@ -3,9 +3,34 @@
 
 #include <time.h>
 #include <stdarg.h>
+#include <fcntl.h>
 #include "params.h"
 
-FILE *log_open(const char *path);
-void Log(const char *format, ...);
+/* log levels, a message is kept if its level is at most the current one */
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+/* levels above this one are compiled out, e.g. -DLOG_LEVEL_MAX=LOG_INFO */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_DEBUG
+#endif
+
+/* the level test is done before any argument is evaluated */
+#define Log(level, ...)                                                   \
+    do {                                                                  \
+        if ((level) <= LOG_LEVEL_MAX && (level) <= log_level)             \
+            log_write(__VA_ARGS__);                                       \
+    } while (0)
+
+extern int log_level;
+
+FILE *log_open(const char *path, const char *mode);
+int  log_reopen(const char *path);
+void log_close();
+int  log_parse_level(const char *name);
+void log_write(const char *format, ...)
+    __attribute__ ((format (printf, 1, 2)));
 
 #endif
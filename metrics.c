@@ -0,0 +1,273 @@
+/*
+ * metrics.c
+ *
+ * Description: This file defines the runtime metrics of the Liso server:
+ *              connection and request counters, bytes sent and latency
+ *              histograms of the request stages. The master maps one slot
+ *              per worker in shared memory before forking, every worker
+ *              updates its own slot without locks, and a request for
+ *              METRICS_URI on any worker renders the sum of all slots in
+ *              the Prometheus text format.
+ *
+ */
+#include "metrics.h"
+
+static metrics_slot local;            // used until a slot is attached
+static metrics_slot *slots;
+static int nslots;
+
+metrics_slot *METRICS = &local;
+
+static const char *method_names[MET_METHODS] = {"GET", "HEAD", "POST", "other"};
+static const char *timeout_names[MET_TIMEOUTS] = {"header", "body", "keepalive", "write"};
+static const int codes[MET_CODES - 1] =
+{
+    200, 204, 206, 301, 304, 400, 403, 404, 408, 411,
+    413, 414, 416, 500, 501, 502, 503, 504, 505
+};
+
+/******************************************************************************
+* subroutine: metrics_init                                                    *
+* purpose:    map the metric slots, shared with the workers forked later      *
+* parameters: n - number of slots, one per worker (1 without workers)         *
+* return:     0 on success, -1 on failure                                     *
+******************************************************************************/
+int metrics_init(int n)
+{
+    slots = (metrics_slot *)mmap(NULL, n * sizeof(metrics_slot),
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED)
+    {
+        Log(LOG_ERROR, "Error: failed mapping metrics, metrics disabled \n");
+        slots = NULL;
+        return -1;
+    }
+    nslots = n;
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: metrics_attach                                                  *
+* purpose:    make this process update the slot of a worker. Counters of a   *
+*             restarted worker keep growing; the gauges start over, as the    *
+*             connections and memory it held are gone                         *
+* parameters: id - the worker id                                              *
+* return:     none                                                            *
+******************************************************************************/
+void metrics_attach(int id)
+{
+    if (slots == NULL || id < 0 || id >= nslots) return;
+    METRICS = &slots[id];
+    METRICS->active = 0;
+    METRICS->state_bytes = 0;
+}
+
+/******************************************************************************
+* subroutine: metrics_request                                                 *
+* purpose:    count a response by request method and status code              *
+* parameters: method - the request method, MET_*                              *
+*             code   - the status code                                        *
+* return:     none                                                            *
+******************************************************************************/
+void metrics_request(int method, int code)
+{
+    int m, i;
+
+    m = (method >= 0 && method < MET_METHODS) ? method : MET_OTHER;
+    for (i = 0; i < MET_CODES - 1 && codes[i] != code; i++)
+        ;
+    METRICS->requests[m][i]++;
+}
+
+/******************************************************************************
+* subroutine: hist_record                                                     *
+* purpose:    add a sample to a histogram. The bucket is found from the top  *
+*             three bits of the value, so the error is below 25% over the     *
+*             whole range at the cost of a few instructions                   *
+* parameters: h  - the histogram                                              *
+*             ns - the sample in nanoseconds                                  *
+* return:     none                                                            *
+******************************************************************************/
+void hist_record(histogram *h, uint64_t ns)
+{
+    int e, i;
+
+    if (ns < 1024)
+        i = 0;
+    else
+    {
+        e = 63 - __builtin_clzll(ns);
+        if (e >= 10 + HIST_OCTAVES)
+            i = HIST_BUCKETS - 1;
+        else
+            i = 1 + (e - 10) * 4 + (int)((ns >> (e - 2)) & 3);
+    }
+    h->count[i]++;
+    h->sum_ns += ns;
+}
+
+/******************************************************************************
+* subroutine: hist_bound                                                      *
+* purpose:    upper bound of a histogram bucket                               *
+* parameters: i - the bucket, below HIST_BUCKETS - 1                          *
+* return:     the bound in nanoseconds                                        *
+******************************************************************************/
+static uint64_t hist_bound(int i)
+{
+    if (i == 0) return 1024;
+    return (uint64_t)(5 + (i - 1) % 4) << (10 + (i - 1) / 4 - 2);
+}
+
+/******************************************************************************
+* subroutine: render_hist                                                     *
+* purpose:    render the sum of one histogram of every slot                   *
+* parameters: buf  - output buffer                                            *
+*             size - room left in buf                                         *
+*             name - metric name                                              *
+*             help - metric description                                       *
+*             off  - offset of the histogram in metrics_slot                  *
+* return:     number of bytes written                                         *
+******************************************************************************/
+static int render_hist(char *buf, int size, const char *name,
+                       const char *help, size_t off)
+{
+    int i, k, len;
+    uint64_t cum = 0, sum = 0, n;
+    histogram *h;
+
+    len = snprintf(buf, size, "# HELP %s %s\n# TYPE %s histogram\n",
+                   name, help, name);
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        for (k = 0, n = 0; k < nslots; k++)
+        {
+            h = (histogram *)((char *)&slots[k] + off);
+            n += h->count[i];
+            if (i == 0) sum += h->sum_ns;
+        }
+        cum += n;
+        if (i == HIST_BUCKETS - 1 || len >= size) continue;
+        len += snprintf(buf + len, size - len, "%s_bucket{le=\"%.9g\"} %llu\n",
+                        name, hist_bound(i) / 1e9, (unsigned long long)cum);
+    }
+    if (len < size)
+        len += snprintf(buf + len, size - len,
+                        "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n"
+                        "%s_count %llu\n", name, (unsigned long long)cum,
+                        name, sum / 1e9, name, (unsigned long long)cum);
+    return len;
+}
+
+/******************************************************************************
+* subroutine: metrics_render                                                  *
+* purpose:    render the metrics of all workers in Prometheus text format     *
+* parameters: buf  - output buffer                                            *
+*             size - size of buf                                              *
+* return:     number of bytes written, at most size - 1                       *
+******************************************************************************/
+int metrics_render(char *buf, int size)
+{
+    int i, m, c, len = 0;
+    int64_t active = 0, state = 0;
+    uint64_t accepted = 0, rejected = 0, evicted = 0, bytes = 0, paused = 0, n;
+
+    if (slots == NULL)
+    {
+        slots = &local;   // metrics_init failed, show this process only
+        nslots = 1;
+    }
+
+    for (i = 0; i < nslots; i++)
+    {
+        active += slots[i].active;
+        accepted += slots[i].accepted;
+        rejected += slots[i].rejected;
+        evicted += slots[i].evicted;
+        bytes += slots[i].bytes_sent;
+        paused += slots[i].paused;
+        state += slots[i].state_bytes;
+    }
+
+    len += snprintf(buf + len, size - len,
+        "# HELP lisod_connections_active Client connections currently open.\n"
+        "# TYPE lisod_connections_active gauge\n"
+        "lisod_connections_active %lld\n"
+        "# HELP lisod_connections_accepted_total Client connections accepted.\n"
+        "# TYPE lisod_connections_accepted_total counter\n"
+        "lisod_connections_accepted_total %llu\n"
+        "# HELP lisod_connections_rejected_total Connections refused "
+        "because the server was full, with a 503 while the rate allows.\n"
+        "# TYPE lisod_connections_rejected_total counter\n"
+        "lisod_connections_rejected_total %llu\n"
+        "# HELP lisod_connections_evicted_total Idle keep-alive connections "
+        "closed to make room for new ones.\n"
+        "# TYPE lisod_connections_evicted_total counter\n"
+        "lisod_connections_evicted_total %llu\n"
+        "# HELP lisod_sent_bytes_total Response bytes written to sockets.\n"
+        "# TYPE lisod_sent_bytes_total counter\n"
+        "lisod_sent_bytes_total %llu\n"
+        "# HELP lisod_reads_paused_total Times a client was not read from "
+        "until it took more of its responses.\n"
+        "# TYPE lisod_reads_paused_total counter\n"
+        "lisod_reads_paused_total %llu\n"
+        "# HELP lisod_state_bytes Memory held for connection and request "
+        "state, spares included.\n"
+        "# TYPE lisod_state_bytes gauge\n"
+        "lisod_state_bytes %lld\n",
+        (long long)active, (unsigned long long)accepted,
+        (unsigned long long)rejected, (unsigned long long)evicted,
+        (unsigned long long)bytes, (unsigned long long)paused,
+        (long long)state);
+
+    if (len < size)
+        len += snprintf(buf + len, size - len,
+            "# HELP lisod_timeouts_total Connections closed by a timeout.\n"
+            "# TYPE lisod_timeouts_total counter\n");
+    for (m = 0; m < MET_TIMEOUTS && len < size; m++)
+    {
+        for (i = 0, n = 0; i < nslots; i++)
+            n += slots[i].timeouts[m];
+        len += snprintf(buf + len, size - len,
+                        "lisod_timeouts_total{kind=\"%s\"} %llu\n",
+                        timeout_names[m], (unsigned long long)n);
+    }
+
+    if (len < size)
+        len += snprintf(buf + len, size - len,
+            "# HELP lisod_requests_total Responses by request method and status.\n"
+            "# TYPE lisod_requests_total counter\n");
+    for (m = 0; m < MET_METHODS; m++)
+    {
+        for (c = 0; c < MET_CODES && len < size; c++)
+        {
+            for (i = 0, n = 0; i < nslots; i++)
+                n += slots[i].requests[m][c];
+            if (n == 0) continue;
+
+            if (c < MET_CODES - 1)
+                len += snprintf(buf + len, size - len,
+                                "lisod_requests_total{method=\"%s\",code=\"%d\"} %llu\n",
+                                method_names[m], codes[c], (unsigned long long)n);
+            else
+                len += snprintf(buf + len, size - len,
+                                "lisod_requests_total{method=\"%s\",code=\"other\"} %llu\n",
+                                method_names[m], (unsigned long long)n);
+        }
+    }
+
+    if (len < size)
+        len += render_hist(buf + len, size - len, "lisod_parse_seconds",
+                           "Time spent parsing request lines and headers.",
+                           offsetof(metrics_slot, parse));
+    if (len < size)
+        len += render_hist(buf + len, size - len, "lisod_lookup_seconds",
+                           "Time spent finding the file of a request.",
+                           offsetof(metrics_slot, lookup));
+    if (len < size)
+        len += render_hist(buf + len, size - len, "lisod_send_seconds",
+                           "Time spent in sendmsg/sendfile per flush.",
+                           offsetof(metrics_slot, send));
+
+    return (len < size) ? len : size - 1;
+}
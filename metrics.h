@@ -0,0 +1,68 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "log.h"
+
+#define METRICS_URI "/__lisod/metrics"
+
+/* log-linear histogram buckets: one below 1us, then 4 per power of two up
+ * to ~17s, and one for anything slower */
+#define HIST_OCTAVES 24
+#define HIST_BUCKETS (HIST_OCTAVES * 4 + 2)
+
+/* methods and status codes requests are counted by, the last is 'other' */
+enum { MET_GET, MET_HEAD, MET_POST, MET_OTHER, MET_METHODS };
+#define MET_CODES 20
+
+/* the timeouts connections are closed by */
+enum { MET_HEADER, MET_BODY, MET_KEEPALIVE, MET_WRITE, MET_TIMEOUTS };
+
+/* this data structure wraps a latency histogram in nanoseconds */
+typedef struct
+{
+    uint64_t count[HIST_BUCKETS];
+    uint64_t sum_ns;
+} histogram;
+
+/* this data structure wraps the metrics of one process. Slots live in memory
+ * shared by all workers; each slot is only written by its own worker, so
+ * updates are plain increments, and a scrape sums every slot */
+typedef struct
+{
+    int64_t  active;             // open client connections
+    uint64_t accepted;           // connections accepted
+    uint64_t rejected;           // connections answered 503 at accept
+    uint64_t evicted;            // idle connections closed to admit new ones
+    uint64_t bytes_sent;         // response bytes written to sockets
+    uint64_t paused;             // reads stopped by a backed up response queue
+    int64_t  state_bytes;        // connection and request state allocated
+    uint64_t timeouts[MET_TIMEOUTS]; // connections closed by each timeout
+    uint64_t requests[MET_METHODS][MET_CODES];
+    histogram parse;             // request line and headers
+    histogram lookup;            // cache lookup or stat of the file
+    histogram send;              // sendmsg/sendfile calls of a flush
+} __attribute__ ((aligned(64))) metrics_slot;
+
+extern metrics_slot *METRICS;
+
+int  metrics_init(int nslots);
+void metrics_attach(int id);
+void metrics_request(int method, int code);
+void hist_record(histogram *h, uint64_t ns);
+int  metrics_render(char *buf, int size);
+
+/* monotonic clock in nanoseconds, used to time the stages */
+static inline uint64_t metrics_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif
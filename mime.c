@@ -0,0 +1,207 @@
+/*
+ * mime.c
+ *
+ * Description: This file defines the MIME types of the Liso server, found
+ *              from the last extension of a file name. The extensions are
+ *              placed at startup in a table with a seed under which no two
+ *              of them share a slot, so a lookup is one hash of the
+ *              extension and one string compare.
+ *
+ */
+#include "mime.h"
+
+typedef struct
+{
+    const char *ext;
+    const char *type;
+} mime_entry;
+
+static const mime_entry types[] =
+{
+    { "html", "text/html" }, { "htm", "text/html" }, { "shtml", "text/html" },
+    { "css", "text/css" },
+    { "xml", "text/xml" },
+    { "txt", "text/plain" }, { "text", "text/plain" }, { "log", "text/plain" },
+    { "conf", "text/plain" }, { "ini", "text/plain" },
+    { "md", "text/markdown" }, { "markdown", "text/markdown" },
+    { "csv", "text/csv" },
+    { "tsv", "text/tab-separated-values" },
+    { "ics", "text/calendar" },
+    { "mml", "text/mathml" },
+    { "yaml", "text/yaml" }, { "yml", "text/yaml" },
+    { "jad", "text/vnd.sun.j2me.app-descriptor" },
+    { "wml", "text/vnd.wap.wml" },
+    { "htc", "text/x-component" },
+
+    { "js", "application/javascript" }, { "mjs", "application/javascript" },
+    { "json", "application/json" }, { "map", "application/json" },
+    { "jsonld", "application/ld+json" },
+    { "webmanifest", "application/manifest+json" },
+    { "atom", "application/atom+xml" },
+    { "rss", "application/rss+xml" },
+    { "xhtml", "application/xhtml+xml" },
+    { "xspf", "application/xspf+xml" },
+    { "kml", "application/vnd.google-earth.kml+xml" },
+    { "kmz", "application/vnd.google-earth.kmz" },
+    { "wasm", "application/wasm" },
+    { "pdf", "application/pdf" },
+    { "ps", "application/postscript" }, { "eps", "application/postscript" },
+    { "ai", "application/postscript" },
+    { "rtf", "application/rtf" },
+    { "doc", "application/msword" },
+    { "xls", "application/vnd.ms-excel" },
+    { "ppt", "application/vnd.ms-powerpoint" },
+    { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+    { "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+    { "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+    { "odt", "application/vnd.oasis.opendocument.text" },
+    { "ods", "application/vnd.oasis.opendocument.spreadsheet" },
+    { "odp", "application/vnd.oasis.opendocument.presentation" },
+    { "m3u8", "application/vnd.apple.mpegurl" },
+    { "apk", "application/vnd.android.package-archive" },
+    { "eot", "application/vnd.ms-fontobject" },
+    { "jar", "application/java-archive" }, { "war", "application/java-archive" },
+    { "ear", "application/java-archive" },
+    { "jnlp", "application/x-java-jnlp-file" },
+    { "hqx", "application/mac-binhex40" },
+    { "zip", "application/zip" },
+    { "gz", "application/gzip" }, { "tgz", "application/gzip" },
+    { "bz2", "application/x-bzip2" },
+    { "xz", "application/x-xz" },
+    { "zst", "application/zstd" },
+    { "tar", "application/x-tar" },
+    { "7z", "application/x-7z-compressed" },
+    { "rar", "application/x-rar-compressed" },
+    { "rpm", "application/x-redhat-package-manager" },
+    { "xpi", "application/x-xpinstall" },
+    { "swf", "application/x-shockwave-flash" },
+    { "sh", "application/x-sh" },
+    { "pl", "application/x-perl" }, { "pm", "application/x-perl" },
+    { "tcl", "application/x-tcl" }, { "tk", "application/x-tcl" },
+    { "run", "application/x-makeself" },
+    { "sql", "application/sql" },
+    { "der", "application/x-x509-ca-cert" }, { "pem", "application/x-x509-ca-cert" },
+    { "crt", "application/x-x509-ca-cert" },
+    { "bin", "application/octet-stream" }, { "exe", "application/octet-stream" },
+    { "dll", "application/octet-stream" }, { "deb", "application/octet-stream" },
+    { "dmg", "application/octet-stream" }, { "iso", "application/octet-stream" },
+    { "img", "application/octet-stream" }, { "msi", "application/octet-stream" },
+    { "msp", "application/octet-stream" }, { "msm", "application/octet-stream" },
+
+    { "gif", "image/gif" },
+    { "jpeg", "image/jpeg" }, { "jpg", "image/jpeg" },
+    { "png", "image/png" },
+    { "webp", "image/webp" },
+    { "avif", "image/avif" },
+    { "svg", "image/svg+xml" }, { "svgz", "image/svg+xml" },
+    { "ico", "image/x-icon" },
+    { "bmp", "image/bmp" },
+    { "tif", "image/tiff" }, { "tiff", "image/tiff" },
+    { "wbmp", "image/vnd.wap.wbmp" },
+    { "jng", "image/x-jng" },
+
+    { "woff", "font/woff" }, { "woff2", "font/woff2" },
+    { "ttf", "font/ttf" }, { "otf", "font/otf" },
+
+    { "mid", "audio/midi" }, { "midi", "audio/midi" }, { "kar", "audio/midi" },
+    { "mp3", "audio/mpeg" },
+    { "ogg", "audio/ogg" }, { "oga", "audio/ogg" }, { "opus", "audio/ogg" },
+    { "m4a", "audio/mp4" },
+    { "aac", "audio/aac" },
+    { "flac", "audio/flac" },
+    { "wav", "audio/wav" },
+    { "weba", "audio/webm" },
+    { "ra", "audio/x-realaudio" },
+
+    { "mp4", "video/mp4" },
+    { "m4v", "video/x-m4v" },
+    { "webm", "video/webm" },
+    { "ogv", "video/ogg" },
+    { "mpeg", "video/mpeg" }, { "mpg", "video/mpeg" },
+    { "mov", "video/quicktime" },
+    { "3gpp", "video/3gpp" }, { "3gp", "video/3gpp" },
+    { "ts", "video/mp2t" },
+    { "flv", "video/x-flv" },
+    { "mng", "video/x-mng" },
+    { "asx", "video/x-ms-asf" }, { "asf", "video/x-ms-asf" },
+    { "wmv", "video/x-ms-wmv" },
+    { "avi", "video/x-msvideo" },
+};
+
+#define MIME_TYPES ((int)(sizeof(types) / sizeof(types[0])))
+
+// a sparse table keeps the search for a seed short
+_Static_assert(MIME_TYPES * 4 <= MIME_SLOTS, "MIME_SLOTS too small for the types");
+
+static uint16_t slots[MIME_SLOTS];        // index into types + 1, 0 if empty
+static uint32_t seed;
+
+/******************************************************************************
+* subroutine: hash_ext                                                        *
+* purpose:    seeded FNV-1a hash of an extension, ignoring case               *
+* parameters: ext - the extension, without its dot                            *
+*             s   - the seed                                                  *
+* return:     the slot of the extension                                       *
+******************************************************************************/
+static unsigned int hash_ext(const char *ext, uint32_t s)
+{
+    uint32_t h = 2166136261u ^ s;
+
+    while (*ext)
+    {
+        h ^= (unsigned char)(*ext++ | 0x20);   // digits don't mind the bit
+        h *= 16777619u;
+    }
+
+    // the low bits pick the slot, so fold the high ones into them
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    return h & (MIME_SLOTS - 1);
+}
+
+/******************************************************************************
+* subroutine: mime_init                                                       *
+* purpose:    find a seed under which every extension gets a slot of its own, *
+*             and fill the table. Called once, before the workers fork        *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void mime_init()
+{
+    int i;
+    unsigned int h;
+
+    for (seed = 0; ; seed++)
+    {
+        memset(slots, 0, sizeof(slots));
+        for (i = 0; i < MIME_TYPES; i++)
+        {
+            h = hash_ext(types[i].ext, seed);
+            if (slots[h]) break;
+            slots[h] = i + 1;
+        }
+        if (i == MIME_TYPES) break;
+    }
+    Log(LOG_DEBUG, "Debug: %d MIME types placed with seed %u \n", MIME_TYPES, seed);
+}
+
+/******************************************************************************
+* subroutine: mime_type                                                       *
+* purpose:    find the MIME type of a file from its last extension            *
+* parameters: path - the file name                                            *
+* return:     the type, MIME_DEFAULT if the extension is unknown              *
+******************************************************************************/
+const char *mime_type(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    int i;
+
+    // no extension, or a dot of a directory name
+    if (dot == NULL || strchr(dot, '/') || strlen(dot + 1) > MIME_EXT_MAX)
+        return MIME_DEFAULT;
+
+    i = slots[hash_ext(dot + 1, seed)];
+    if (i && !strcasecmp(types[i - 1].ext, dot + 1)) return types[i - 1].type;
+    return MIME_DEFAULT;
+}
@@ -0,0 +1,16 @@
+#ifndef _MIME_H_
+#define _MIME_H_
+
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include "log.h"
+
+#define MIME_SLOTS   4096          // slots of the hash table, power of two
+#define MIME_EXT_MAX 16            // longer extensions are not looked up
+#define MIME_DEFAULT "application/octet-stream"  // type of unknown extensions
+
+void mime_init();
+const char *mime_type(const char *path);
+
+#endif
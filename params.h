@@ -7,24 +7,80 @@
 #define MIN_LINE 64
 #define MAX_NAME 256
 #define MAX_CONN 1024
+#define MAX_EVENTS 1024
+#define MAX_FDS (1 << 16) // descriptor limit and client table size
+#define FD_RESERVE 16  // log, lock, listeners, epoll, inotify, spare and open files
+#define MAX_WORKERS 256
+#define ACCEPT_BATCH 64   // connections accepted per listener and wakeup
+#define REJECT_RATE 64    // 503s sent per second while full, --reject-rate
+#define EVICT_IDLE 1      // seconds a keep-alive client idles before it may be evicted
+#define DRAIN_IDLE 1      // and before it is closed by a draining server
+
+#define CACHE_MAX_BYTES   (64 << 20)  // file content held by the cache
+#define CACHE_MAX_ENTRIES 4096
+#define CACHE_MAX_FILE    (256 << 10) // larger files go through sendfile
+#define TREE_MAX_NODES (1 << 16)    // larger www trees are not indexed
+#define GZIP_LEVEL     6      // compression of cached text, once per file
+#define BROTLI_QUALITY 5
 #define BUF_SIZE 4096
 #define MAX_PATH 4096
 #define MAX_LINE 8192
 
+#define PARSE_AGAIN 1     // parser needs more bytes from the client
+#define SEND_AGAIN 1      // socket buffer is full, resume on EPOLLOUT
+#define OUT_IOV 32        // memory segments queued per connection
+#define OUT_RESERVE 1024  // obuf room kept for the headers of one response
+#define OUT_HIGH_WATER (256 << 10)  // queued response bytes which stop reading
+#define OUT_LOW_WATER  (64 << 10)   // and the level they resume at
+#define SLAB_KEEP 256     // spare buffers kept per size class
+
+#define METRICS_BUF (64 << 10)  // rendered metrics page
+#define MAX_BODY (1LL << 30)    // default limit of a request body, --max-body
+#define MAX_RANGES 8            // byte ranges served in one response, more are ignored
+#define COND_TAGS 4             // If-None-Match tags compared
+
+#define TIMER_TICK_MS 1000      // resolution of timeouts, and longest epoll wait
+#define HEADER_TIMEOUT 20       // seconds to receive a request head, --header-timeout
+#define BODY_TIMEOUT 60         // seconds a request body may pause, --body-timeout
+#define KEEPALIVE_TIMEOUT 15    // seconds an idle connection is kept, --keepalive-timeout
+#define WRITE_TIMEOUT 60        // seconds a response may stall, --write-timeout
+#define MAX_TIMEOUT 86400       // longest timeout accepted
+
+#define CGI_PREFIX "/cgi-bin"   // URIs under it run a CGI program
+#define CGI_ENV (2 * MAX_LINE)  // environment of one CGI request
+#define CGI_HEADER BUF_SIZE     // longest header block a CGI may return
+#define CGI_CHUNK 16384         // CGI output read per chunk, at most 0xffff
+#define CGI_MAX_APPS 64         // persistent FastCGI processes
+
+#define LOG_SLOTS 4096    // messages the log ring holds, power of two
+#define LOG_LINE 256      // longest message, longer ones are truncated
+#define LOG_FLUSH_MS 50   // how often the flusher drains the ring
+
 struct lisod_state
 {
     FILE* log;
     int  is_full;
+    int  workers;     // number of worker processes, 0 runs a single process
+    int  worker_id;
     int  port;
     int  s_port;
     int  sock;
     int  s_sock;
+    int  listen_fd[MAX_WORKERS][2];  // HTTP and HTTPS listeners of each worker
+    int  ino_fd;      // inotify descriptor of the file cache and www index
+    struct ssl_ctx_st *tls_ctx;  // TLS context of the HTTPS port, or NULL
+    int  fastcgi;     // persistent FastCGI processes, 0 forks a CGI per request
+    long long max_body;  // largest request body accepted
+    int  timeouts[4];    // seconds, indexed by TIMEOUT_*, 0 never times out
+    int  reject_rate;    // 503s sent per second while the pool is full
     char log_path[MAX_PATH];
     char lck_path[MAX_PATH];
     char www_path[MAX_PATH];
+    int  www_len;
     char cgi_path[MAX_PATH];
     char key_path[MAX_PATH];
     char ctf_path[MAX_PATH];
+    char **argv;      // command line, run again by a binary upgrade
 };
 
 extern struct lisod_state STATE;
@@ -0,0 +1,91 @@
+/*
+ * slab.c
+ *
+ * Description: This file defines the size-classed allocator of the Liso
+ *              server for connection and request state. Freed objects are
+ *              kept on a per-class free list and handed out again, so the
+ *              steady state does no malloc; a bounded number of spares is
+ *              kept, the rest is returned, and idle connections hold none.
+ *
+ */
+#include "slab.h"
+
+/* a free object holds the link to the next one */
+typedef struct slab_obj
+{
+    struct slab_obj *next;
+} slab_obj;
+
+/* this data structure wraps one size class */
+typedef struct
+{
+    size_t    size;       // bytes of an object
+    int       keep;       // free objects kept for reuse at most
+    int       nfree;      // objects on the free list
+    slab_obj *free;       // free list, most recently freed first
+} slab_class;
+
+static slab_class classes[SLAB_CLASSES];
+
+/******************************************************************************
+* subroutine: slab_init                                                       *
+* purpose:    set up a size class                                             *
+* parameters: cls  - the class                                                *
+*             size - bytes of an object                                       *
+*             keep - free objects kept for reuse at most                      *
+* return:     none                                                            *
+******************************************************************************/
+void slab_init(int cls, size_t size, int keep)
+{
+    classes[cls].size = (size < sizeof(slab_obj)) ? sizeof(slab_obj) : size;
+    classes[cls].keep = keep;
+}
+
+/******************************************************************************
+* subroutine: slab_alloc                                                      *
+* purpose:    get an object of a class, the most recently freed if any (its  *
+*             memory is likely still cached). The content is undefined        *
+* parameters: cls - the class                                                 *
+* return:     the object, NULL if out of memory                               *
+******************************************************************************/
+void *slab_alloc(int cls)
+{
+    slab_class *sc = &classes[cls];
+    slab_obj *obj = sc->free;
+
+    if (obj != NULL)
+    {
+        sc->free = obj->next;
+        sc->nfree--;
+        return obj;
+    }
+
+    if ((obj = (slab_obj *)malloc(sc->size)) != NULL)
+        METRICS->state_bytes += sc->size;
+    return obj;
+}
+
+/******************************************************************************
+* subroutine: slab_free                                                       *
+* purpose:    give an object back to its class. It is kept for reuse while    *
+*             the class has fewer than keep spares, otherwise freed           *
+* parameters: cls - the class                                                 *
+*             obj - the object, may be NULL                                   *
+* return:     none                                                            *
+******************************************************************************/
+void slab_free(int cls, void *obj)
+{
+    slab_class *sc = &classes[cls];
+
+    if (obj == NULL) return;
+
+    if (sc->nfree >= sc->keep)
+    {
+        free(obj);
+        METRICS->state_bytes -= sc->size;
+        return;
+    }
+    ((slab_obj *)obj)->next = sc->free;
+    sc->free = (slab_obj *)obj;
+    sc->nfree++;
+}
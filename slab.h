@@ -0,0 +1,29 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+#include "log.h"
+#include "metrics.h"
+
+/* size classes of the state kept per connection and per request. Objects of
+ * a class are recycled through a free list, so a warmed up server serves
+ * requests without calling malloc; spares beyond SLAB_KEEP go back to it, so
+ * memory follows the live connections */
+enum
+{
+    SLAB_RIO,        // read buffer of a client
+    SLAB_OUT,        // output buffer of a client
+    SLAB_CONTEXT,    // a request being parsed
+    SLAB_PATH,       // resolved path of a static file
+    SLAB_COND,       // validators and ranges of a conditional or partial GET
+    SLAB_ENV,        // environment of a CGI request
+    SLAB_CGI,        // a running CGI request
+    SLAB_CHUNK,      // CGI output of a client being sent, one chunk at a time
+    SLAB_CLASSES
+};
+
+void  slab_init(int cls, size_t size, int keep);
+void *slab_alloc(int cls);
+void  slab_free(int cls, void *obj);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * timer.c
+ *
+ * Description: This file defines the timer wheel of the Liso server. Every
+ *              connection has one timer, re-armed whenever it moves to a
+ *              state with another deadline; the event loop runs the wheel
+ *              once per wakeup, so expiring timers costs nothing while none
+ *              are due, however many are armed.
+ *
+ */
+#include "timer.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_SPAN(level) (1ull << (TIMER_BITS * (level)))  // ticks of a slot
+
+static timer_node wheel[TIMER_LEVELS][TIMER_SLOTS];  // slot list heads
+static uint64_t now;        // next tick to run
+static uint64_t start;      // clock at tick 0, in ns
+static uint64_t tick_ns;
+static unsigned int tick_ms;
+
+/* link a timer at the tail of a list */
+static void timer_link(timer_node *head, timer_node *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/* move the timers of a list to an empty one */
+static void timer_splice(timer_node *from, timer_node *to)
+{
+    to->next = to->prev = to;
+    if (from->next == from) return;
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    from->next = from->prev = from;
+}
+
+/******************************************************************************
+* subroutine: timer_place                                                     *
+* purpose:    put a timer in the slot which covers its expiry: the lowest     *
+*             level whose span reaches it. Expiries beyond the top level are  *
+*             clamped to the last tick it can hold                            *
+* parameters: t - the timer, not linked                                       *
+* return:     none                                                            *
+******************************************************************************/
+static void timer_place(timer_node *t)
+{
+    int level;
+    uint64_t delta;
+
+    if (t->expires < now) t->expires = now;
+    delta = t->expires - now;
+    if (delta >= TIMER_SPAN(TIMER_LEVELS))
+        t->expires = now + TIMER_SPAN(TIMER_LEVELS) - 1;
+
+    for (level = 0; level < TIMER_LEVELS - 1; level++)
+        if (delta < TIMER_SPAN(level + 1)) break;
+
+    timer_link(&wheel[level][(t->expires >> (TIMER_BITS * level)) & TIMER_MASK], t);
+}
+
+/******************************************************************************
+* subroutine: timer_cascade                                                   *
+* purpose:    move the timers of the slot of a level which starts at the     *
+*             current tick to the levels below                                *
+* parameters: level - the level, 1 or above                                   *
+* return:     index of the slot, 0 when the level above is due as well        *
+******************************************************************************/
+static int timer_cascade(int level)
+{
+    int idx = (now >> (TIMER_BITS * level)) & TIMER_MASK;
+    timer_node list, *t;
+
+    timer_splice(&wheel[level][idx], &list);
+    while ((t = list.next) != &list)
+    {
+        list.next = t->next;
+        t->next->prev = &list;
+        timer_place(t);
+    }
+    return idx;
+}
+
+/******************************************************************************
+* subroutine: timer_init                                                      *
+* purpose:    start an empty wheel at the current time                        *
+* parameters: ms - length of a tick in milliseconds                           *
+* return:     none                                                            *
+******************************************************************************/
+void timer_init(int ms)
+{
+    int level, i;
+
+    for (level = 0; level < TIMER_LEVELS; level++)
+        for (i = 0; i < TIMER_SLOTS; i++)
+            wheel[level][i].next = wheel[level][i].prev = &wheel[level][i];
+
+    tick_ms = ms;
+    tick_ns = (uint64_t)ms * 1000000;
+    start = metrics_now();
+    now = 0;
+}
+
+/******************************************************************************
+* subroutine: timer_set                                                       *
+* purpose:    arm a timer, or re-arm it if it is pending. It fires on the     *
+*             first run of the wheel at least ms after the last run           *
+* parameters: t  - the timer                                                  *
+*             ms - the timeout in milliseconds                                *
+* return:     none                                                            *
+******************************************************************************/
+void timer_set(timer_node *t, unsigned int ms)
+{
+    timer_del(t);
+    t->expires = now + (ms + tick_ms - 1) / tick_ms;
+    timer_place(t);
+}
+
+/******************************************************************************
+* subroutine: timer_del                                                       *
+* purpose:    disarm a timer, nothing happens if it is not pending            *
+* parameters: t - the timer                                                   *
+* return:     none                                                            *
+******************************************************************************/
+void timer_del(timer_node *t)
+{
+    if (t->next == NULL) return;
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/******************************************************************************
+* subroutine: timer_run                                                       *
+* purpose:    run the ticks which have passed since the last run, and fire    *
+*             the timers due. A fired timer is disarmed before its callback,  *
+*             which may re-arm it or disarm others                            *
+* parameters: fire - callback of an expired timer                             *
+*             arg  - passed to fire                                           *
+* return:     none                                                            *
+******************************************************************************/
+void timer_run(void (*fire)(timer_node *t, void *arg), void *arg)
+{
+    int level;
+    uint64_t current = (metrics_now() - start) / tick_ns;
+    timer_node list, *t;
+
+    while (now <= current)
+    {
+        // at the start of a level 0 round, the next slot above comes down
+        if ((now & TIMER_MASK) == 0)
+            for (level = 1; level < TIMER_LEVELS; level++)
+                if (timer_cascade(level) != 0) break;
+
+        timer_splice(&wheel[0][now & TIMER_MASK], &list);
+        now++;
+        while ((t = list.next) != &list)
+        {
+            timer_del(t);
+            fire(t, arg);
+        }
+    }
+}
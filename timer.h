@@ -0,0 +1,32 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "metrics.h"
+
+/* a hierarchical timer wheel with TIMER_LEVELS levels of TIMER_SLOTS slots.
+ * A slot of level 0 spans one tick, a slot of level n spans TIMER_SLOTS^n
+ * ticks; timers move down a level when the slot above them comes due. So
+ * adding, re-arming and removing a timer are O(1), and a tick which expires
+ * nothing only looks at one empty slot */
+#define TIMER_BITS   6
+#define TIMER_SLOTS  (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+
+/* this data structure is a timer, embedded in the object it times out */
+typedef struct timer_node
+{
+    struct timer_node *next;    // neighbours in the slot, NULL if not armed
+    struct timer_node *prev;
+    uint64_t expires;           // tick the timer is due at
+} timer_node;
+
+void timer_init(int tick_ms);
+void timer_set(timer_node *t, unsigned int ms);
+void timer_del(timer_node *t);
+void timer_run(void (*fire)(timer_node *t, void *arg), void *arg);
+
+#define timer_pending(t) ((t)->next != NULL)
+
+#endif
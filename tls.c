@@ -0,0 +1,308 @@
+/*
+ * tls.c
+ *
+ * Description: This file defines the TLS layer of the Liso server on top of
+ *              OpenSSL. Connections on the HTTPS port get an SSL object which
+ *              is driven without blocking from the epoll loop: the handshake
+ *              and every read or write return to the loop when the socket
+ *              would block, and resume on the next edge. The session ticket
+ *              keys are picked before the workers are forked, so all of them
+ *              share them and any worker can resume a session, also with a
+ *              context created on reload.
+ *              When the kernel supports kTLS, records are encrypted in the
+ *              kernel and file bodies go out with SSL_sendfile().
+ *
+ */
+#include "tls.h"
+
+static unsigned char stage[TLS_RECORD];   // plaintext of the record being written
+static unsigned char ticket_keys[80];     // key name, HMAC and AES key of tickets
+static int have_keys;
+
+/******************************************************************************
+* subroutine: select_alpn                                                     *
+* purpose:    ALPN callback, the server only speaks http/1.1                  *
+* parameters: see SSL_CTX_set_alpn_select_cb                                  *
+* return:     SSL_TLSEXT_ERR_OK, or NOACK to go on without ALPN               *
+******************************************************************************/
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *arg)
+{
+    static const unsigned char protos[] = "\x08http/1.1";
+
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos,
+                              sizeof(protos) - 1, in, inlen)
+        != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/******************************************************************************
+* subroutine: tls_init                                                        *
+* purpose:    create the server context from a private key and certificate.   *
+*             The first call, in the master, picks the session ticket keys;  *
+*             a context a worker creates on reload gets the same ones         *
+* parameters: key_path  - PEM private key                                     *
+*             cert_path - PEM certificate (chain)                             *
+* return:     the context, NULL if TLS cannot be served                       *
+******************************************************************************/
+SSL_CTX *tls_init(const char *key_path, const char *cert_path)
+{
+    SSL_CTX *ctx;
+    static const unsigned char sid_ctx[] = "lisod";
+
+    if (!have_keys)
+        have_keys = (RAND_bytes(ticket_keys, sizeof(ticket_keys)) == 1);
+
+    if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL)
+        return NULL;
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        Log(LOG_ERROR, "Error: failed loading key %s / certificate %s, "
+            "HTTPS disabled \n", key_path, cert_path);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    // resumption: stateless tickets, plus a session cache for old clients
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, 20480);
+    SSL_CTX_set_timeout(ctx, 3600);
+    if (have_keys)
+        SSL_CTX_set_tlsext_ticket_keys(ctx, ticket_keys, sizeof(ticket_keys));
+
+    // writes are resumed from the output queue, which may have moved or
+    // grown in between; idle connections give their buffers back
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION |
+                             SSL_OP_CIPHER_SERVER_PREFERENCE
+#ifdef SSL_OP_ENABLE_KTLS
+                             | SSL_OP_ENABLE_KTLS
+#endif
+                        );
+
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+    return ctx;
+}
+
+/******************************************************************************
+* subroutine: tls_reload                                                      *
+* purpose:    load a renewed key and certificate into the server context.    *
+*             The pair is checked in a scratch context first, so bad files    *
+*             leave the current one serving. Connections made before keep     *
+*             the certificate they were made with, and as the context stays,  *
+*             so do the session ticket keys the workers share                 *
+* parameters: ctx       - the server context                                  *
+*             key_path  - PEM private key                                     *
+*             cert_path - PEM certificate (chain)                             *
+* return:     0 on success, -1 if the current key and certificate are kept   *
+******************************************************************************/
+int tls_reload(SSL_CTX *ctx, const char *key_path, const char *cert_path)
+{
+    SSL_CTX *check;
+    int ok;
+
+    if ((check = SSL_CTX_new(TLS_server_method())) == NULL) return -1;
+    ok = SSL_CTX_use_certificate_chain_file(check, cert_path) == 1 &&
+         SSL_CTX_use_PrivateKey_file(check, key_path, SSL_FILETYPE_PEM) == 1 &&
+         SSL_CTX_check_private_key(check) == 1;
+    SSL_CTX_free(check);
+
+    if (!ok || SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM) != 1)
+    {
+        Log(LOG_ERROR, "Error: failed loading key %s / certificate %s, "
+            "keeping the current ones \n", key_path, cert_path);
+        return -1;
+    }
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: tls_new                                                         *
+* purpose:    create the TLS state of an accepted connection                  *
+* parameters: ctx - the server context                                        *
+*             fd  - the non-blocking client socket                            *
+* return:     the SSL object, NULL on failure                                 *
+******************************************************************************/
+SSL *tls_new(SSL_CTX *ctx, int fd)
+{
+    SSL *ssl;
+
+    if ((ssl = SSL_new(ctx)) == NULL) return NULL;
+    if (SSL_set_fd(ssl, fd) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+/******************************************************************************
+* subroutine: tls_accept                                                      *
+* purpose:    advance the handshake of a connection                           *
+* parameters: ssl - the connection                                            *
+* return:     0 once established, TLS_AGAIN if it waits for the socket, -1 on *
+*             failure                                                         *
+******************************************************************************/
+int tls_accept(SSL *ssl)
+{
+    int ret;
+
+    ERR_clear_error();
+    if ((ret = SSL_accept(ssl)) == 1)
+    {
+        Log(LOG_DEBUG, "TLS established: %s %s%s%s \n", SSL_get_version(ssl),
+            SSL_get_cipher_name(ssl), SSL_session_reused(ssl) ? ", resumed" : "",
+            BIO_get_ktls_send(SSL_get_wbio(ssl)) ? ", ktls" : "");
+        return 0;
+    }
+
+    switch (SSL_get_error(ssl, ret))
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_AGAIN;
+        default:
+            Log(LOG_INFO, "Info: TLS handshake failed \n");
+            return -1;
+    }
+}
+
+/******************************************************************************
+* subroutine: io_result                                                       *
+* purpose:    map the result of an SSL call to the read()/write() convention  *
+* parameters: ssl - the connection                                            *
+*             ret - what SSL_read/SSL_write returned                          *
+* return:     ret if positive, 0 on a clean close, otherwise -1 with errno    *
+*             EAGAIN when the socket would block                              *
+******************************************************************************/
+static ssize_t io_result(SSL *ssl, int ret)
+{
+    if (ret > 0) return ret;
+
+    switch (SSL_get_error(ssl, ret))
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0) errno = ECONNRESET;
+            return -1;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+/******************************************************************************
+* subroutine: tls_read                                                        *
+* purpose:    read decrypted bytes, like read() on a non-blocking socket      *
+* parameters: ssl - the connection                                            *
+*             buf - where to store the bytes                                  *
+*             len - room in buf                                               *
+* return:     bytes read, 0 on EOF, -1 with errno set on error or EAGAIN      *
+******************************************************************************/
+ssize_t tls_read(SSL *ssl, void *buf, size_t len)
+{
+    ERR_clear_error();
+    return io_result(ssl, SSL_read(ssl, buf, len));
+}
+
+/******************************************************************************
+* subroutine: tls_writev                                                      *
+* purpose:    encrypt queued segments, like writev() on a non-blocking        *
+*             socket. Small segments are gathered into one record. A write    *
+*             which would block must be retried with the same bytes; the      *
+*             caller's queue still starts with them, so gathering it again    *
+*             yields the same record                                          *
+* parameters: ssl    - the connection                                         *
+*             iov    - the segments                                           *
+*             iovcnt - number of segments                                     *
+* return:     bytes written, -1 with errno set on error or EAGAIN             *
+******************************************************************************/
+ssize_t tls_writev(SSL *ssl, const struct iovec *iov, int iovcnt)
+{
+    int i, n;
+    size_t len = 0;
+
+    // a segment of a full record or more is written in place
+    if (iov[0].iov_len >= TLS_RECORD || iovcnt == 1)
+    {
+        ERR_clear_error();
+        return io_result(ssl, SSL_write(ssl, iov[0].iov_base, iov[0].iov_len));
+    }
+
+    for (i = 0; i < iovcnt && len < TLS_RECORD; i++)
+    {
+        n = iov[i].iov_len;
+        if (n > TLS_RECORD - len) n = TLS_RECORD - len;
+        memcpy(stage + len, iov[i].iov_base, n);
+        len += n;
+    }
+
+    ERR_clear_error();
+    return io_result(ssl, SSL_write(ssl, stage, len));
+}
+
+/******************************************************************************
+* subroutine: tls_sendfile                                                    *
+* purpose:    send part of a file, like sendfile() on a non-blocking socket.  *
+*             With kTLS the kernel encrypts straight from the page cache;     *
+*             otherwise one record is read at the offset and encrypted, and   *
+*             a retry reads the same bytes again                              *
+* parameters: ssl    - the connection                                         *
+*             fd     - the file                                               *
+*             offset - file offset, advanced by the bytes sent                *
+*             count  - bytes left to send                                     *
+* return:     bytes sent, -1 with errno set on error or EAGAIN                *
+******************************************************************************/
+ssize_t tls_sendfile(SSL *ssl, int fd, off_t *offset, size_t count)
+{
+    ssize_t n;
+
+    ERR_clear_error();
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+    {
+        n = SSL_sendfile(ssl, fd, *offset, count, 0);
+        if (n <= 0) return io_result(ssl, n);
+    }
+    else
+    {
+        if (count > TLS_RECORD) count = TLS_RECORD;
+        if ((n = pread(fd, stage, count, *offset)) <= 0)
+        {
+            if (n == 0) errno = EIO;   // the file shrank
+            return -1;
+        }
+        if ((n = io_result(ssl, SSL_write(ssl, stage, n))) <= 0) return -1;
+    }
+
+    *offset += n;
+    return n;
+}
+
+/******************************************************************************
+* subroutine: tls_close                                                       *
+* purpose:    send close_notify if the socket takes it and free the state     *
+* parameters: ssl - the connection                                            *
+* return:     none                                                            *
+******************************************************************************/
+void tls_close(SSL *ssl)
+{
+    ERR_clear_error();
+    if (SSL_is_init_finished(ssl)) SSL_shutdown(ssl);
+    SSL_free(ssl);
+}
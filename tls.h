@@ -0,0 +1,26 @@
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include "log.h"
+
+#define TLS_AGAIN 1       // handshake needs more I/O, wait for the next edge
+#define TLS_RECORD 16384  // largest TLS record payload
+
+SSL_CTX *tls_init(const char *key_path, const char *cert_path);
+int  tls_reload(SSL_CTX *ctx, const char *key_path, const char *cert_path);
+SSL *tls_new(SSL_CTX *ctx, int fd);
+int  tls_accept(SSL *ssl);
+ssize_t tls_read(SSL *ssl, void *buf, size_t len);
+ssize_t tls_writev(SSL *ssl, const struct iovec *iov, int iovcnt);
+ssize_t tls_sendfile(SSL *ssl, int fd, off_t *offset, size_t count);
+void tls_close(SSL *ssl);
+
+#endif
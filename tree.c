@@ -0,0 +1,462 @@
+/*
+ * tree.c
+ *
+ * Description: This file defines the index of the www tree of the Liso
+ *              server: every file and directory under the root, with the
+ *              stat fields a response needs, built at startup and kept
+ *              current with an inotify watch on each directory. A static
+ *              request is then found, or known to be missing, without a
+ *              syscall. Symbolic links and special files are only named in
+ *              the index; paths through them are left to stat().
+ *
+ */
+#include "tree.h"
+
+/* the file cache may watch a directory too, so masks are added to */
+#define TREE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                     IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB |              \
+                     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | \
+                     IN_MASK_ADD)
+
+/* this data structure is a file or directory of the tree. The entries of a
+ * directory are linked from it, and every node is also in one hash table,
+ * keyed by its directory and name */
+typedef struct tree_node
+{
+    struct tree_node *hnext;    // next node in the same hash bucket
+    struct tree_node *parent;   // directory holding it, NULL for the root
+    struct tree_node *child;    // first entry of a directory
+    struct tree_node *sibling;  // next entry of the same directory
+    unsigned int hash;          // hash of parent and name
+    int    wd;                  // inotify watch of a directory, else -1
+    mode_t mode;                // 0 for an entry left to stat()
+    ino_t  ino;
+    off_t  size;
+    struct timespec mtime;
+    char   name[];
+} tree_node;
+
+static tree_node  *root;          // NULL while the index is off
+static tree_node **buckets;
+static unsigned int nbuckets;     // power of two
+static int         nodes;
+static int         ino_fd = -1;
+static tree_node **wds;           // directory of each watch descriptor
+static int         wd_size;
+static char        www_root[MAX_PATH];   // the root as configured
+static char        root_path[MAX_PATH];  // and the directory it resolves to
+
+static void tree_free();
+
+/******************************************************************************
+* subroutine: hash_name                                                       *
+* purpose:    FNV-1a hash of a name, mixed with its directory                 *
+* parameters: dir  - the directory                                            *
+*             name - the name, not NUL terminated                             *
+*             len  - the length of name                                       *
+* return:     the hash value                                                  *
+******************************************************************************/
+static unsigned int hash_name(tree_node *dir, const char *name, int len)
+{
+    unsigned int h = 2166136261u ^ (unsigned int)((uintptr_t)dir >> 4);
+
+    while (len-- > 0)
+    {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+/******************************************************************************
+* subroutine: node_find                                                       *
+* purpose:    find an entry of a directory                                    *
+* parameters: dir  - the directory                                            *
+*             name - the name of the entry, not NUL terminated                *
+*             len  - the length of name                                       *
+* return:     the entry, NULL if there is none                                *
+******************************************************************************/
+static tree_node *node_find(tree_node *dir, const char *name, int len)
+{
+    unsigned int h = hash_name(dir, name, len);
+    tree_node *n;
+
+    for (n = buckets[h & (nbuckets - 1)]; n; n = n->hnext)
+        if (n->hash == h && n->parent == dir &&
+            !strncmp(n->name, name, len) && n->name[len] == '\0')
+            return n;
+    return NULL;
+}
+
+/******************************************************************************
+* subroutine: node_add                                                        *
+* purpose:    add an entry to a directory, growing the hash table to keep     *
+*             about one node per bucket                                       *
+* parameters: dir  - the directory, NULL for the root                         *
+*             name - the name of the entry                                    *
+* return:     the entry, with no stat fields yet                              *
+******************************************************************************/
+static tree_node *node_add(tree_node *dir, const char *name)
+{
+    int len = strlen(name);
+    unsigned int i, n;
+    tree_node *e, *next, **grown;
+
+    if (nodes >= (int)nbuckets)
+    {
+        n = nbuckets ? nbuckets * 2 : 1024;
+        grown = (tree_node **)calloc(n, sizeof(tree_node *));
+        for (i = 0; i < nbuckets; i++)
+        {
+            for (e = buckets[i]; e; e = next)
+            {
+                next = e->hnext;
+                e->hnext = grown[e->hash & (n - 1)];
+                grown[e->hash & (n - 1)] = e;
+            }
+        }
+        free(buckets);
+        buckets = grown;
+        nbuckets = n;
+    }
+
+    e = (tree_node *)calloc(1, sizeof(tree_node) + len + 1);
+    memcpy(e->name, name, len + 1);
+    e->wd = -1;
+    e->parent = dir;
+    e->hash = hash_name(dir, name, len);
+    e->hnext = buckets[e->hash & (nbuckets - 1)];
+    buckets[e->hash & (nbuckets - 1)] = e;
+    if (dir)
+    {
+        e->sibling = dir->child;
+        dir->child = e;
+    }
+    nodes++;
+    return e;
+}
+
+/******************************************************************************
+* subroutine: node_remove                                                     *
+* purpose:    remove an entry, with everything below it and their watches     *
+* parameters: e - the entry                                                   *
+* return:     none                                                            *
+******************************************************************************/
+static void node_remove(tree_node *e)
+{
+    tree_node **pp;
+
+    while (e->child) node_remove(e->child);
+
+    for (pp = &buckets[e->hash & (nbuckets - 1)]; *pp != e; pp = &(*pp)->hnext);
+    *pp = e->hnext;
+    if (e->parent)
+    {
+        for (pp = &e->parent->child; *pp != e; pp = &(*pp)->sibling);
+        *pp = e->sibling;
+    }
+    // a watch the file cache shares goes too; its IN_IGNORED makes the
+    // cache drop the files of the directory
+    if (e->wd >= 0)
+    {
+        inotify_rm_watch(ino_fd, e->wd);
+        wds[e->wd] = NULL;
+    }
+    nodes--;
+    free(e);
+}
+
+/******************************************************************************
+* subroutine: node_path                                                       *
+* purpose:    build the filesystem path of an entry                           *
+* parameters: e   - the entry                                                 *
+*             buf - a buffer of MAX_PATH bytes                                *
+* return:     the length of the path, -1 if it is too long                    *
+******************************************************************************/
+static int node_path(tree_node *e, char *buf)
+{
+    int len;
+
+    if (e->parent == NULL)
+        return snprintf(buf, MAX_PATH, "%s", root_path);
+    if ((len = node_path(e->parent, buf)) < 0) return -1;
+    len += snprintf(buf + len, MAX_PATH - len, "/%s", e->name);
+    return (len < MAX_PATH) ? len : -1;
+}
+
+/******************************************************************************
+* subroutine: node_scan                                                       *
+* purpose:    watch a directory and index its entries, and those of the      *
+*             directories below it. The watch comes first, so an entry made  *
+*             during the scan is not missed                                   *
+* parameters: dir  - the directory                                            *
+*             path - its filesystem path, in a buffer of MAX_PATH bytes,     *
+*                    which is used to build the paths below it                *
+*             len  - the length of path                                       *
+* return:     0 on success, -1 if the index can't cover the directory         *
+******************************************************************************/
+static int node_scan(tree_node *dir, char *path, int len)
+{
+    int wd, n, ret = 0;
+    DIR *d;
+    struct dirent *de;
+    struct stat sbuf;
+    tree_node *e;
+
+    if ((wd = inotify_add_watch(ino_fd, path, TREE_EVENTS)) < 0)
+    {
+        Log(LOG_ERROR, "Error: can't watch %s for the www index \n", path);
+        return -1;
+    }
+    if (wd >= wd_size)
+    {
+        n = (wd + 1) * 2;
+        wds = (tree_node **)realloc(wds, n * sizeof(tree_node *));
+        memset(wds + wd_size, 0, (n - wd_size) * sizeof(tree_node *));
+        wd_size = n;
+    }
+    wds[wd] = dir;
+    dir->wd = wd;
+
+    if ((d = opendir(path)) == NULL) return 0;  // unreadable: all of it is missing
+    while (ret == 0 && (de = readdir(d)) != NULL)
+    {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        if (nodes >= TREE_MAX_NODES ||
+            (n = snprintf(path + len, MAX_PATH - len, "/%s", de->d_name)) >= MAX_PATH - len ||
+            lstat(path, &sbuf) < 0)
+        {
+            ret = (nodes >= TREE_MAX_NODES) ? -1 : 0;
+            continue;
+        }
+
+        if ((e = node_find(dir, de->d_name, strlen(de->d_name))) == NULL)
+            e = node_add(dir, de->d_name);
+        if (S_ISREG(sbuf.st_mode) || S_ISDIR(sbuf.st_mode))
+        {
+            e->mode = sbuf.st_mode;
+            e->ino = sbuf.st_ino;
+            e->size = sbuf.st_size;
+            e->mtime = sbuf.st_mtim;
+        }
+        if (S_ISDIR(sbuf.st_mode) && e->wd < 0) ret = node_scan(e, path, len + n);
+    }
+    path[len] = '\0';
+    closedir(d);
+    return ret;
+}
+
+/******************************************************************************
+* subroutine: node_refresh                                                    *
+* purpose:    bring the entry of a name in a directory up to date after an   *
+*             event: add, update or remove it                                 *
+* parameters: dir  - the directory                                            *
+*             name - the name                                                 *
+* return:     0 on success, -1 if the index can't cover it any more           *
+******************************************************************************/
+static int node_refresh(tree_node *dir, const char *name)
+{
+    char path[MAX_PATH];
+    int len;
+    struct stat sbuf;
+    tree_node *e = node_find(dir, name, strlen(name));
+
+    if ((len = node_path(dir, path)) < 0 ||
+        snprintf(path + len, MAX_PATH - len, "/%s", name) >= MAX_PATH - len ||
+        lstat(path, &sbuf) < 0)
+    {
+        if (e) node_remove(e);
+        return 0;
+    }
+
+    // a directory replaced by something else loses what was below it
+    if (e && S_ISDIR(e->mode) && !S_ISDIR(sbuf.st_mode))
+    {
+        node_remove(e);
+        e = NULL;
+    }
+    if (e == NULL)
+    {
+        if (nodes >= TREE_MAX_NODES) return -1;
+        e = node_add(dir, name);
+    }
+
+    e->mode = (S_ISREG(sbuf.st_mode) || S_ISDIR(sbuf.st_mode)) ? sbuf.st_mode : 0;
+    e->ino = sbuf.st_ino;
+    e->size = sbuf.st_size;
+    e->mtime = sbuf.st_mtim;
+    if (S_ISDIR(sbuf.st_mode) && e->wd < 0)
+        return node_scan(e, path, strlen(path));
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: tree_build                                                      *
+* purpose:    index the whole tree. If it has more than TREE_MAX_NODES       *
+*             entries or can't be watched, the index is turned off            *
+* parameters: none                                                            *
+* return:     0 on success, -1 if the index is off                            *
+******************************************************************************/
+static int tree_build()
+{
+    char path[MAX_PATH], *real;
+    struct stat sbuf;
+    int len;
+
+    // inotify follows no link to a directory, so a root given as a link
+    // is indexed and watched where it points to now
+    if ((real = realpath(www_root, NULL)) == NULL)
+    {
+        Log(LOG_ERROR, "Error: www root can't be resolved, files are looked up \n");
+        return -1;
+    }
+    len = snprintf(root_path, MAX_PATH, "%s", real);
+    free(real);
+    if (len >= MAX_PATH || stat(root_path, &sbuf) < 0 || !S_ISDIR(sbuf.st_mode))
+        return -1;
+
+    root = node_add(NULL, "");
+    root->mode = sbuf.st_mode;
+    root->ino = sbuf.st_ino;
+    strcpy(path, root_path);
+    if (node_scan(root, path, strlen(path)) < 0)
+    {
+        Log(LOG_ERROR, "Error: www tree can't be indexed, files are looked up \n");
+        tree_free();
+        return -1;
+    }
+    Log(LOG_INFO, "Info: www index holds %d entries \n", nodes);
+    return 0;
+}
+
+/******************************************************************************
+* subroutine: tree_free                                                       *
+* purpose:    drop the whole index and its watches, turning it off            *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+static void tree_free()
+{
+    if (root) node_remove(root);
+    root = NULL;
+}
+
+/******************************************************************************
+* subroutine: tree_init                                                       *
+* purpose:    build the index, watching its directories with the inotify     *
+*             instance of the process                                         *
+* parameters: path - the www root                                             *
+*             fd   - the inotify instance, shared with the file cache         *
+* return:     0 on success, -1 if the index is off                            *
+******************************************************************************/
+int tree_init(const char *path, int fd)
+{
+    snprintf(www_root, MAX_PATH, "%s", path[0] ? path : "/");
+    ino_fd = fd;
+
+    // without notifications the index would go stale, so look files up
+    if (ino_fd < 0)
+    {
+        Log(LOG_ERROR, "Error: no inotify instance, www index disabled \n");
+        return -1;
+    }
+    return tree_build();
+}
+
+/******************************************************************************
+* subroutine: tree_lookup                                                     *
+* purpose:    find a path in the index                                        *
+* parameters: path - the normalized path, below the www root                  *
+*             sbuf - returns the mode, inode, size and mtime of the entry,    *
+*                    the other fields are 0                                   *
+* return:     TREE_FOUND, TREE_MISSING, or TREE_UNKNOWN if the index is off  *
+*             or the path goes through a link or special file                 *
+******************************************************************************/
+int tree_lookup(const char *path, struct stat *sbuf)
+{
+    tree_node *e = root;
+    const char *end;
+
+    if (root == NULL) return TREE_UNKNOWN;
+
+    for (;;)
+    {
+        while (*path == '/') path++;
+        if (*path == '\0') break;
+        if (!S_ISDIR(e->mode)) return TREE_MISSING;
+
+        if ((end = strchr(path, '/')) == NULL) end = path + strlen(path);
+        if ((e = node_find(e, path, end - path)) == NULL) return TREE_MISSING;
+        if (e->mode == 0) return TREE_UNKNOWN;
+        path = end;
+    }
+
+    memset(sbuf, 0, sizeof(struct stat));
+    sbuf->st_mode = e->mode;
+    sbuf->st_ino = e->ino;
+    sbuf->st_size = e->size;
+    sbuf->st_mtim = e->mtime;
+    return TREE_FOUND;
+}
+
+/******************************************************************************
+* subroutine: tree_event                                                      *
+* purpose:    update the entries an inotify event names. Events of watches   *
+*             the index did not ask for are ignored                           *
+* parameters: ev - the event                                                  *
+* return:     none                                                            *
+******************************************************************************/
+void tree_event(const struct inotify_event *ev)
+{
+    tree_node *dir;
+
+    // events were lost, nothing in the index can be trusted
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        Log(LOG_INFO, "Info: inotify queue overflow, rebuilding www index \n");
+        tree_free();
+        tree_build();
+        return;
+    }
+    if (root == NULL || ev->wd < 0 || ev->wd >= wd_size ||
+        (dir = wds[ev->wd]) == NULL)
+        return;
+
+    // a directory which went away is removed through its parent;
+    // the root going away turns the index off
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+    {
+        if (dir == root)
+        {
+            Log(LOG_ERROR, "Error: www root moved, www index disabled \n");
+            tree_free();
+        }
+        else if (ev->mask & IN_IGNORED)
+        {
+            wds[ev->wd] = NULL;
+            dir->wd = -1;
+        }
+        return;
+    }
+
+    if (ev->len > 0 && node_refresh(dir, ev->name) < 0)
+    {
+        Log(LOG_ERROR, "Error: www tree outgrew its index, files are looked up \n");
+        tree_free();
+    }
+}
+
+/******************************************************************************
+* subroutine: tree_reload                                                     *
+* purpose:    build the index again from the www root, which may now be a    *
+*             different directory or a link to one, and turn it back on if   *
+*             it was off                                                      *
+* parameters: none                                                            *
+* return:     none                                                            *
+******************************************************************************/
+void tree_reload()
+{
+    if (ino_fd < 0) return;
+    tree_free();
+    tree_build();
+}
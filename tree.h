@@ -0,0 +1,26 @@
+#ifndef _TREE_H_
+#define _TREE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "log.h"
+
+/* results of a lookup in the index of the www tree */
+#define TREE_FOUND    1
+#define TREE_MISSING  0
+#define TREE_UNKNOWN -1   // the index can't tell, ask the filesystem
+
+int  tree_init(const char *root, int fd);
+int  tree_lookup(const char *path, struct stat *sbuf);
+void tree_event(const struct inotify_event *ev);
+void tree_reload();
+
+#endif